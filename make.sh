@@ -1,3 +1,5 @@
 #!/bin/sh
-gcc -o isotp-test-pc src/isotp.c src/timer.c test/test.c -I./src -lpthread
-#arm-linux-gnueabihf-gcc -o isotp-test-arm src/isotp.c src/timer.c test/test.c -I./src -lpthread
+gcc -o isotp-test-pc src/isotp.c src/isotp_pool.c src/isotp_ring.c src/isotp_table.c src/isotp_sched.c src/isotp_txq.c src/isotp_gateway.c src/timer.c test/test.c -I./src -lpthread
+#arm-linux-gnueabihf-gcc -o isotp-test-arm src/isotp.c src/isotp_pool.c src/isotp_ring.c src/isotp_table.c src/isotp_sched.c src/isotp_txq.c src/isotp_gateway.c src/timer.c test/test.c -I./src -lpthread
+gcc -o isotp-vcan-pc src/isotp.c src/isotp_pool.c src/isotp_ring.c src/isotp_table.c src/isotp_txq.c src/isotp_socketcan.c src/isotp_reactor.c src/timer.c test/vcan_test.c -I./src
+gcc -o isotp-unit-pc src/isotp.c src/isotp_pool.c src/isotp_ring.c src/isotp_table.c src/isotp_sched.c src/isotp_txq.c src/isotp_gateway.c src/isotp_engine.c src/timer.c test/unit_test.c -I./src -lpthread
@@ -24,7 +24,7 @@ typedef unsigned char   Bool;
 typedef unsigned char   U8;  	/*unsigned 8 bit definition */
 typedef unsigned short  U16; 	/*unsigned 16 bit definition*/
 typedef unsigned int    U32; 	/*unsigned 32 bit definition*/
-typedef unsigned long	U64;		
+typedef unsigned long long U64;	/*unsigned 64 bit definition*/
 typedef signed   char     S8;   	/*signed 8 bit definition */
 typedef signed   short    S16;  	/*signed 16 bit definition*/
 typedef signed   long     S32;  	/*signed 32 bit definition*/
@@ -2,6 +2,8 @@
 #include <stdio.h>
 
 #include "isotp.h"
+#include "isotp_pool.h"
+#include "isotp_txq.h"
 
 /* N_PCI type values in bits 7-4 of N_PCI bytes */
 enum n_pci_type_e
@@ -58,6 +60,26 @@ enum n_pci_type_e
  */
 #define UNUSED_PADDING_VALUE    0xFF
 
+/*
+ * ISO-15765-2:2016-10.4.2.1
+ * CAN FD frames longer than 8 bytes shall be padded up to the next valid CAN_DL
+ */
+#ifdef UNUSED_PADDING_VALUE
+#define CANFD_PADDING_VALUE     UNUSED_PADDING_VALUE
+#else
+#define CANFD_PADDING_VALUE     0xCC
+#endif
+
+/*
+ * Payload capacity of a frame with a data link layer length of dl,
+ * a SF uses the SF_DL escape sequence (2 bytes N_PCI) when dl > 8,
+ * a FF uses the FF_DL escape sequence (6 bytes N_PCI) when len > 4095
+ */
+#define SF_MAX_LEN(dl)      (((dl) > FRAME_DATA_LEN) ? ((dl) - 2UL) : 7UL)
+#define FF_PCI_LEN(len)     (((len) > ISOTP_FF_DL) ? 6UL : 2UL)
+#define FF_DATA_LEN(dl,len) ((dl) - FF_PCI_LEN(len))
+#define CF_DATA_LEN(dl)     ((dl) - 1UL)
+
 /* Timeout values */
 #define TIMEOUT_N_Ar        (100u * 1000u)  /* Timeout between strating send FC and send FC done */
 #define TIMEOUT_N_Br        (100u * 1000u)  /* Timeout between after receive FF/CF and start send FC */
@@ -68,20 +90,51 @@ enum n_pci_type_e
 #define TIMEOUT_N_Cs        (250u * 1000u)  /* Timeout between strating receive CF and receive all CF done */
 
 
-#define MAX_FCWAIT_FRAME    (10UL)
+#define MAX_FCWAIT_FRAME    (10UL)                /* N_WFTmax */
+#define FC_WAIT_PERIOD      (TIMEOUT_N_Br / 2u)   /* a held sender is told again after it */
+#define WAIT_FC_NAP         (100u)                /* longest sleep of a blocking call while a frame may come in */
+
+/* indications noted by the receive path, given by service_notify() */
+#define ISOTP_EVT_UNEXP_PDU (0x01u)     /* a reception was cut by a new SF/FF */
+#define ISOTP_EVT_FF_IND    (0x02u)
+#define ISOTP_EVT_SF_IND    (0x04u)
 
 static void       send_init(struct isotp_t* msg);
-static ERROR_CODE send_fc(struct isotp_t* msg);
+static ERROR_CODE send_fc(struct isotp_t* msg, enum ISOTP_FS_e FS);
+static ERROR_CODE send_rx_fc(struct isotp_t* msg);
+static void       fc_adapt(struct isotp_t* msg, Bool first);
+static U8         stmin_code(U32 us);
 static ERROR_CODE send_sf(struct isotp_t* msg);
 static ERROR_CODE send_ff(struct isotp_t* msg);
 static ERROR_CODE send_cf(struct isotp_t* msg);
-static ERROR_CODE rcv_sf(struct isotp_t* msg);
-static ERROR_CODE rcv_ff(struct isotp_t* msg);
-static ERROR_CODE rcv_cf(struct isotp_t* msg);
-static ERROR_CODE rcv_fc(struct isotp_t* msg);
-static void fc_delay(U8 STmin);
-static ERROR_CODE send_port(struct isotp_msg_t *msg);
+static void       send_next_cf(struct isotp_t* msg);
+static void       send_cf_block(struct isotp_t* msg);
+static void       frame_pad(const struct isotp_t *msg, struct phy_msg_t *frame, U32 used);
+static ERROR_CODE tx_peek(struct isotp_t* msg, U8 *dst, U32 len);
+static ERROR_CODE request_start(struct isotp_t* msg);
+static void       tx_advance(struct isotp_t* msg, U32 len);
+static enum N_Result send_wait(struct isotp_t* msg);
+static ERROR_CODE rcv_frame(struct isotp_t* msg, const struct phy_msg_t *frame);
+static ERROR_CODE rcv_sf(struct isotp_t* msg, const struct phy_msg_t *frame);
+static ERROR_CODE rcv_ff(struct isotp_t* msg, const struct phy_msg_t *frame);
+static ERROR_CODE rcv_cf(struct isotp_t* msg, const struct phy_msg_t *frame);
+static ERROR_CODE rcv_fc(struct isotp_t* msg, const struct phy_msg_t *frame);
+static U32        rcv_cf_run(struct isotp_t* msg, const struct phy_msg_t *frames, U32 n);
+static U32        stmin_us(U8 STmin);
+static U32        tx_gap_us(const struct isotp_t* msg);
+static void       peer_update(struct isotp_t* msg);
+static Bool       peer_hold(struct isotp_t* msg, U32 length);
+static U8         frame_dl(U32 len);
+static U8        *rx_buffer_get(struct isotp_t* msg, U32 length, U32 frame_len);
+static void       rx_stream(struct isotp_t* msg, Bool block_end);
+static void       rx_finish(struct isotp_t* msg);
+static ERROR_CODE send_port(struct isotp_t *msg, U32 used);
+static ERROR_CODE frame_check(const struct isotp_msg_t *msg, const struct phy_msg_t *frame);
 static ERROR_CODE receive_port(struct isotp_msg_t *msg);
+static void       wheel_expired(void *arg);
+static void       wheel_update(struct isotp_t* msg);
+static Bool       tx_state(isotp_states_t state);
+static void       service_notify(struct isotp_t* msg, isotp_states_t before);
 
 /*
  * initialize a message in tp layer
@@ -92,7 +145,8 @@ static ERROR_CODE receive_port(struct isotp_msg_t *msg);
  * ta:        target address
  * fs_set_cb: flow control status control callback
  * send:      send data function in data link layer
- * receive:   receive data function in data link layer
+ * receive:   receive data function in data link layer,
+ *            NULL if frames are pushed in by isotp_on_frame()
  * @parameter out:
  * operation status return
  */
@@ -105,20 +159,47 @@ ERROR_CODE isotp_init(struct isotp_t *msg,
 {
     ERROR_CODE err = STATUS_NORMAL;
 
-    if(msg == NULL || send == NULL || receive == NULL)
+    if(msg == NULL || send == NULL)
     {
         err = ERR_POINTER_0;
     }
     else
     {
         send_init(msg);
+        msg->FS                = ISOTP_FS_CTS;     /* Flow control status */
+        msg->BS                = FC_DEFAULT_BS;    /* block size, setting value */
+        msg->STmin             = 0u;
         msg->tp_state          = ISOTP_IDLE;
         msg->DL                = 0UL;              /* data length */
+        msg->TX_DL             = FRAME_DATA_LEN;
+        msg->RX_DL             = FRAME_DATA_LEN;
         msg->isotp.N_TA        = ta;
         msg->isotp.N_SA        = sa;
         msg->isotp.phy_send    = send;
+        msg->isotp.phy_send_batch = NULL;
         msg->isotp.phy_receive = receive;
+        msg->isotp.txq         = NULL;
+        msg->isotp.tx_class    = ISOTP_TXQ_CLASS_DEFAULT;
         msg->fs_set_cb         = fs_set_cb;
+        msg->fc_adapt          = NULL;
+        msg->peer              = NULL;
+        msg->rx_ctx            = NULL;
+        msg->Buffer            = NULL;
+        msg->rx_buf            = NULL;
+        msg->rx_held           = FALSE;
+        msg->rx_buffer_cb      = NULL;
+        msg->rx_stream_cb      = NULL;
+        msg->rx_stream_buf     = NULL;
+        msg->rx_stream_size    = 0UL;
+        msg->rx_stream_off     = 0UL;
+        msg->tx_iov            = NULL;
+        msg->tx_iovcnt         = 0UL;
+        msg->tx_producer       = NULL;
+        msg->wheel             = NULL;
+        msg->service           = NULL;
+        msg->events            = 0u;
+        msg->rx_active         = FALSE;
+        timer_node_init(&msg->tmo_node, wheel_expired, msg);
     }
 
     return err;
@@ -127,18 +208,16 @@ ERROR_CODE isotp_init(struct isotp_t *msg,
 static void send_init(struct isotp_t* msg)
 {
     msg->SN = ISOTP_DEFAULT_SN;     /* consecutive frame serial number */
-    msg->FS = ISOTP_FS_CTS;         /* Flow control status */
-    msg->BS = FC_DEFAULT_BS;        /* block size, setting value */
-    msg->BS_Counter = FC_DEFAULT_BS;/* block size, setting value */
-    msg->STmin      = 0UL;
+    msg->tx_FS      = ISOTP_FS_CTS; /* the FC settings of the receiver */
+    msg->tx_BS      = 0u;
+    msg->BS_Counter = 0u;
+    msg->tx_STmin   = 0u;
     msg->rest       = 0UL;          /* mutilate frame remaining part */
-    if(msg->DL > ISOTP_FF_DL)
-    {
-        msg->DL = ISOTP_FF_DL;
-    }
-    else
-    {}
+    msg->wait_count = 0u;
+    msg->fc_pending = FALSE;
     msg->buffer_index           = 0UL;
+    msg->tx_iov_idx             = 0UL;
+    msg->tx_iov_off             = 0UL;
     msg->reply                  = N_OK;
     msg->isotp.phy_rx.new_data  = FALSE;
 }
@@ -161,503 +240,2339 @@ ERROR_CODE fc_set(struct isotp_t *msg, enum ISOTP_FS_e FS, U8 BS, U8 STmin)
     return err;
 }
 
-static ERROR_CODE send_port(struct isotp_msg_t *msg)
-{
-    msg->phy_tx.new_data    = TRUE;
-    msg->phy_tx.id          = msg->N_TA;
-    msg->phy_tx.length      = FRAME_DATA_LEN;
-    return msg->phy_send(&msg->phy_tx);
-}
-
-static ERROR_CODE receive_port(struct isotp_msg_t *msg)
+/*
+ * set the transmit data link layer length
+ * 
+ * @parameter in:
+ * msg:   object
+ * TX_DL: 8 for classic CAN, 12/16/20/24/32/48/64 for CAN FD
+ * @parameter out:
+ * operation status return
+ */
+ERROR_CODE isotp_set_tx_dl(struct isotp_t *msg, U8 TX_DL)
 {
-    ERROR_CODE err = ERR_EMPTY;
+    ERROR_CODE err = STATUS_NORMAL;
 
-    do
+    if(msg == NULL)
     {
-        err = msg->phy_receive(&msg->phy_rx);
-        if(err != STATUS_NORMAL)
-        {
-            break;
-        }
-        if(msg->phy_rx.id != msg->N_SA)
-        {
-            err = ERR_NOT_FOUND;
-            break;
-        }
-        if(msg->phy_rx.length == 0)
-        {
-            err = ERR_EMPTY;
-            break;
-        }
-        if(msg->phy_rx.length > FRAME_DATA_LEN)
-        {
-            msg->phy_rx.length = FRAME_DATA_LEN;
-        }
-        err = STATUS_NORMAL;
-    } while(0);
+        err = ERR_POINTER_0;
+    }
+    else if(TX_DL < FRAME_DATA_LEN || frame_dl(TX_DL) != TX_DL)
+    {
+        err = ERR_PARAMETER;
+    }
+    else if(isotp_busy(msg->tp_state))
+    {
+        err = ERR_USED;
+    }
+    else
+    {
+        msg->TX_DL = TX_DL;
+    }
 
     return err;
 }
 
 /*
- * Send a Flow Control Frame
+ * set the batch transmit function, every frame is then sent through it
+ * and a run of CFs not separated by STmin goes out in one call
+ * 
+ * @parameter in:
+ * msg:        object
+ * send_batch: batch send function in data link layer, NULL to use send
+ * @parameter out:
+ * operation status return
  */
-static ERROR_CODE send_fc(struct isotp_t *msg)
+ERROR_CODE isotp_set_tx_batch(struct isotp_t *msg, isotp_transfer_batch send_batch)
 {
-    ERROR_CODE retVal = STATUS_NORMAL;
-    U8        *data   = msg->isotp.phy_tx.data;
+    ERROR_CODE err = STATUS_NORMAL;
 
-#ifdef UNUSED_PADDING_VALUE
-    memset(data, UNUSED_PADDING_VALUE, FRAME_DATA_LEN);
-#endif
-    /* FC message high nibble = 0x3 , low nibble = FC Status */
-    data[0] = (N_PCI_FC | msg->FS);
-    data[1] = msg->BS;
-    /* fix wrong separation time values according spec */
-    if ((msg->STmin > 0x7F) && 
-        ((msg->STmin < 0xF1) || (msg->STmin > 0xF9))) 
+    if(msg == NULL)
     {
-        msg->STmin = ISOTP_DEFAULT_STmin;
+        err = ERR_POINTER_0;
     }
-    data[2] = msg->STmin;
-
-    if (timer_overflow(&msg->N_Bx, TIMEOUT_N_Br))
+    else if(isotp_busy(msg->tp_state))
     {
-        msg->tp_state = ISOTP_ERROR;
-        msg->reply    = N_TIMEOUT_Bx;
+        err = ERR_USED;
     }
-    timer_refresh(&msg->N_Ax);
-
-    retVal = send_port(&msg->isotp);
-
-    if (timer_overflow(&msg->N_Ax, TIMEOUT_N_Ar))
+    else
     {
-        msg->reply    = N_TIMEOUT_Ax;
-        msg->tp_state = ISOTP_ERROR;
+        msg->isotp.phy_send_batch = send_batch;
     }
-    timer_refresh(&msg->N_Cx);
 
-    return retVal;
+    return err;
 }
 
 /*
- * Send SF Message
+ * let the receiver choose its flow control from the consumer backlog,
+ * fc_set() and fs_set_cb are not used while it is set
+ * 
+ * @parameter in:
+ * msg:      object
+ * adapt:    state of the policy, NULL to go back to fixed parameters
+ * backlog:  bytes of the received data the consumer has not taken yet
+ * capacity: bytes the consumer can hold
+ * @parameter out:
+ * operation status return
  */
-static ERROR_CODE send_sf(struct isotp_t *msg)
+ERROR_CODE isotp_set_fc_adapt(struct isotp_t *msg, struct isotp_fc_adapt_t *adapt,
+                              U32 (*backlog)(struct isotp_t* /*msg*/), U32 capacity)
 {
-    U8 *data = msg->isotp.phy_tx.data;
-
-#ifdef UNUSED_PADDING_VALUE
-    memset(data, UNUSED_PADDING_VALUE, FRAME_DATA_LEN);
-#endif
+    ERROR_CODE err = STATUS_NORMAL;
 
-    /* SF message high nibble = 0x0 , low nibble = Length */
-    data[0] = (N_PCI_SF | msg->DL);
-    memcpy(data + 1UL, msg->Buffer + msg->buffer_index, msg->DL);
+    if(msg == NULL || (adapt != NULL && backlog == NULL))
+    {
+        err = ERR_POINTER_0;
+    }
+    else if(isotp_busy(msg->tp_state))
+    {
+        err = ERR_USED;
+    }
+    else
+    {
+        if(adapt != NULL)
+        {
+            adapt->backlog       = backlog;
+            adapt->capacity      = capacity;
+            adapt->drain         = 0UL;
+            adapt->kept_up       = FALSE;
+            adapt->last_backlog  = 0UL;
+            adapt->last_received = 0UL;
+            timer_add(&adapt->mark);
+        }
+        msg->fc_adapt = adapt;
+    }
 
-    return send_port(&msg->isotp);
+    return err;
 }
 
 /*
- * Send a First Frame
+ * clear the pacing profile of a peer
+ * 
+ * @parameter in:
+ * peer: profile
  */
-static ERROR_CODE send_ff(struct isotp_t *msg) 
+void isotp_peer_init(struct isotp_peer_t *peer)
 {
-    ERROR_CODE retVal = STATUS_NORMAL;
-    U8        *data   = msg->isotp.phy_tx.data;
-
-#ifdef UNUSED_PADDING_VALUE
-    memset(data, UNUSED_PADDING_VALUE, FRAME_DATA_LEN);
-#endif
-    msg->buffer_index = 0UL;
-    msg->SN = ISOTP_DEFAULT_SN;
-    data[0] = N_PCI_FF | ((msg->DL >> 8UL) & 0x0F);
-    data[1] = (msg->DL & 0xFF);
-    /* Skip 2 Bytes PCI */
-    memcpy(data + 2UL, msg->Buffer + msg->buffer_index, 6UL);
-
-    timer_add(&msg->N_Ax);
-    /* First Frame has full length */
-    retVal = send_port(&msg->isotp);
-
-    timer_add(&msg->N_Bx);
-    timer_add(&msg->N_Cx);
-
-    if (timer_overflow(&msg->N_Ax, TIMEOUT_N_As))
+    if(peer != NULL)
     {
-        msg->tp_state = ISOTP_ERROR;
-        msg->reply    = N_TIMEOUT_Ax;
-        retVal        = ERR_TIMEOUT;
+        memset(peer, 0, sizeof(*peer));
     }
-
-    return retVal;
 }
 
 /*
- * Send a Consecutive Frame
+ * set the pacing profile of the target the session sends to, it may be
+ * shared by the sessions sending to the same target one after another
+ * 
+ * @parameter in:
+ * msg:  object
+ * peer: profile, NULL to follow the FC only
+ * @parameter out:
+ * operation status return
  */
-static ERROR_CODE send_cf(struct isotp_t *msg)
+ERROR_CODE isotp_set_peer(struct isotp_t *msg, struct isotp_peer_t *peer)
 {
-    ERROR_CODE retVal = STATUS_NORMAL;
-    U8        *data   = msg->isotp.phy_tx.data;
-    U16        len    = 7UL;
+    ERROR_CODE err = STATUS_NORMAL;
 
-#ifdef UNUSED_PADDING_VALUE
-    memset(data, UNUSED_PADDING_VALUE, FRAME_DATA_LEN);
-#endif
-    data[0] = (N_PCI_CF | (msg->SN & 0x0F));
-    if(msg->DL > 7UL) 
+    if(msg == NULL)
     {
-        len = 7UL;
+        err = ERR_POINTER_0;
     }
-    else
+    else if(isotp_busy(msg->tp_state))
     {
-        len = msg->DL;
+        err = ERR_USED;
     }
-    /* Skip 1 Byte PCI */
-    memcpy(data + 1, msg->Buffer + msg->buffer_index, len);
-
-    if (timer_overflow(&msg->N_Cx, TIMEOUT_N_Cs))
+    else
     {
-        msg->tp_state = ISOTP_ERROR;
-        msg->reply    = N_TIMEOUT_Cx;
-        retVal        = ERR_TIMEOUT;
+        msg->peer = peer;
     }
 
-    timer_refresh(&msg->N_Ax);
-    retVal = send_port(&msg->isotp);
+    return err;
+}
 
-    if (timer_overflow(&msg->N_Ax, TIMEOUT_N_As))
+/*
+ * part of a length bytes message to send to a peer in one go: below the
+ * shortest message it has refused with OVFLW, half way from the longest
+ * one it has taken, so repeated transfers close in on its buffer size
+ * 
+ * @parameter in:
+ * peer:   profile
+ * length: bytes left to send
+ * @parameter out:
+ * bytes to put into the next message
+ */
+U32 isotp_peer_chunk(const struct isotp_peer_t *peer, U32 length)
+{
+    U32 chunk = length;
+
+    if(peer != NULL && peer->ovflw_len > 0UL && chunk >= peer->ovflw_len)
     {
-        msg->tp_state = ISOTP_ERROR;
-        msg->reply    = N_TIMEOUT_Ax;
-        retVal        = ERR_TIMEOUT;
+        /* max_len < ovflw_len */
+        chunk = (peer->max_len + peer->ovflw_len) / 2UL;
+        if(chunk == 0UL)
+        {
+            chunk = 1UL;
+        }
     }
 
-    timer_refresh(&msg->N_Cx);
-
-    return retVal;
+    return chunk;
 }
 
-static void fc_delay(U8 STmin)
+/*
+ * Learn from a finished transmission: the pace is doubled after a
+ * message the peer held with WAIT and halved after one it did not, the
+ * retry delay is doubled by an OVFLW and halved by a message taken
+ */
+static void peer_update(struct isotp_t* msg)
 {
-    struct timer_t tmr;
-    U32     waitUs = 0u;
+    struct isotp_peer_t *peer = msg->peer;
+    U32                  len  = msg->buffer_index + msg->DL;
 
-    timer_add(&tmr);
-    /* SeparationTime minimum (STmin) range: 0ms~127ms */
-    if(STmin <= 0x7F)
+    if(peer == NULL)
     {
-        waitUs = STmin * 1000u;
+        return;
     }
-    else if(STmin <= 0xF0)
+
+    peer->messages ++;
+    if(msg->reply == N_BUFFER_OVFLW)
     {
-        waitUs = ISOTP_DEFAULT_STmin * 1000u;
+        peer->overflows ++;
+        if(peer->ovflw_len == 0UL || len < peer->ovflw_len)
+        {
+            peer->ovflw_len = len;
+        }
+        if(peer->max_len >= peer->ovflw_len)
+        {
+            /* the peer has less room than it used to */
+            peer->max_len = 0UL;
+        }
+        peer->retry = (peer->retry < ISOTP_PEER_RETRY_MIN) ? ISOTP_PEER_RETRY_MIN : peer->retry * 2UL;
+        if(peer->retry > ISOTP_PEER_RETRY_MAX)
+        {
+            peer->retry = ISOTP_PEER_RETRY_MAX;
+        }
+        timer_add(&peer->refused);
     }
-    else if(STmin <= 0xF9)
+    else if(msg->reply == N_OK)
     {
-        /* SeparationTime minimum (STmin) range: 100us~900us */
-        waitUs = (STmin - 0xF0) * 100u;
+        if(len > peer->max_len)
+        {
+            peer->max_len = len;
+        }
+        if(peer->ovflw_len > 0UL && len >= peer->ovflw_len)
+        {
+            /* the peer takes longer messages now */
+            peer->ovflw_len = 0UL;
+        }
+        peer->retry /= 2UL;
+        if(peer->retry < ISOTP_PEER_RETRY_MIN)
+        {
+            peer->retry = 0UL;
+        }
+        if(peer->msg_waits > 0UL)
+        {
+            peer->pace = (peer->pace < ISOTP_PEER_PACE_MIN) ? ISOTP_PEER_PACE_MIN : peer->pace * 2UL;
+            if(peer->pace > ISOTP_PEER_PACE_MAX)
+            {
+                peer->pace = ISOTP_PEER_PACE_MAX;
+            }
+        }
+        else
+        {
+            peer->pace /= 2UL;
+            if(peer->pace < ISOTP_PEER_PACE_MIN)
+            {
+                peer->pace = 0UL;
+            }
+        }
     }
     else
-    {
-        waitUs = ISOTP_DEFAULT_STmin * 1000u;
-    }
-
-    /* Loop here until timer is overflow */
-    while (!timer_overflow(&tmr, waitUs))
-        ;
-
-    timer_xdelete(&tmr);
+    {}
+    peer->msg_waits = 0UL;
 }
 
 /*
- * Receive a Single Frame
+ * A message of length bytes is held back while the peer would refuse it
+ * again: it is as long as one refused with OVFLW less than retry ago
  */
-static ERROR_CODE rcv_sf(struct isotp_t* msg)
+static Bool peer_hold(struct isotp_t* msg, U32 length)
 {
-    /* get the SF_DL from the N_PCI byte */
-    msg->DL = msg->isotp.phy_rx.data[0] & 0x0F;
-    msg->buffer_index = 0UL;
-    /* copy the received data bytes */
-    /* Skip PCI, SF uses len bytes */
-    memcpy(msg->Buffer + msg->buffer_index, msg->isotp.phy_rx.data + 1UL, msg->DL);
-    msg->tp_state = ISOTP_FINISHED;
+    struct isotp_peer_t *peer = msg->peer;
 
-    return STATUS_NORMAL;
+    return (peer != NULL
+            && peer->ovflw_len > 0UL && length >= peer->ovflw_len
+            && timer_is_added(&peer->refused) == TRUE
+            && timer_overflow(&peer->refused, peer->retry) == FALSE) ? TRUE : FALSE;
 }
 
 /*
- * Receive a First Frame
+ * set the First Frame indication which lends the receive buffer
+ * 
+ * @parameter in:
+ * msg:          object
+ * rx_buffer_cb: buffer lender, NULL to receive into a buffer of the pool
+ * @parameter out:
+ * operation status return
  */
-static ERROR_CODE rcv_ff(struct isotp_t* msg)
+ERROR_CODE isotp_set_rx_buffer_cb(struct isotp_t *msg, isotp_rx_buffer_cb rx_buffer_cb)
 {
     ERROR_CODE err = STATUS_NORMAL;
-    U8 *data = msg->isotp.phy_rx.data;
 
-    timer_add(&msg->N_Ax);
-    timer_add(&msg->N_Bx);
-    timer_add(&msg->N_Cx);
-    /* get the FF_DL */
-    msg->DL = (data[0] & 0x0F) << 8;
-    msg->DL += data[1];
-    if(msg->DL <= 6UL)
+    if(msg == NULL)
     {
-        err = ERR_PARAMETER;
+        err = ERR_POINTER_0;
+    }
+    else if(isotp_busy(msg->tp_state))
+    {
+        err = ERR_USED;
     }
     else
     {
-        msg->SN = ISOTP_DEFAULT_SN;
-        msg->rest = msg->DL;
-        msg->buffer_index = 0UL;
-        /* 
-         * copy the first received data bytes
-         * Skip 2 bytes PCI, FF must have 6 bytes!
-         */
-        memcpy(msg->Buffer + msg->buffer_index, data + 2UL, 6UL);
-        msg->buffer_index  += 6UL;
-        msg->rest          -= 6UL; /* Rest length */
-        msg->BS_Counter     = msg->BS;
-        msg->tp_state       = ISOTP_WAIT_DATA;
-        if (timer_overflow(&msg->N_Bx, TIMEOUT_N_Br))
-        {
-            msg->tp_state = ISOTP_ERROR;
-            msg->reply    = N_TIMEOUT_Bx;
-        }
-        else
-        {
-            timer_refresh(&msg->N_Ax);
-            err        = send_fc(msg);
-            if (timer_overflow(&msg->N_Ax, TIMEOUT_N_Ar))
-            {
-                msg->tp_state = ISOTP_ERROR;
-                msg->reply    = N_TIMEOUT_Ax;
-            }
-        }
+        msg->rx_buffer_cb = rx_buffer_cb;
     }
 
     return err;
 }
 
 /*
- * Receive a Consecutive Frame
- */
-static ERROR_CODE rcv_cf(struct isotp_t* msg)
-{
-    ERROR_CODE err  = STATUS_NORMAL;
-    U8        *data = msg->isotp.phy_rx.data;
+ * set the service primitives given to the upper layer
+ * 
+ * @parameter in:
+ * msg:     object
+ * service: callbacks, shall stay valid, NULL to remove them
+ * @parameter out:
+ * operation status return
+ */
+ERROR_CODE isotp_set_service(struct isotp_t *msg, const struct isotp_service_t *service)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(msg == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else
+    {
+        msg->service = service;
+    }
+
+    return err;
+}
+
+/*
+ * N_ChangeParameter.request: change the BS or STmin sent in the FCs of
+ * the next receptions, confirmed at once by service->change_con
+ * 
+ * @parameter in:
+ * msg:   object
+ * param: ISOTP_PARAM_STmin or ISOTP_PARAM_BS
+ * value: new value, STmin 0x00-0x7F or 0xF1-0xF9
+ * @parameter out:
+ * Result_ChangeParameter
+ */
+enum N_Result_ChangeParameter isotp_change_parameter(struct isotp_t *msg, enum ISOTP_PARAM_e param, U8 value)
+{
+    enum N_Result_ChangeParameter result = N_CHANGE_OK;
+
+    if(msg == NULL)
+    {
+        return N_WRONG_PARAMETER;
+    }
+
+    if(isotp_busy(msg->tp_state))
+    {
+        /* the parameters are in use by the transfer in progress */
+        result = N_RX_ON;
+    }
+    else if(param == ISOTP_PARAM_STmin)
+    {
+        if(value > 0x7F && (value < 0xF1 || value > 0xF9))
+        {
+            result = N_WRONG_VALUE;
+        }
+        else
+        {
+            msg->STmin = value;
+        }
+    }
+    else if(param == ISOTP_PARAM_BS)
+    {
+        msg->BS = value;
+    }
+    else
+    {
+        result = N_WRONG_PARAMETER;
+    }
+
+    if(msg->service != NULL && msg->service->change_con != NULL)
+    {
+        msg->service->change_con(msg, param, result);
+    }
+
+    return result;
+}
+
+static Bool tx_state(isotp_states_t state)
+{
+    return (state == ISOTP_SEND
+            || state == ISOTP_SEND_FF
+            || state == ISOTP_SEND_CF
+            || state == ISOTP_WAIT_FIRST_FC
+            || state == ISOTP_WAIT_FC);
+}
+
+/*
+ * Give the indications noted while handling a call, and the confirmation
+ * if the call ended the transmission which was in progress before it,
+ * which the peer profile learns from
+ */
+static void service_notify(struct isotp_t* msg, isotp_states_t before)
+{
+    const struct isotp_service_t *service = msg->service;
+    U8                            events  = msg->events;
+    Bool                          rx_end  = FALSE;
+    Bool                          tx_end  = (tx_state(before) && !tx_state(msg->tp_state)) ? TRUE : FALSE;
+
+    msg->events = 0u;
+    if(tx_end == TRUE)
+    {
+        peer_update(msg);
+    }
+    if(msg->rx_active == TRUE && msg->tp_state != ISOTP_WAIT_DATA)
+    {
+        msg->rx_active = FALSE;
+        rx_end         = TRUE;
+    }
+    if(service == NULL)
+    {
+        return;
+    }
+
+    if((events & ISOTP_EVT_UNEXP_PDU) && service->ind != NULL)
+    {
+        service->ind(msg, N_UNEXP_PDU);
+    }
+    if((events & ISOTP_EVT_FF_IND) && service->ff_ind != NULL)
+    {
+        service->ff_ind(msg, msg->DL);
+    }
+    if((rx_end == TRUE || (events & ISOTP_EVT_SF_IND)) && service->ind != NULL)
+    {
+        service->ind(msg, msg->reply);
+    }
+    if(tx_end == TRUE && service->con != NULL)
+    {
+        service->con(msg, msg->reply);
+    }
+}
+
+/*
+ * make the session full duplex: the SF/FF/CF it is sent go to a receive
+ * context of their own, so a message is received while one is sent on
+ * the same address pair; msg keeps the transmission and the FCs for it.
+ * The receive settings made on msg so far (fc_set(), fs_set_cb, service,
+ * buffer lender, streaming, adaptive FC) are taken over by rx, later ones
+ * are made on rx. msg is still the only object to poll, to feed frames
+ * to and to put on a wheel or a table, the results of a reception are
+ * read from rx.
+ * 
+ * @parameter in:
+ * msg: object
+ * rx:  receive context, it is initialized here; NULL: half duplex again
+ * @parameter out:
+ * operation status return
+ */
+ERROR_CODE isotp_set_duplex(struct isotp_t *msg, struct isotp_t *rx)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(msg == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else if(rx == msg)
+    {
+        err = ERR_PARAMETER;
+    }
+    else if(isotp_busy(msg->tp_state)
+        || (msg->rx_ctx != NULL && isotp_busy(msg->rx_ctx->tp_state)))
+    {
+        err = ERR_USED;
+    }
+    else if(rx != NULL)
+    {
+        err = isotp_init(rx, msg->isotp.N_SA, msg->isotp.N_TA, msg->fs_set_cb,
+                         msg->isotp.phy_send, NULL);
+        rx->isotp.phy_send_batch = msg->isotp.phy_send_batch;
+        rx->isotp.txq      = msg->isotp.txq;
+        rx->isotp.tx_class = msg->isotp.tx_class;
+        rx->TX_DL          = msg->TX_DL;
+        rx->FS             = msg->FS;
+        rx->BS             = msg->BS;
+        rx->STmin          = msg->STmin;
+        rx->service        = msg->service;
+        rx->rx_buffer_cb   = msg->rx_buffer_cb;
+        rx->rx_stream_cb   = msg->rx_stream_cb;
+        rx->rx_stream_buf  = msg->rx_stream_buf;
+        rx->rx_stream_size = msg->rx_stream_size;
+        rx->fc_adapt       = msg->fc_adapt;
+        msg->rx_ctx        = rx;
+    }
+    else
+    {
+        msg->rx_ctx = NULL;
+    }
+
+    return err;
+}
+
+/*
+ * send the frames of the session through a priority queue with a
+ * bus-load budget instead of straight to the driver; a frame queued
+ * counts as sent, N_As and N_Bs run from then on
+ * 
+ * @parameter in:
+ * msg:      object
+ * txq:      queue shared by the sessions of the bus, NULL: no queue
+ * tx_class: priority of the session, 0 is the most urgent,
+ *           e.g. diagnostics before bulk flashing
+ * @parameter out:
+ * operation status return, ERR_USED during a transfer
+ */
+ERROR_CODE isotp_set_txq(struct isotp_t *msg, struct isotp_txq_t *txq, U8 tx_class)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(msg == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else if(isotp_busy(msg->tp_state)
+        || (msg->rx_ctx != NULL && isotp_busy(msg->rx_ctx->tp_state)))
+    {
+        err = ERR_USED;
+    }
+    else
+    {
+        msg->isotp.txq      = txq;
+        msg->isotp.tx_class = tx_class;
+        if(msg->rx_ctx != NULL)
+        {
+            /* its FCs go the same way */
+            msg->rx_ctx->isotp.txq      = txq;
+            msg->rx_ctx->isotp.tx_class = tx_class;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * register the session on a timer wheel, isotp_poll() is then called by
+ * timer_wheel_advance() when one of its timers is due instead of being
+ * polled for each session
+ * 
+ * @parameter in:
+ * msg:   object
+ * wheel: shared wheel, NULL to leave it
+ * @parameter out:
+ * operation status return
+ */
+ERROR_CODE isotp_set_wheel(struct isotp_t *msg, struct timer_wheel_t *wheel)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(msg == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else
+    {
+        if(msg->wheel != NULL)
+        {
+            timer_wheel_disarm(msg->wheel, &msg->tmo_node);
+        }
+        msg->wheel = wheel;
+        wheel_update(msg);
+    }
+
+    return err;
+}
+
+static void wheel_expired(void *arg)
+{
+    (void)isotp_poll((struct isotp_t *)arg);
+}
+
+/* keep the node of the session on its next deadline */
+static void wheel_update(struct isotp_t* msg)
+{
+    U32 remain;
+
+    if(msg->wheel != NULL)
+    {
+        remain = isotp_next_deadline(msg);
+        if(remain == U32_INVALID_VALUE)
+        {
+            timer_wheel_disarm(msg->wheel, &msg->tmo_node);
+        }
+        else
+        {
+            timer_wheel_arm(msg->wheel, &msg->tmo_node, remain);
+        }
+    }
+}
+
+/*
+ * take a buffer of the pool as msg->Buffer, the previous one is released
+ * 
+ * @parameter in:
+ * msg:    object
+ * length: message length
+ * @parameter out:
+ * msg->Buffer, NULL if the pool has no block for length bytes
+ */
+U8 *isotp_buffer_alloc(struct isotp_t *msg, U32 length)
+{
+    U8 *buf = NULL;
+
+    if(msg != NULL)
+    {
+        isotp_buffer_release(msg);
+        msg->Buffer = isotp_pool_alloc(length);
+        buf         = msg->Buffer;
+    }
+
+    return buf;
+}
+
+/*
+ * give msg->Buffer back to the pool once the message has been consumed,
+ * it shall not be called while msg->Buffer is being sent; a message
+ * received into a block of the pool stays there until this call, the
+ * messages coming in meanwhile are refused with N_BUFFER_OVFLW
+ * 
+ * @parameter in:
+ * msg: object
+ */
+void isotp_buffer_release(struct isotp_t *msg)
+{
+    if(msg != NULL && msg->Buffer != NULL)
+    {
+        /* a buffer set by the application is not a block of the pool */
+        (void)isotp_pool_free(msg->Buffer);
+        if(msg->rx_buf == msg->Buffer)
+        {
+            msg->rx_buf = NULL;
+        }
+        msg->Buffer  = NULL;
+        msg->rx_held = FALSE;
+    }
+}
+
+/*
+ * set the streaming receive: the payload is collected in window and
+ * handed to stream_cb each time the window is full, at the end of each
+ * block of BS CFs (before its FC is sent) and at the end of the message,
+ * so the message never has to fit into memory as a whole; a window
+ * of one frame hands each CF on as it comes
+ * 
+ * @parameter in:
+ * msg:       object
+ * stream_cb: consumer, NULL to receive whole messages again
+ * window:    collecting buffer, not used when stream_cb is NULL
+ * size:      size of window, FRAME_DATA_LEN at least; a message sent
+ *            in frames whose payload does not fit is rejected
+ * @parameter out:
+ * operation status return
+ */
+ERROR_CODE isotp_set_rx_stream(struct isotp_t *msg, isotp_rx_stream_cb stream_cb, U8 *window, U32 size)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(msg == NULL || (stream_cb != NULL && window == NULL))
+    {
+        err = ERR_POINTER_0;
+    }
+    else if(stream_cb != NULL && size < FRAME_DATA_LEN)
+    {
+        /* a classic SF, FF or CF shall fit into the window */
+        err = ERR_PARAMETER;
+    }
+    else if(isotp_busy(msg->tp_state))
+    {
+        err = ERR_USED;
+    }
+    else
+    {
+        msg->rx_stream_cb   = stream_cb;
+        msg->rx_stream_buf  = window;
+        msg->rx_stream_size = size;
+    }
+
+    return err;
+}
+
+/*
+ * Hand the collected payload to the streaming consumer when the window
+ * cannot take another CF, at the end of a block or of the message
+ */
+static void rx_stream(struct isotp_t* msg, Bool block_end)
+{
+    U32 len = msg->DL - msg->rx_stream_off;
+
+    if(msg->rx_stream_cb == NULL)
+    {
+        return;
+    }
+    if(msg->tp_state == ISOTP_WAIT_DATA && block_end == FALSE
+        && msg->buffer_index + CF_DATA_LEN(msg->RX_DL) <= msg->rx_stream_size)
+    {
+        return;
+    }
+
+    /* the last CF is counted as a full one in buffer_index */
+    if(len > msg->buffer_index)
+    {
+        len = msg->buffer_index;
+    }
+    if(len > 0UL
+        && msg->rx_stream_cb(msg, msg->rx_stream_off, msg->rx_buf, len) != STATUS_NORMAL)
+    {
+        msg->reply    = N_ERROR;
+        msg->tp_state = ISOTP_ERROR;
+    }
+    msg->rx_stream_off += len;
+    msg->buffer_index   = 0UL;
+}
+
+/*
+ * Choose where a message of length bytes is received into:
+ * the streaming window, if frames of frame_len payload bytes fit into it,
+ * the buffer lent by the application, or a buffer of the pool; Buffer
+ * is only taken back from a reception which did not finish, a message
+ * the application has not released is not overwritten
+ */
+static U8 *rx_buffer_get(struct isotp_t* msg, U32 length, U32 frame_len)
+{
+    U8 *buf = NULL;
+
+    msg->rx_stream_off = 0UL;
+    if(msg->rx_stream_cb != NULL)
+    {
+        buf = (frame_len <= msg->rx_stream_size) ? msg->rx_stream_buf : NULL;
+    }
+    else if(msg->rx_buffer_cb != NULL)
+    {
+        buf = msg->rx_buffer_cb(msg, length);
+    }
+    else if(msg->Buffer == NULL
+        || (msg->Buffer == msg->rx_buf && msg->rx_held == FALSE))
+    {
+        buf = isotp_buffer_alloc(msg, length);
+    }
+    else
+    {}
+
+    return buf;
+}
+
+/*
+ * End a reception, a block of the pool received into is the
+ * application's now
+ */
+static void rx_finish(struct isotp_t* msg)
+{
+    msg->tp_state = ISOTP_FINISHED;
+    if(msg->rx_buf == msg->Buffer)
+    {
+        msg->rx_held = TRUE;
+    }
+    rx_stream(msg, TRUE);
+}
+
+/*
+ * Round a length up to the next valid CAN_DL (8 at least)
+ */
+static U8 frame_dl(U32 len)
+{
+    static const U8 can_dl[] = { 8u, 12u, 16u, 20u, 24u, 32u, 48u, 64u };
+    U8 i = 0u;
+
+    while(i < sizeof(can_dl) - 1u && len > can_dl[i])
+    {
+        i ++;
+    }
+
+    return can_dl[i];
+}
+
+/*
+ * Complete a frame whose first used bytes are set,
+ * the unused bytes up to the CAN_DL of the frame are padded
+ */
+static void frame_pad(const struct isotp_t *msg, struct phy_msg_t *frame, U32 used)
+{
+    if(msg->TX_DL > FRAME_DATA_LEN)
+    {
+        frame->fd     = TRUE;
+        frame->length = frame_dl(used);
+        memset(frame->data + used, CANFD_PADDING_VALUE, frame->length - used);
+    }
+    else
+    {
+        frame->fd     = FALSE;
+        frame->length = FRAME_DATA_LEN;
+#ifdef UNUSED_PADDING_VALUE
+        memset(frame->data + used, UNUSED_PADDING_VALUE, frame->length - used);
+#endif
+    }
+    frame->new_data = TRUE;
+    frame->id       = msg->isotp.N_TA;
+}
+
+/*
+ * Send the first used bytes of phy_tx
+ */
+static ERROR_CODE send_port(struct isotp_t *msg, U32 used)
+{
+    struct phy_msg_t *tx = &msg->isotp.phy_tx;
+
+    ERROR_CODE        err  = STATUS_NORMAL;
+    U32               sent = 0UL;
+
+    frame_pad(msg, tx, used);
+    if(msg->isotp.txq != NULL)
+    {
+        err = isotp_txq_put(msg->isotp.txq, tx, 1UL, msg->isotp.tx_class);
+    }
+    else if(msg->isotp.phy_send_batch != NULL)
+    {
+        err = msg->isotp.phy_send_batch(tx, 1UL, &sent);
+    }
+    else
+    {
+        err = msg->isotp.phy_send(tx);
+    }
+    /* N_As/N_Ar are checked next, they shall see the time the driver took */
+    timer_snapshot_renew();
+
+    return err;
+}
+
+static ERROR_CODE frame_check(const struct isotp_msg_t *msg, const struct phy_msg_t *frame)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(frame->id != msg->N_SA)
+    {
+        err = ERR_NOT_FOUND;
+    }
+    else if(frame->length == 0)
+    {
+        err = ERR_EMPTY;
+    }
+    else
+    {}
+
+    return err;
+}
+
+static ERROR_CODE receive_port(struct isotp_msg_t *msg)
+{
+    ERROR_CODE err = ERR_EMPTY;
+
+    do
+    {
+        err = msg->phy_receive(&msg->phy_rx);
+        if(err != STATUS_NORMAL)
+        {
+            break;
+        }
+        err = frame_check(msg, &msg->phy_rx);
+        if(err != STATUS_NORMAL)
+        {
+            break;
+        }
+        if(msg->phy_rx.length > CANFD_DATA_LEN)
+        {
+            msg->phy_rx.length = CANFD_DATA_LEN;
+        }
+    } while(0);
+
+    return err;
+}
+
+/*
+ * Send a Flow Control Frame
+ */
+static ERROR_CODE send_fc(struct isotp_t *msg, enum ISOTP_FS_e FS)
+{
+    ERROR_CODE retVal = STATUS_NORMAL;
+    U8        *data   = msg->isotp.phy_tx.data;
+
+    /* FC message high nibble = 0x3 , low nibble = FC Status */
+    data[0] = (N_PCI_FC | FS);
+    data[1] = msg->BS;
+    /* fix wrong separation time values according spec */
+    if ((msg->STmin > 0x7F) && 
+        ((msg->STmin < 0xF1) || (msg->STmin > 0xF9))) 
+    {
+        msg->STmin = ISOTP_DEFAULT_STmin;
+    }
+    data[2] = msg->STmin;
+
+    if (timer_overflow(&msg->N_Bx, TIMEOUT_N_Br))
+    {
+        msg->tp_state = ISOTP_ERROR;
+        msg->reply    = N_TIMEOUT_Bx;
+    }
+    timer_refresh(&msg->N_Ax);
+
+    retVal = send_port(msg, 3UL);
+
+    if (timer_overflow(&msg->N_Ax, TIMEOUT_N_Ar))
+    {
+        msg->reply    = N_TIMEOUT_Ax;
+        msg->tp_state = ISOTP_ERROR;
+    }
+    timer_refresh(&msg->N_Cx);
+
+    return retVal;
+}
+
+/*
+ * Choose and send the FC which follows the FF or ends a block,
+ * no more than MAX_FCWAIT_FRAME WAITs are sent in a row; a FC the
+ * driver refuses is sent again by isotp_poll() until N_Br runs out
+ */
+static ERROR_CODE send_rx_fc(struct isotp_t *msg)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+    /* no CF has been received yet: the sender takes BS and STmin from this FC */
+    Bool first = (msg->DL - msg->rest <= FF_DATA_LEN(msg->RX_DL, msg->DL)) ? TRUE : FALSE;
+
+    if(msg->fc_adapt != NULL)
+    {
+        fc_adapt(msg, first);
+    }
+    else if(first == FALSE && msg->fs_set_cb != NULL)
+    {
+        msg->fs_set_cb(msg);
+    }
+    else
+    {}
+
+    if(msg->FS == ISOTP_FS_WAIT)
+    {
+        if(msg->wait_count >= MAX_FCWAIT_FRAME)
+        {
+            /* the sender would give up with N_WFT_OVRN */
+            msg->FS         = ISOTP_FS_CTS;
+            msg->wait_count = 0u;
+        }
+        else
+        {
+            msg->wait_count ++;
+        }
+    }
+    else
+    {
+        msg->wait_count = 0u;
+    }
+    msg->BS_Counter = msg->BS;
+    err             = send_fc(msg, msg->FS);
+    msg->fc_pending = (err != STATUS_NORMAL) ? TRUE : FALSE;
+
+    return err;
+}
+
+/*
+ * Adaptive flow control policy: the FC after the FF opens the message
+ * (BS=0, STmin=0) when it fits into the room left or the consumer has
+ * kept up, else a block takes half the room, so one is received while
+ * the one before is consumed, and STmin follows the drain rate of a
+ * lagging consumer; a later FC holds the sender with WAIT until the
+ * next block fits
+ */
+static void fc_adapt(struct isotp_t* msg, Bool first)
+{
+    struct isotp_fc_adapt_t *fa       = msg->fc_adapt;
+    U32                      backlog  = fa->backlog(msg);
+    U32                      received = msg->DL - msg->rest;
+    U32                      arrived  = (first == TRUE) ? received : received - fa->last_received;
+    U32                      cf       = CF_DATA_LEN(msg->RX_DL);
+    U32                      room     = (fa->capacity > backlog) ? fa->capacity - backlog : 0UL;
+    U32                      elapsed  = timer_interval(&fa->mark);
+    U32                      block    = 0UL;
+    U32                      sample   = 0UL;
+
+    if(first == FALSE && elapsed > 0UL && backlog > arrived
+        && fa->last_backlog + arrived >= backlog)
+    {
+        /* the consumer was busy all along: bytes per ms it has taken */
+        sample = (U32)(((U64)(fa->last_backlog + arrived - backlog) * 1000u) / elapsed);
+        fa->drain = (fa->drain == 0UL) ? sample : (fa->drain * 3UL + sample) / 4UL;
+    }
+
+    if(room < cf)
+    {
+        msg->FS = ISOTP_FS_WAIT;
+    }
+    else if(first == TRUE)
+    {
+        msg->FS = ISOTP_FS_CTS;
+        if(msg->rest <= room || (fa->kept_up == TRUE && backlog <= arrived))
+        {
+            msg->BS    = 0u;
+            msg->STmin = 0u;
+        }
+        else
+        {
+            block      = room / 2UL / cf;
+            msg->BS    = (U8)((block > 0xFFUL) ? 0xFFUL : ((block == 0UL) ? 1UL : block));
+            msg->STmin = (fa->kept_up == TRUE || fa->drain == 0UL) ? 0u : stmin_code(cf * 1000UL / fa->drain);
+        }
+    }
+    else
+    {
+        block   = (U32)msg->BS * cf;
+        msg->FS = (room >= ((block < msg->rest) ? block : msg->rest)) ? ISOTP_FS_CTS : ISOTP_FS_WAIT;
+    }
+
+    /* nothing older than what came in since the last FC is left */
+    fa->kept_up       = (backlog <= arrived) ? TRUE : FALSE;
+    fa->last_backlog  = backlog;
+    fa->last_received = received;
+    timer_refresh(&fa->mark);
+}
+
+/*
+ * Convert microseconds to the STmin parameter of a FC frame, rounded up
+ */
+static U8 stmin_code(U32 us)
+{
+    U8 STmin = 0u;
+
+    if(us == 0UL)
+    {}
+    else if(us < 1000UL)
+    {
+        /* 0xF1~0xF9: 100us~900us */
+        STmin = (U8)(0xF0 + (us + 99UL) / 100UL);
+    }
+    else if(us <= 127000UL)
+    {
+        STmin = (U8)((us + 999UL) / 1000UL);
+    }
+    else
+    {
+        STmin = 0x7F;
+    }
+
+    return STmin;
+}
+
+/*
+ * Send SF Message
+ */
+static ERROR_CODE send_sf(struct isotp_t *msg)
+{
+    U8 *data = msg->isotp.phy_tx.data;
+    U32 pci  = 1UL;
+
+    if(msg->DL <= 7UL)
+    {
+        /* SF message high nibble = 0x0 , low nibble = Length */
+        data[0] = (N_PCI_SF | msg->DL);
+    }
+    else
+    {
+        /* CAN FD: SF_DL escape sequence, low nibble = 0, Length in byte #2 */
+        data[0] = N_PCI_SF;
+        data[1] = (U8)msg->DL;
+        pci     = 2UL;
+    }
+    if(tx_peek(msg, data + pci, msg->DL) != STATUS_NORMAL)
+    {
+        return ERR_EMPTY;
+    }
+
+    return send_port(msg, pci + msg->DL);
+}
+
+/*
+ * Send a First Frame
+ */
+static ERROR_CODE send_ff(struct isotp_t *msg) 
+{
+    ERROR_CODE retVal = STATUS_NORMAL;
+    U8        *data   = msg->isotp.phy_tx.data;
+
+    msg->buffer_index = 0UL;
+    msg->SN = ISOTP_DEFAULT_SN;
+    if(msg->DL > ISOTP_FF_DL)
+    {
+        /* FF_DL escape sequence, 32 bit length big endian */
+        data[0] = N_PCI_FF;
+        data[1] = 0x00;
+        data[2] = (U8)(msg->DL >> 24UL);
+        data[3] = (U8)(msg->DL >> 16UL);
+        data[4] = (U8)(msg->DL >> 8UL);
+        data[5] = (U8)(msg->DL);
+    }
+    else
+    {
+        data[0] = N_PCI_FF | ((msg->DL >> 8UL) & 0x0F);
+        data[1] = (msg->DL & 0xFF);
+    }
+    /* Skip 2 or 6 Bytes PCI */
+    if(tx_peek(msg, data + FF_PCI_LEN(msg->DL), FF_DATA_LEN(msg->TX_DL, msg->DL)) != STATUS_NORMAL)
+    {
+        return ERR_EMPTY;
+    }
+
+    timer_add(&msg->N_Ax);
+    /* First Frame has full length */
+    retVal = send_port(msg, msg->TX_DL);
+
+    timer_add(&msg->N_Bx);
+    timer_add(&msg->N_Cx);
+
+    if (timer_overflow(&msg->N_Ax, TIMEOUT_N_As))
+    {
+        msg->tp_state = ISOTP_ERROR;
+        msg->reply    = N_TIMEOUT_Ax;
+        retVal        = ERR_TIMEOUT;
+    }
+
+    return retVal;
+}
+
+/*
+ * Send a Consecutive Frame
+ */
+static ERROR_CODE send_cf(struct isotp_t *msg)
+{
+    ERROR_CODE retVal = STATUS_NORMAL;
+    U8        *data   = msg->isotp.phy_tx.data;
+    U16        len    = CF_DATA_LEN(msg->TX_DL);
+
+    data[0] = (N_PCI_CF | (msg->SN & 0x0F));
+    if(msg->DL > CF_DATA_LEN(msg->TX_DL)) 
+    {
+        len = CF_DATA_LEN(msg->TX_DL);
+    }
+    else
+    {
+        len = msg->DL;
+    }
+    if (timer_overflow(&msg->N_Cx, TIMEOUT_N_Cs))
+    {
+        msg->tp_state = ISOTP_ERROR;
+        msg->reply    = N_TIMEOUT_Cx;
+        retVal        = ERR_TIMEOUT;
+    }
+    /* Skip 1 Byte PCI */
+    if (tx_peek(msg, data + 1, len) != STATUS_NORMAL)
+    {
+        /* nothing from the producer, the CF is not sent */
+        return ERR_EMPTY;
+    }
+
+    timer_refresh(&msg->N_Ax);
+    retVal = send_port(msg, 1UL + len);
+
+    if (timer_overflow(&msg->N_Ax, TIMEOUT_N_As))
+    {
+        msg->tp_state = ISOTP_ERROR;
+        msg->reply    = N_TIMEOUT_Ax;
+        retVal        = ERR_TIMEOUT;
+    }
+
+    timer_refresh(&msg->N_Cx);
+
+    return retVal;
+}
+
+/*
+ * Convert the STmin parameter of a FC frame to microseconds
+ */
+static U32 stmin_us(U8 STmin)
+{
+    U32 waitUs = 0u;
+
+    /* SeparationTime minimum (STmin) range: 0ms~127ms */
+    if(STmin <= 0x7F)
+    {
+        waitUs = STmin * 1000u;
+    }
+    else if(STmin <= 0xF0)
+    {
+        waitUs = ISOTP_DEFAULT_STmin * 1000u;
+    }
+    else if(STmin <= 0xF9)
+    {
+        /* SeparationTime minimum (STmin) range: 100us~900us */
+        waitUs = (STmin - 0xF0) * 100u;
+    }
+    else
+    {
+        waitUs = ISOTP_DEFAULT_STmin * 1000u;
+    }
+
+    return waitUs;
+}
+
+
+/*
+ * Separation of two CFs sent: STmin of the receiver, at least the pace
+ * learnt for the peer
+ */
+static U32 tx_gap_us(const struct isotp_t* msg)
+{
+    U32 gap = stmin_us(msg->tx_STmin);
+
+    if(msg->peer != NULL && msg->peer->pace > gap)
+    {
+        gap = msg->peer->pace;
+    }
+
+    return gap;
+}
+
+
+/*
+ * Receive a Single Frame
+ */
+static ERROR_CODE rcv_sf(struct isotp_t* msg, const struct phy_msg_t *frame)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+    /* get the SF_DL from the N_PCI byte */
+    U16        len = frame->data[0] & 0x0F;
+    U32        pci = 1UL;
+
+    if(len == 0UL && frame->length > FRAME_DATA_LEN)
+    {
+        /* CAN FD: SF_DL escape sequence */
+        len = frame->data[1];
+        pci = 2UL;
+    }
+    if(len == 0UL
+        || len > SF_MAX_LEN(frame->length)
+        || pci + len > frame->length)
+    {
+        /* ISO-15765-2-9.6.2.2: ignore SF with invalid SF_DL */
+        err = ERR_PARAMETER;
+    }
+    else if((msg->rx_buf = rx_buffer_get(msg, len, len)) == NULL)
+    {
+        /* rejected by the application */
+        msg->DL       = 0UL;
+        msg->reply    = N_BUFFER_OVFLW;
+        msg->tp_state = ISOTP_ERROR;
+        err           = ERR_FULL;
+    }
+    else
+    {
+        msg->DL = len;
+        msg->buffer_index = 0UL;
+        /* copy the received data bytes */
+        /* Skip PCI, SF uses len bytes */
+        memcpy(msg->rx_buf + msg->buffer_index, frame->data + pci, msg->DL);
+        msg->buffer_index = msg->DL;
+        msg->reply    = N_OK;
+        msg->events  |= ISOTP_EVT_SF_IND;
+        rx_finish(msg);
+    }
+
+    return err;
+}
+
+/*
+ * Receive a First Frame
+ */
+static ERROR_CODE rcv_ff(struct isotp_t* msg, const struct phy_msg_t *frame)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+    const U8  *data = frame->data;
+    U32        pci  = 2UL;
+
+    timer_add(&msg->N_Ax);
+    timer_add(&msg->N_Bx);
+    timer_add(&msg->N_Cx);
+    /* get the FF_DL */
+    msg->DL = (data[0] & 0x0F) << 8;
+    msg->DL += data[1];
+    if(msg->DL == 0UL)
+    {
+        /* FF_DL escape sequence, 32 bit length big endian */
+        msg->DL = ((U32)data[2] << 24UL)
+                | ((U32)data[3] << 16UL)
+                | ((U32)data[4] << 8UL)
+                | (U32)data[5];
+        pci = 6UL;
+    }
+    /* 
+     * RX_DL is given by the CAN_DL of the FF, a FF_DL which would fit
+     * into a SF of the same RX_DL or a short FF_DL sent escaped is not valid
+     */
+    if(frame->length < FRAME_DATA_LEN
+        || frame_dl(frame->length) != frame->length
+        || msg->DL <= SF_MAX_LEN(frame->length)
+        || pci != FF_PCI_LEN(msg->DL))
+    {
+        err = ERR_PARAMETER;
+    }
+    else if((msg->rx_buf = rx_buffer_get(msg, msg->DL, CF_DATA_LEN(frame->length))) == NULL)
+    {
+        /* the message does not fit into the buffer, abort the reception */
+        msg->DL       = 0UL;
+        msg->reply    = N_BUFFER_OVFLW;
+        msg->tp_state = ISOTP_ERROR;
+        err           = send_fc(msg, ISOTP_FS_OVFLW);
+    }
+    else
+    {
+        msg->RX_DL = (U8)frame->length;
+        msg->SN = ISOTP_DEFAULT_SN;
+        msg->rest = msg->DL;
+        msg->buffer_index = 0UL;
+        msg->reply = N_OK;
+        /* 
+         * copy the first received data bytes
+         * Skip 2 or 6 bytes PCI, FF must have RX_DL - PCI bytes!
+         */
+        memcpy(msg->rx_buf + msg->buffer_index, data + pci, msg->RX_DL - pci);
+        msg->buffer_index  += msg->RX_DL - pci;
+        msg->rest          -= msg->RX_DL - pci; /* Rest length */
+        msg->BS_Counter     = msg->BS;
+        msg->tp_state       = ISOTP_WAIT_DATA;
+        msg->rx_active      = TRUE;
+        msg->events        |= ISOTP_EVT_FF_IND;
+        rx_stream(msg, FALSE);
+        if (msg->tp_state != ISOTP_WAIT_DATA)
+        {
+            /* the streaming consumer can't take the message */
+            err = send_fc(msg, ISOTP_FS_OVFLW);
+        }
+        else if (timer_overflow(&msg->N_Bx, TIMEOUT_N_Br))
+        {
+            msg->tp_state = ISOTP_ERROR;
+            msg->reply    = N_TIMEOUT_Bx;
+        }
+        else
+        {
+            timer_refresh(&msg->N_Ax);
+            msg->wait_count = 0u;
+            err        = send_rx_fc(msg);
+            if (timer_overflow(&msg->N_Ax, TIMEOUT_N_Ar))
+            {
+                msg->tp_state = ISOTP_ERROR;
+                msg->reply    = N_TIMEOUT_Ax;
+            }
+        }
+    }
+
+    return err;
+}
+
+/*
+ * Receive a Consecutive Frame
+ */
+static ERROR_CODE rcv_cf(struct isotp_t* msg, const struct phy_msg_t *frame)
+{
+    ERROR_CODE err  = STATUS_NORMAL;
+    const U8  *data = frame->data;
+    U32        len  = CF_DATA_LEN(msg->RX_DL);
+
+    if (timer_overflow(&msg->N_Cx, TIMEOUT_N_Cr))
+    {
+        msg->tp_state = ISOTP_ERROR;
+        msg->reply    = N_TIMEOUT_Cx;
+    }
+    else
+    {
+        timer_refresh(&msg->N_Cx);
+    }
+    for(;;)
+    {
+        if (msg->tp_state != ISOTP_WAIT_DATA) 
+        {
+            err = ERR_PARAMETER;
+            break;
+        }
+        /* every CF but the last one carries RX_DL bytes */
+        if (frame->length < 1UL + ((msg->rest < len) ? msg->rest : len))
+        {
+            err = ERR_PARAMETER;
+            break;
+        }
+        if ((data[0] & 0x0F) != (msg->SN & 0x0F))
+        {
+            msg->tp_state   = ISOTP_ERROR;
+            msg->SN         = ISOTP_DEFAULT_SN;
+            msg->reply      = N_WRONG_SN;
+            err             = ERR_PARAMETER;
+            break;
+        }
+
+        msg->SN ++;
+        msg->SN           &= 0x0F;
+        if(msg->rest <= len)
+        {
+            /* Last Frame */
+            memcpy(msg->rx_buf + msg->buffer_index, data + 1UL, msg->rest); /* RX_DL - 2 Bytes in FF */
+            msg->buffer_index += len;                                       /* + RX_DL - 1 per CF skip PCI */
+            msg->rest = 0UL;
+            rx_finish(msg);
+        }
+        else
+        {
+            memcpy(msg->rx_buf + msg->buffer_index, data + 1UL, len);   /* RX_DL - 2 Bytes in FF + RX_DL - 1 */
+            msg->buffer_index += len;
+            msg->rest -= len; /* Got another RX_DL - 1 Bytes of Data; */
+            if(msg->BS != 0UL
+                && (--msg->BS_Counter) == 0UL)
+            {
+                /* the block is consumed before the sender may go on */
+                rx_stream(msg, TRUE);
+                if(msg->tp_state == ISOTP_WAIT_DATA)
+                {
+                    timer_refresh(&msg->N_Bx);
+                    err = send_rx_fc(msg);
+                }
+            }
+            else
+            {
+                rx_stream(msg, FALSE);
+            }
+        }
+        
+        break;
+    }
+
+    return err;
+}
+
+/*
+ * Receive a run of Consecutive Frames with one N_Cr check and one timer
+ * update, the run ends at the first frame which is not a CF of msg or
+ * at the end of the message; returns the number of frames used
+ */
+static U32 rcv_cf_run(struct isotp_t* msg, const struct phy_msg_t *frames, U32 n)
+{
+    const struct phy_msg_t *frame = NULL;
+    U32                     len   = CF_DATA_LEN(msg->RX_DL);
+    U32                     take  = 0UL;
+    U32                     i     = 0UL;
+
+    if (timer_overflow(&msg->N_Cx, TIMEOUT_N_Cr))
+    {
+        msg->tp_state = ISOTP_ERROR;
+        msg->reply    = N_TIMEOUT_Cx;
+        return 1UL;
+    }
+
+    for(i = 0UL; i < n; i ++)
+    {
+        frame = &frames[i];
+        if (frame->id != msg->isotp.N_SA || frame->length == 0UL
+            || (frame->data[0] & 0xF0) != N_PCI_CF)
+        {
+            break;
+        }
+        take = (msg->rest < len) ? msg->rest : len;
+        if (frame->length < 1UL + take)
+        {
+            /* ignored, as rcv_cf() does */
+            continue;
+        }
+        if ((frame->data[0] & 0x0F) != (msg->SN & 0x0F))
+        {
+            msg->tp_state   = ISOTP_ERROR;
+            msg->SN         = ISOTP_DEFAULT_SN;
+            msg->reply      = N_WRONG_SN;
+            i ++;
+            break;
+        }
+
+        memcpy(msg->rx_buf + msg->buffer_index, frame->data + 1UL, take);
+        msg->buffer_index += len;
+        msg->SN = (msg->SN + 1U) & 0x0F;
+        if(msg->rest <= len)
+        {
+            /* Last Frame */
+            msg->rest     = 0UL;
+            rx_finish(msg);
+            i ++;
+            break;
+        }
+        msg->rest -= len;
+        if(msg->BS != 0UL
+            && (--msg->BS_Counter) == 0UL)
+        {
+            rx_stream(msg, TRUE);
+            if(msg->tp_state != ISOTP_WAIT_DATA)
+            {
+                i ++;
+                break;
+            }
+            timer_refresh(&msg->N_Bx);
+            (void)send_rx_fc(msg);
+        }
+        else
+        {
+            rx_stream(msg, FALSE);
+            if(msg->tp_state != ISOTP_WAIT_DATA)
+            {
+                i ++;
+                break;
+            }
+        }
+    }
+    timer_refresh(&msg->N_Cx);
+
+    return i;
+}
+
+/*
+ * Receive a Flow Control Frame
+ */
+static ERROR_CODE rcv_fc(struct isotp_t* msg, const struct phy_msg_t *frame)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+    const U8  *data = frame->data;
+    do
+    {
+        if (msg->tp_state != ISOTP_WAIT_FC 
+            && msg->tp_state != ISOTP_WAIT_FIRST_FC)
+        {
+            err = ERR_PARAMETER;
+            break;
+        }
+        if(N_PCI_FC != (data[0] & 0xF0) || frame->length < 3UL)
+        {
+            err = ERR_PARAMETER;
+            break;
+        }
+        /* FS is read from every FC, BS and STmin only from the first one */
+        msg->tx_FS = (enum ISOTP_FS_e)(data[0] & 0x0F);
+        if (msg->tp_state == ISOTP_WAIT_FIRST_FC)
+        {
+            msg->tx_BS = data[1];
+            msg->BS_Counter = msg->tx_BS;
+            msg->tx_STmin = data[2];
+            /* fix wrong separation time values according spec */
+            if ((msg->tx_STmin > 0x7F) 
+                && ((msg->tx_STmin < 0xF1) || (msg->tx_STmin > 0xF9))) 
+            {
+                msg->tx_STmin = ISOTP_DEFAULT_STmin;
+            }
+            if (msg->peer != NULL)
+            {
+                msg->peer->BS    = msg->tx_BS;
+                msg->peer->STmin = msg->tx_STmin;
+            }
+        }
+        switch (msg->tx_FS)
+        {
+            case ISOTP_FS_CTS:
+                msg->wait_count = 0u;
+                msg->tp_state = ISOTP_SEND_CF;
+                if (timer_overflow(&msg->N_Bx, TIMEOUT_N_Bs))
+                {
+                    msg->reply    = N_TIMEOUT_Bx;
+                    msg->tp_state = ISOTP_ERROR;
+                }
+                timer_refresh(&msg->N_Cx);
+                /* the first CF is paced by STmin as well */
+                timer_add(&msg->N_STmin);
+                break;
+            case ISOTP_FS_WAIT:
+                if (msg->peer != NULL)
+                {
+                    msg->peer->waits ++;
+                    msg->peer->msg_waits ++;
+                }
+                if (++msg->wait_count > MAX_FCWAIT_FRAME)
+                {
+                    msg->tp_state = ISOTP_ERROR;
+                    err           = ERR_TIMEOUT;
+                    msg->reply    = N_WFT_OVRN;
+                    break;
+                }
+                timer_refresh(&msg->N_Bx);
+                break;
+            case ISOTP_FS_OVFLW:
+                msg->tp_state = ISOTP_ERROR;
+                err           = ERR_FULL;
+                msg->reply    = N_BUFFER_OVFLW;
+                break;
+            default:
+                msg->tp_state = ISOTP_ERROR;
+                err           = ERR_PARAMETER;
+                msg->reply    = N_INVALID_FS;
+                break;
+        }
+    } while (0);
+
+    return err;
+}
+
+/*
+ * Dispatch a received frame by its N_PCI type
+ */
+static ERROR_CODE rcv_frame(struct isotp_t* msg, const struct phy_msg_t *frame)
+{
+    ERROR_CODE        err        = STATUS_NORMAL;
+    enum n_pci_type_e n_pci_type = (enum n_pci_type_e)(frame->data[0u] & 0xF0);
+
+    if (n_pci_type == N_PCI_FC)
+    {
+        err = rcv_fc(msg, frame);/* tx path: fc frame */
+    }
+    else if (msg->rx_ctx != NULL)
+    {
+        err = rcv_frame(msg->rx_ctx, frame);/* full duplex: rx path of its own */
+    }
+    else if (isotp_busy(msg->tp_state) && msg->tp_state != ISOTP_WAIT_DATA)
+    {
+        /* half duplex: a segmented transmission is in progress */
+        err = ERR_USED;
+    }
+    else
+    {
+        if (msg->tp_state == ISOTP_WAIT_DATA
+            && (n_pci_type == N_PCI_SF || n_pci_type == N_PCI_FF))
+        {
+            /* ISO-15765-2-9.8.3: the reception is ended, the new one starts */
+            msg->rx_active = FALSE;
+            msg->events   |= ISOTP_EVT_UNEXP_PDU;
+        }
+        switch (n_pci_type)
+        {
+            case N_PCI_SF:
+                err = rcv_sf(msg, frame);/* rx path: single frame */
+                break;
+            case N_PCI_FF:
+                err = rcv_ff(msg, frame);/* rx path: first frame */
+                break;
+            case N_PCI_CF:
+                err = rcv_cf(msg, frame);/* rx path: consecutive frame */
+                break;
+            default:
+                /* ISO-15765-2-9.6.1: ignore unknown N_PCI */
+                err = ERR_PARAMETER;
+                break;
+        }
+    }
+
+    return err;
+}
+
+/*
+ * Send the next Consecutive Frame and update the BS/SN bookkeeping
+ */
+static void send_next_cf(struct isotp_t* msg)
+{
+    if(send_cf(msg) == STATUS_NORMAL
+        && msg->tp_state == ISOTP_SEND_CF)
+    {
+        timer_refresh(&msg->N_STmin);
+        if(msg->tx_BS > 0UL)
+        {
+            if((--msg->BS_Counter) == 0UL)
+            {
+                /* The last one CF has been sent */
+                timer_refresh(&msg->N_Bx);
+                msg->BS_Counter = msg->tx_BS;
+                msg->tp_state = ISOTP_WAIT_FC;
+            }
+            else
+            {
+                /* Not the last one CF has been sent */
+                timer_refresh(&msg->N_Cx);
+            }
+        }
+        msg->SN ++;
+        msg->SN &= 0x0F;
+        if(msg->DL > CF_DATA_LEN(msg->TX_DL))
+        {
+            tx_advance(msg, CF_DATA_LEN(msg->TX_DL));
+        }
+        else
+        {
+            tx_advance(msg, msg->DL);
+            msg->tp_state = ISOTP_IDLE;
+        }
+    }
+}
+
+/*
+ * Encode the CFs up to the end of the block (BS), the end of the message
+ * or ISOTP_TX_BATCH in one pass and send them with one batch call,
+ * with STmin > 0 every CF is a block of its own
+ */
+static void send_cf_block(struct isotp_t* msg)
+{
+    struct phy_msg_t frames[ISOTP_TX_BATCH];
+    U32              max = ISOTP_TX_BATCH;
+    U32              n    = 0UL;
+    U32              len  = 0UL;
+    U32              sent = 0UL;
+    ERROR_CODE       err  = STATUS_NORMAL;
+    /* the cursor before the block, the frames the driver refuses give it back */
+    U32              DL           = msg->DL;
+    U32              buffer_index = msg->buffer_index;
+    U32              tx_iov_idx   = msg->tx_iov_idx;
+    U32              tx_iov_off   = msg->tx_iov_off;
+
+    if(tx_gap_us(msg) > 0UL)
+    {
+        max = 1UL;
+    }
+    if(msg->tx_BS > 0UL && msg->BS_Counter < max)
+    {
+        max = msg->BS_Counter;
+    }
+
+    for(n = 0UL; n < max && msg->DL > 0UL; n ++)
+    {
+        len = (msg->DL > CF_DATA_LEN(msg->TX_DL)) ? CF_DATA_LEN(msg->TX_DL) : msg->DL;
+        frames[n].data[0] = (N_PCI_CF | ((msg->SN + n) & 0x0F));
+        if (tx_peek(msg, frames[n].data + 1, len) != STATUS_NORMAL)
+        {
+            /* the block ends with the data the producer had */
+            break;
+        }
+        frame_pad(msg, &frames[n], 1UL + len);
+        tx_advance(msg, len);
+    }
+
+    if (timer_overflow(&msg->N_Cx, TIMEOUT_N_Cs))
+    {
+        msg->tp_state = ISOTP_ERROR;
+        msg->reply    = N_TIMEOUT_Cx;
+        return;
+    }
+    if (n > 0UL && msg->tp_state == ISOTP_SEND_CF)
+    {
+        timer_refresh(&msg->N_Ax);
+        if (msg->isotp.txq != NULL)
+        {
+            /* the queue takes the whole block or nothing */
+            err  = isotp_txq_put(msg->isotp.txq, frames, n, msg->isotp.tx_class);
+            sent = (err == STATUS_NORMAL) ? n : 0UL;
+        }
+        else
+        {
+            err = msg->isotp.phy_send_batch(frames, n, &sent);
+        }
+        timer_snapshot_renew();
+        if (timer_overflow(&msg->N_Ax, TIMEOUT_N_As))
+        {
+            msg->tp_state = ISOTP_ERROR;
+            msg->reply    = N_TIMEOUT_Ax;
+            return;
+        }
+    }
+    else
+    {
+        err = ERR_EMPTY;
+    }
+    if (err != STATUS_NORMAL)
+    {
+        /*
+         * the frames from the first one the driver did not take are
+         * retried by the next poll, as send_next_cf() does; only the
+         * last CF of the message may be short, so the ones taken before
+         * it carry full frames
+         */
+        msg->DL           = DL;
+        msg->buffer_index = buffer_index;
+        msg->tx_iov_idx   = tx_iov_idx;
+        msg->tx_iov_off   = tx_iov_off;
+        if (sent > n)
+        {
+            sent = n;
+        }
+        if (sent == 0UL)
+        {
+            return;
+        }
+        len = sent * CF_DATA_LEN(msg->TX_DL);
+        tx_advance(msg, (len > DL) ? DL : len);
+        n = sent;
+    }
+
+    timer_refresh(&msg->N_Cx);
+    timer_refresh(&msg->N_STmin);
+    msg->SN = (msg->SN + n) & 0x0F;
+    if(msg->tx_BS > 0UL)
+    {
+        msg->BS_Counter -= n;
+        if(msg->BS_Counter == 0UL)
+        {
+            /* The last one CF of the block has been sent */
+            timer_refresh(&msg->N_Bx);
+            msg->BS_Counter = msg->tx_BS;
+            msg->tp_state = ISOTP_WAIT_FC;
+        }
+    }
+    if(msg->DL == 0UL)
+    {
+        msg->tp_state = ISOTP_IDLE;
+    }
+}
+
+/*
+ * Gather len bytes from the current position of the transmit segments
+ * or from the producer, the position is only moved by tx_advance() once
+ * the frame is sent
+ */
+static ERROR_CODE tx_peek(struct isotp_t* msg, U8 *dst, U32 len)
+{
+    const struct isotp_iovec_t *iov = msg->tx_iov + msg->tx_iov_idx;
+    U32                         off = msg->tx_iov_off;
+    U32                         n   = 0UL;
+    ERROR_CODE                  err = STATUS_NORMAL;
+
+    if(msg->tx_producer != NULL)
+    {
+        /* buffer_index is the offset of the next byte to send */
+        err = msg->tx_producer(msg, msg->buffer_index, dst, len);
+        if(err != STATUS_NORMAL && err != ERR_EMPTY)
+        {
+            msg->reply    = N_ERROR;
+            msg->tp_state = ISOTP_ERROR;
+        }
+        return err;
+    }
+
+    while(len > 0UL)
+    {
+        n = iov->len - off;
+        if(n > len)
+        {
+            n = len;
+        }
+        memcpy(dst, iov->base + off, n);
+        dst += n;
+        len -= n;
+        off += n;
+        if(off >= iov->len)
+        {
+            iov ++;
+            off = 0UL;
+        }
+    }
+
+    return err;
+}
+
+static void tx_advance(struct isotp_t* msg, U32 len)
+{
+    U32 n = 0UL;
+
+    msg->buffer_index += len;
+    msg->DL           -= len;
+    while(len > 0UL && msg->tx_iov_idx < msg->tx_iovcnt)
+    {
+        n = msg->tx_iov[msg->tx_iov_idx].len - msg->tx_iov_off;
+        if(n > len)
+        {
+            msg->tx_iov_off += len;
+            break;
+        }
+        len -= n;
+        msg->tx_iov_idx ++;
+        msg->tx_iov_off = 0UL;
+    }
+}
+
+/*
+ * whether a transfer is in progress in a state, a session in it shall
+ * not be given a new request or new settings
+ *
+ * @parameter in:
+ * state: tp_state of a session
+ * @parameter out:
+ * TRUE unless IDLE, FINISHED or ERROR
+ */
+Bool isotp_busy(isotp_states_t state)
+{
+    return (state != ISOTP_IDLE
+            && state != ISOTP_FINISHED
+            && state != ISOTP_ERROR);
+}
+
+/*
+ * Start to send msg->DL bytes of msg->Buffer without blocking,
+ * the transfer is carried on by isotp_poll()/isotp_on_frame()
+ *
+ * @parameter in:
+ * msg: object
+ * @parameter out:
+ * operation status return, ERR_PARAMETER if DL is 0 or above
+ * ISOTP_BUFFER_SIZE, ERR_FULL if the peer refused as long a message
+ * less than its retry delay ago
+ */
+ERROR_CODE isotp_request(struct isotp_t* msg)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(msg == NULL || msg->Buffer == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else if(msg->DL == 0UL || msg->DL > ISOTP_BUFFER_SIZE)
+    {
+        err = ERR_PARAMETER;
+    }
+    else
+    {
+        msg->tx_buf_iov.base = msg->Buffer;
+        msg->tx_buf_iov.len  = msg->DL;
+        err = isotp_request_iov(msg, &msg->tx_buf_iov, 1UL);
+    }
+
+    return err;
+}
+
+/*
+ * Start to send a message made of several segments without copying them,
+ * the segments are read directly while the frames are built
+ *
+ * @parameter in:
+ * msg:    object
+ * iov:    segments of the message, they shall stay valid and unchanged
+ *         until the transmission is finished
+ * iovcnt: number of segments
+ * @parameter out:
+ * operation status return, ERR_FULL if the peer refused as long a
+ * message less than its retry delay ago
+ */
+ERROR_CODE isotp_request_iov(struct isotp_t* msg, const struct isotp_iovec_t *iov, U32 iovcnt)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+    U32        len = 0UL;
+    U32        i   = 0UL;
+
+    if(msg == NULL || (iov == NULL && iovcnt > 0UL))
+    {
+        err = ERR_POINTER_0;
+    }
+    else if(isotp_busy(msg->tp_state))
+    {
+        err = ERR_USED;
+    }
+    else
+    {
+        for(i = 0UL; i < iovcnt; i ++)
+        {
+            len += iov[i].len;
+        }
+    }
+    if(err == STATUS_NORMAL && len == 0UL)
+    {
+        /* there is no SF_DL of 0 */
+        err = ERR_PARAMETER;
+    }
+    else if(err == STATUS_NORMAL && peer_hold(msg, len) == TRUE)
+    {
+        err = ERR_FULL;
+    }
+    else if(err == STATUS_NORMAL)
+    {
+        send_init(msg);
+        msg->tx_iov      = iov;
+        msg->tx_iovcnt   = iovcnt;
+        msg->tx_producer = NULL;
+        msg->DL          = len;
+        err = request_start(msg);
+    }
 
-    if (timer_overflow(&msg->N_Cx, TIMEOUT_N_Cr))
+    return err;
+}
+
+/*
+ * Start to send a message of length bytes which are pulled from the
+ * producer only when the frame carrying them is built, so a large
+ * message (a flash image) need not be staged in memory; the SF or the
+ * FF is built at once, the producer shall have its data ready
+ *
+ * @parameter in:
+ * msg:      object
+ * length:   message length, up to 4 GB with the FF_DL escape sequence
+ * producer: source of the message bytes
+ * @parameter out:
+ * operation status return, ERR_FULL if the peer refused as long a
+ * message less than its retry delay ago
+ */
+ERROR_CODE isotp_request_stream(struct isotp_t* msg, U32 length, isotp_tx_producer producer)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(msg == NULL || producer == NULL)
     {
-        msg->tp_state = ISOTP_ERROR;
-        msg->reply    = N_TIMEOUT_Cx;
+        err = ERR_POINTER_0;
+    }
+    else if(length == 0UL)
+    {
+        err = ERR_PARAMETER;
+    }
+    else if(isotp_busy(msg->tp_state))
+    {
+        err = ERR_USED;
+    }
+    else if(peer_hold(msg, length) == TRUE)
+    {
+        err = ERR_FULL;
     }
     else
     {
-        timer_refresh(&msg->N_Cx);
+        send_init(msg);
+        msg->tx_iov      = NULL;
+        msg->tx_iovcnt   = 0UL;
+        msg->tx_producer = producer;
+        msg->DL          = length;
+        err = request_start(msg);
     }
-    for(;;)
+
+    return err;
+}
+
+/*
+ * Send the SF or the FF of the message set up by a request
+ */
+static ERROR_CODE request_start(struct isotp_t* msg)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    msg->tp_state = ISOTP_SEND;
+    if(msg->peer != NULL)
     {
-        if (msg->tp_state != ISOTP_WAIT_DATA) 
-        {
-            err = ERR_PARAMETER;
-            break;
-        }
-        if ((data[0] & 0x0F) != (msg->SN & 0x0F))
+        msg->peer->msg_waits = 0UL;
+    }
+    if(msg->DL <= SF_MAX_LEN(msg->TX_DL))
+    {
+        err = send_sf(msg);
+        msg->tp_state = ISOTP_IDLE;
+    }
+    else
+    {
+        err = send_ff(msg);
+        if(err == STATUS_NORMAL) // FF complete
         {
-            msg->tp_state   = ISOTP_IDLE;
-            msg->SN         = ISOTP_DEFAULT_SN;
-            msg->reply      = N_WRONG_SN;
-            err             = ERR_PARAMETER;
-            break;
+            tx_advance(msg, FF_DATA_LEN(msg->TX_DL, msg->DL));
+            msg->tp_state = ISOTP_WAIT_FIRST_FC;
         }
+    }
+    if(err != STATUS_NORMAL && msg->reply == N_OK)
+    {
+        msg->reply    = N_ERROR;
+        msg->tp_state = ISOTP_ERROR;
+    }
+    service_notify(msg, ISOTP_SEND);
+    wheel_update(msg);
+
+    return err;
+}
+
+/*
+ * Feed a frame received from the data link layer into the state machine
+ *
+ * @parameter in:
+ * msg:   object
+ * frame: received frame, its id shall be the source address of msg
+ * @parameter out:
+ * operation status return
+ */
+ERROR_CODE isotp_on_frame(struct isotp_t* msg, const struct phy_msg_t *frame)
+{
+    ERROR_CODE err = STATUS_NORMAL;
 
-        if(msg->rest <= 7UL)
+    if(msg == NULL || frame == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else
+    {
+        err = frame_check(&msg->isotp, frame);
+        if(err == STATUS_NORMAL
+            && msg->rx_ctx != NULL
+            && (frame->data[0] & 0xF0) != N_PCI_FC)
         {
-            /* Last Frame */
-            memcpy(msg->Buffer + msg->buffer_index, data + 1UL, msg->rest); /* 6 Bytes in FF + 7 */
-            msg->tp_state = ISOTP_FINISHED;                                 /* per CF skip PCI */
-            msg->rest = 0UL;
+            err = isotp_on_frame(msg->rx_ctx, frame);
+            /* the deadlines of both directions are kept on the node of msg */
+            wheel_update(msg);
         }
-        else
+        else if(err == STATUS_NORMAL)
         {
-            memcpy(msg->Buffer + msg->buffer_index, data + 1UL, 7UL);   /* 6 Bytes in FF + 7 */
-            msg->rest -= 7UL; /* Got another 7 Bytes of Data; */
-            if(msg->BS != 0UL
-                && (--msg->BS_Counter) == 0UL)
-            {
-                timer_refresh(&msg->N_Bx);
-                if(msg->fs_set_cb != NULL)
-                {
-                    msg->fs_set_cb(msg);
-                }
-                msg->BS_Counter = msg->BS;
-                err = send_fc(msg);
-            }
-        }
+            isotp_states_t before = msg->tp_state;
 
-        msg->SN ++;
-        msg->SN           &= 0x0F;
-        msg->buffer_index += 7UL;
-        
-        break;
+            (void)timer_snapshot();
+            err = rcv_frame(msg, frame);
+            service_notify(msg, before);
+            wheel_update(msg);
+            timer_snapshot_end();
+        }
     }
 
     return err;
 }
 
 /*
- * Receive a Flow Control Frame
+ * Feed a vector of received frames, e.g. from recvmmsg() or a driver FIFO,
+ * into the state machine. Runs of CFs are copied with one state check and
+ * one timer update; frames of other ids are skipped.
+ *
+ * It stops after the frame which finishes or aborts a message, so the
+ * message can be taken before the rest is fed in with another call.
+ *
+ * @parameter in:
+ * msg:    object
+ * frames: received frames in bus order
+ * n:      number of frames
+ * @parameter out:
+ * number of frames used
  */
-static ERROR_CODE rcv_fc(struct isotp_t* msg)
+U32 isotp_rx_batch(struct isotp_t* msg, const struct phy_msg_t *frames, U32 n)
 {
-    ERROR_CODE err = STATUS_NORMAL;
-    U8 *data = msg->isotp.phy_rx.data;
-    do
+    U32            i = 0UL;
+    isotp_states_t before;
+
+    if(msg == NULL || frames == NULL || n == 0UL)
     {
-        if (msg->tp_state != ISOTP_WAIT_FC 
-            && msg->tp_state != ISOTP_WAIT_FIRST_FC)
+        return 0UL;
+    }
+
+    if(msg->rx_ctx != NULL)
+    {
+        /* full duplex: a FC goes to msg, a run of other frames to rx_ctx */
+        if((frames[0].data[0] & 0xF0) == N_PCI_FC)
         {
-            err = ERR_PARAMETER;
-            break;
+            (void)isotp_on_frame(msg, &frames[0]);
+            return 1UL;
         }
-        if(N_PCI_FC != (data[0] & 0xF0))
+        for(i = 1UL; i < n && (frames[i].data[0] & 0xF0) != N_PCI_FC; i ++)
+        {}
+        i = isotp_rx_batch(msg->rx_ctx, frames, i);
+        wheel_update(msg);
+        return i;
+    }
+
+    before = msg->tp_state;
+
+    (void)timer_snapshot();
+    while(i < n)
+    {
+        if(frame_check(&msg->isotp, &frames[i]) != STATUS_NORMAL)
         {
-            err = ERR_PARAMETER;
-            break;
+            i ++;
+            continue;
         }
-        /* get communication parameters only from the first FC frame */
-        if (msg->tp_state == ISOTP_WAIT_FIRST_FC)
+        if(msg->tp_state == ISOTP_WAIT_DATA
+            && (frames[i].data[0] & 0xF0) == N_PCI_CF)
         {
-            msg->FS = (enum ISOTP_FS_e)(data[0] & 0x0F);
-            msg->BS = data[1];
-            msg->BS_Counter = msg->BS;
-            msg->STmin = data[2];
-            /* fix wrong separation time values according spec */
-            if ((msg->STmin > 0x7F) 
-                && ((msg->STmin < 0xF1) || (msg->STmin > 0xF9))) 
-            {
-                msg->STmin = ISOTP_DEFAULT_STmin;
-            }
+            i += rcv_cf_run(msg, frames + i, n - i);
         }
-        switch (msg->FS)
+        else
         {
-            case ISOTP_FS_CTS:
-                msg->tp_state = ISOTP_SEND_CF;
-                if (timer_overflow(&msg->N_Bx, TIMEOUT_N_Bs))
+            (void)rcv_frame(msg, &frames[i]);
+            i ++;
+        }
+        if(msg->tp_state == ISOTP_FINISHED || msg->tp_state == ISOTP_ERROR)
+        {
+            break;
+        }
+    }
+    service_notify(msg, before);
+    wheel_update(msg);
+    timer_snapshot_end();
+
+    return i;
+}
+
+/*
+ * Move the state machine one step forward, never blocks
+ *
+ * @parameter in:
+ * msg: object
+ * @parameter out:
+ * state of the state machine after this step
+ */
+isotp_states_t isotp_poll(struct isotp_t* msg)
+{
+    isotp_states_t before = msg->tp_state;
+
+    /* one clock read serves every timer check of this step */
+    (void)timer_snapshot();
+    if(msg->isotp.phy_receive != NULL
+        && receive_port(&msg->isotp) == STATUS_NORMAL)
+    {
+        (void)rcv_frame(msg, &msg->isotp.phy_rx);
+    }
+
+    switch(msg->tp_state)
+    {
+        case ISOTP_WAIT_FIRST_FC:
+            /* break; */
+        case ISOTP_WAIT_FC:
+            if (timer_overflow(&msg->N_Bx, TIMEOUT_N_Bs))
+            {
+                msg->reply    = N_TIMEOUT_Bx;
+                msg->tp_state = ISOTP_ERROR;
+            }
+            break;
+        case ISOTP_SEND_CF:
+            if (timer_overflow(&msg->N_STmin, tx_gap_us(msg)))
+            {
+                if(msg->isotp.phy_send_batch != NULL || msg->isotp.txq != NULL)
                 {
-                    msg->reply    = N_TIMEOUT_Bx;
-                    msg->tp_state = ISOTP_ERROR;
+                    send_cf_block(msg);
                 }
-                timer_refresh(&msg->N_Cx);
-                break;
-            case ISOTP_FS_WAIT:
+                else
+                {
+                    send_next_cf(msg);
+                }
+            }
+            break;
+        case ISOTP_WAIT_DATA:
+            if (timer_overflow(&msg->N_Cx, TIMEOUT_N_Cr))
+            {
+                msg->reply    = N_TIMEOUT_Cx;
+                msg->tp_state = ISOTP_ERROR;
+            }
+            else if (msg->fc_pending == TRUE)
+            {
+                /* the sender waits for the FC the driver refused */
+                if (send_fc(msg, msg->FS) == STATUS_NORMAL)
+                {
+                    msg->fc_pending = FALSE;
+                }
+            }
+            else if (msg->FS == ISOTP_FS_WAIT
+                && timer_overflow(&msg->N_Bx, FC_WAIT_PERIOD))
+            {
+                /* the sender is held by WAIT, tell it again whether it may go on */
                 timer_refresh(&msg->N_Bx);
-                break;
-            case ISOTP_FS_OVFLW:
-                err        = ERR_FULL;
-                msg->reply = N_BUFFER_OVFLW;
-                break;
-            default:
-                msg->tp_state = ISOTP_IDLE;
-                err           = ERR_PARAMETER;
-                msg->reply    = N_INVALID_FS;
-                break;
-        }
-    } while (0);
+                (void)send_rx_fc(msg);
+            }
+            else
+            {}
+            break;
+        default:
+            break;
+    }
+    if(msg->rx_ctx != NULL)
+    {
+        /* the frames read above for it have been handed over already */
+        (void)isotp_poll(msg->rx_ctx);
+    }
 
-    return err;
+    if(!isotp_busy(msg->tp_state))
+    {
+        timer_xdelete(&msg->N_STmin);
+    }
+    service_notify(msg, before);
+    wheel_update(msg);
+    timer_snapshot_end();
+
+    return msg->tp_state;
 }
 
-enum N_Result isotp_send(struct isotp_t* msg)
+/*
+ * Time until isotp_poll() has timer work to do for msg: the next CF is
+ * allowed by STmin, or N_Bs/N_Cr runs out; the transmit queue of msg is
+ * left to the one who pumps it
+ *
+ * @parameter in:
+ * msg: object
+ * @parameter out:
+ * time left in the unit of the timer module, 0 if due,
+ * U32_INVALID_VALUE if no timer is pending
+ */
+U32 isotp_next_deadline(struct isotp_t* msg)
 {
-    ERROR_CODE err = STATUS_NORMAL;
+    U32 remain = U32_INVALID_VALUE;
 
-    if(msg->tp_state != ISOTP_IDLE)
+    switch(msg->tp_state)
     {
-        err = N_ERROR;
+        case ISOTP_SEND_CF:
+            remain = timer_remain(&msg->N_STmin, tx_gap_us(msg));
+            break;
+        case ISOTP_WAIT_FIRST_FC:
+            /* break; */
+        case ISOTP_WAIT_FC:
+            remain = timer_remain(&msg->N_Bx, TIMEOUT_N_Bs);
+            break;
+        case ISOTP_WAIT_DATA:
+            remain = timer_remain(&msg->N_Cx, TIMEOUT_N_Cr);
+            if(msg->FS == ISOTP_FS_WAIT
+                && timer_remain(&msg->N_Bx, FC_WAIT_PERIOD) < remain)
+            {
+                remain = timer_remain(&msg->N_Bx, FC_WAIT_PERIOD);
+            }
+            if(msg->fc_pending == TRUE && WAIT_FC_NAP < remain)
+            {
+                /* a refused FC is tried again after a nap */
+                remain = WAIT_FC_NAP;
+            }
+            break;
+        default:
+            break;
     }
-    else
+    if(msg->rx_ctx != NULL
+        && isotp_next_deadline(msg->rx_ctx) < remain)
     {
-        msg->tp_state = ISOTP_SEND;
-        send_init(msg);
-        while(msg->tp_state != ISOTP_IDLE && msg->tp_state != ISOTP_ERROR)
+        remain = isotp_next_deadline(msg->rx_ctx);
+    }
+
+    return remain;
+}
+
+/*
+ * Pump the transmit queue of msg, nobody else does while the caller is
+ * blocked on msg, then sleep until the next timer or queued frame is
+ * due, at most nap
+ */
+static void wait_nap(struct isotp_t* msg, U32 nap)
+{
+    U32 remain = isotp_next_deadline(msg);
+    U32 queued = U32_INVALID_VALUE;
+
+    if(msg->isotp.txq != NULL)
+    {
+        queued = isotp_txq_pump(msg->isotp.txq);
+        if(queued == 0UL)
         {
-            switch(msg->tp_state)
-            {
-                case ISOTP_IDLE:
-                    break;
-                case ISOTP_SEND:
-                    if(msg->DL <= 7UL)
-                    {
-                        err = send_sf(msg);
-                        msg->tp_state = ISOTP_IDLE;
-                    }
-                    else
-                    {
-                        err = send_ff(msg);
-                        if(err == STATUS_NORMAL) // FF complete
-                        {
-                            msg->buffer_index += 6UL;
-                            msg->DL -= 6UL;
-                            msg->tp_state = ISOTP_WAIT_FIRST_FC;
-                        }
-                    }
-                    break;
-                case ISOTP_WAIT_FIRST_FC:
-                    /* break; */
-                case ISOTP_WAIT_FC:
-                    if(receive_port(&msg->isotp) == STATUS_NORMAL)
-                    {
-                        err = rcv_fc(msg);
-                    }
-                    break;
-                case ISOTP_SEND_CF:
-                    while(msg->tp_state == ISOTP_SEND_CF)
-                    {
-                        fc_delay(msg->STmin);
-                        err = send_cf(msg);
-                        if(err == STATUS_NORMAL)
-                        {
-                            if(msg->BS > 0UL)
-                            {
-                                if((--msg->BS_Counter) == 0UL)
-                                {
-                                    /* The last one CF has been sent */
-                                    timer_refresh(&msg->N_Bx);
-                                    msg->BS_Counter = msg->BS;
-                                    msg->tp_state = ISOTP_WAIT_FC;
-                                    
-                                }
-                                else
-                                {
-                                    /* Not the last one CF has been sent */
-                                    timer_refresh(&msg->N_Cx);
-                                }
-                            }
-                            msg->SN ++;
-                            msg->SN &= 0x0F;
-                            if(msg->DL > 7UL)
-                            {
-                                msg->buffer_index += 7UL;
-                                msg->DL -= 7UL;
-                            }
-                            else
-                            {
-                                msg->buffer_index += msg->DL;
-                                msg->DL = 0UL;
-                                msg->tp_state = ISOTP_IDLE;
-                            }
-                        }
-                    }
-                    break;
-                default:
-                    err = ERR_PARAMETER;
-                break;
-            }
+            /* the driver is full, it is tried again after a nap */
+            queued = WAIT_FC_NAP;
         }
     }
+    if(queued < remain)
+    {
+        remain = queued;
+    }
+    if(remain > nap)
+    {
+        remain = nap;
+    }
+    timer_sleep(remain);
+}
+
+static enum N_Result send_wait(struct isotp_t* msg)
+{
+    while(isotp_poll(msg) != ISOTP_IDLE && msg->tp_state != ISOTP_ERROR)
+    {
+        /*
+         * no frame is expected while CFs are sent, a FC waited for is
+         * looked for every WAIT_FC_NAP
+         */
+        wait_nap(msg, (msg->tp_state == ISOTP_SEND_CF) ? U32_INVALID_VALUE : WAIT_FC_NAP);
+    }
 
     timer_xdelete(&msg->N_Ax);
     timer_xdelete(&msg->N_Bx);
@@ -666,62 +2581,78 @@ enum N_Result isotp_send(struct isotp_t* msg)
     return msg->reply;
 }
 
+enum N_Result isotp_send(struct isotp_t* msg)
+{
+    enum N_Result result = N_ERROR;
+
+    if(isotp_request(msg) == STATUS_NORMAL)
+    {
+        result = send_wait(msg);
+    }
+
+    return result;
+}
+
+enum N_Result isotp_send_iov(struct isotp_t* msg, const struct isotp_iovec_t *iov, U32 iovcnt)
+{
+    enum N_Result result = N_ERROR;
+
+    if(isotp_request_iov(msg, iov, iovcnt) == STATUS_NORMAL)
+    {
+        result = send_wait(msg);
+    }
+
+    return result;
+}
+
+/*
+ * Wait for a message, in the receive context of a full duplex session;
+ * a transmission in progress on msg is carried on meanwhile
+ */
 enum N_Result isotp_receive(struct isotp_t* msg, U32 tmoutUs)
 {
-    enum n_pci_type_e n_pci_type = N_PCI_SF;
-    struct timer_t    tmr;
-    ERROR_CODE        retVal = STATUS_NORMAL;
+    struct timer_t  tmr;
+    struct isotp_t *rx = (msg->rx_ctx != NULL) ? msg->rx_ctx : msg;
 
     if (tmoutUs != 0xFFFFFFFF)
     {
         timer_add(&tmr);
     }
-    msg->reply    = N_OK;
-    msg->tp_state = ISOTP_IDLE;
-    while(msg->reply == N_OK
-            && msg->tp_state != ISOTP_FINISHED
-            && msg->tp_state != ISOTP_ERROR)
+    else
+    {
+        timer_xdelete(&tmr);
+    }
+    if (!isotp_busy(rx->tp_state))
+    {
+        /* the last result has been read, a transfer going on is not dropped */
+        rx->reply    = N_OK;
+        rx->tp_state = ISOTP_IDLE;
+    }
+    while(rx->reply == N_OK
+            && rx->tp_state != ISOTP_FINISHED
+            && rx->tp_state != ISOTP_ERROR)
     {
-        retVal = receive_port(&msg->isotp);
-        if(retVal == STATUS_NORMAL)
+        (void)isotp_poll(msg);
+        if (rx->tp_state != ISOTP_IDLE)
         {
-            n_pci_type = (enum n_pci_type_e)(msg->isotp.phy_rx.data[0u] & 0xF0);
-            switch (n_pci_type)
-            {
-                case N_PCI_FC:
-                    retVal = rcv_fc(msg);/* tx path: fc frame */
-                    break;
-                case N_PCI_SF:
-                    retVal = rcv_sf(msg);/* rx path: single frame */
-                    break;
-                case N_PCI_FF:
-                    retVal = rcv_ff(msg);/* rx path: first frame */
-                    break;
-                case N_PCI_CF:
-                    retVal = rcv_cf(msg);/* rx path: consecutive frame */
-                    break;
-                default:
-                    msg->reply = N_ERROR;
-                    break;
-            }
+            /* a reception is in progress, it is guarded by N_Cr */
             timer_refresh(&tmr);
         }
-
-        if (msg->tp_state == ISOTP_WAIT_DATA)
+        else if (timer_overflow(&tmr, tmoutUs))
         {
-            timer_refresh(&tmr);
+            rx->reply    = N_ERROR;
+            rx->tp_state = ISOTP_ERROR;
         }
-        if (timer_overflow(&tmr, tmoutUs))
+        if (rx->tp_state != ISOTP_FINISHED && rx->tp_state != ISOTP_ERROR)
         {
-            msg->reply    = N_ERROR;
-            msg->tp_state = ISOTP_ERROR;
+            /* the FCs of the reception go out of the queue, a frame is looked for every WAIT_FC_NAP */
+            wait_nap(msg, WAIT_FC_NAP);
         }
     }
 
-    timer_xdelete(&msg->N_Ax);
-    timer_xdelete(&msg->N_Bx);
-    timer_xdelete(&msg->N_Cx);
+    timer_xdelete(&rx->N_Ax);
+    timer_xdelete(&rx->N_Bx);
+    timer_xdelete(&rx->N_Cx);
 
-    return msg->reply;
+    return rx->reply;
 }
-
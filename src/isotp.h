@@ -28,8 +28,31 @@ typedef enum
  */
 #define ISOTP_FF_DL     (4095UL)
 
+/**
+ * ISO-15765-2:2016-9.6.3.1
+ * Messages longer than 4095 bytes use the FF_DL escape sequence: the 12 bit FF_DL
+ * is set to zero and the message length follows as a 32 bit value in N_PCI byte #3..#6.
+ */
+#define ISOTP_FF_DL_ESC (0xFFFFFFFFUL)
+
+/* largest message buffer of the pool, a FF_DL above it is rejected with FS=OVFLW */
+#ifndef ISOTP_BUFFER_SIZE
+#define ISOTP_BUFFER_SIZE   ISOTP_FF_DL
+#endif
+
 #define FRAME_DATA_LEN  (8UL)
 
+/* maximum CAN_DL of a CAN FD frame, valid TX_DL: 8/12/16/20/24/32/48/64 */
+#define CANFD_DATA_LEN  (64UL)
+
+/*
+ * Set in phy_msg_t.id (and N_SA/N_TA) for 29-bit extended identifiers,
+ * ids without this flag are 11-bit standard identifiers
+ */
+#define ISOTP_ID_EXT_FLAG   (0x80000000UL)
+#define ISOTP_STD_ID_MASK   (0x000007FFUL)
+#define ISOTP_EXT_ID_MASK   (0x1FFFFFFFUL)
+
 /* Flow Status given in FC frame */
 enum ISOTP_FS_e
 {
@@ -59,16 +82,92 @@ enum N_Result
     N_ERROR
 };
 
+/* Parameter of N_ChangeParameter.request */
+enum ISOTP_PARAM_e
+{
+    ISOTP_PARAM_STmin = 0,
+    ISOTP_PARAM_BS,
+};
+
+/* Result_ChangeParameter of N_ChangeParameter.confirm */
+enum N_Result_ChangeParameter
+{
+    N_CHANGE_OK = 0,
+    N_RX_ON,            /* a reception is in progress */
+    N_WRONG_PARAMETER,
+    N_WRONG_VALUE
+};
+
 struct phy_msg_t
 {
     U8  new_data;
+    Bool fd;                    /* TRUE: CAN FD frame format */
     U32 id;
     U32 length;
-    U8  data[FRAME_DATA_LEN];
+    U8  data[CANFD_DATA_LEN];
+    U64 timestamp;              /* receive time in ns given by the driver, 0 if unknown;
+                                   reported only, the session timers don't use it */
 };
 
 typedef ERROR_CODE (*isotp_transfer)(struct phy_msg_t *);
 
+/*
+ * send count frames with one call, e.g. by sendmmsg(), and tell in sent
+ * how many of them the driver took: all of them unless an error is
+ * returned, the ones after them are sent again by a later poll
+ */
+typedef ERROR_CODE (*isotp_transfer_batch)(struct phy_msg_t * /*frames*/, U32 /*count*/, U32 * /*sent*/);
+
+/* most CFs encoded in one pass and handed to the batch callback at once */
+#ifndef ISOTP_TX_BATCH
+#define ISOTP_TX_BATCH  (16UL)
+#endif
+
+/* bounds of the separation time a sender adds on its own for a peer, us */
+#ifndef ISOTP_PEER_PACE_MIN
+#define ISOTP_PEER_PACE_MIN     (100UL)
+#endif
+#ifndef ISOTP_PEER_PACE_MAX
+#define ISOTP_PEER_PACE_MAX     (127000UL)
+#endif
+/* bounds of the delay before a refused message is sent again, us */
+#ifndef ISOTP_PEER_RETRY_MIN
+#define ISOTP_PEER_RETRY_MIN    (10000UL)
+#endif
+#ifndef ISOTP_PEER_RETRY_MAX
+#define ISOTP_PEER_RETRY_MAX    (1000000UL)
+#endif
+
+/*
+ * Pacing profile of a target, learnt by the sessions sending to it:
+ * the CFs are spaced by pace on top of STmin, pace grows while the peer
+ * holds the sender with WAIT and shrinks again when it does not; a
+ * message as long as one it refused is not requested again before retry
+ */
+struct isotp_peer_t
+{
+    U8   BS;            /* from the last first FC */
+    U8   STmin;
+    U32  pace;          /* separation added by the sender, us */
+    U32  max_len;       /* longest message the peer has taken */
+    U32  ovflw_len;     /* shortest message refused with OVFLW, 0: none */
+    U32  retry;         /* delay before a refused message is sent again, us */
+    struct timer_t refused;     /* time of the last OVFLW */
+    U32  messages;      /* messages sent in all */
+    U32  waits;         /* FS=WAIT received in all */
+    U32  overflows;     /* FS=OVFLW received in all */
+    U32  msg_waits;     /* FS=WAIT received during the current message */
+};
+
+/* one segment of a message sent without copying it into isotp_t.Buffer */
+struct isotp_iovec_t
+{
+    const U8 *base;
+    U32       len;
+};
+
+struct isotp_txq_t;
+
 struct isotp_msg_t
 {
     struct phy_msg_t phy_rx;
@@ -76,26 +175,119 @@ struct isotp_msg_t
     U32              N_TA;       /* network target address */
     U32              N_SA;       /* network source address */
     isotp_transfer   phy_send;
+    isotp_transfer_batch phy_send_batch;   /* NULL: frames go one by one to phy_send */
     isotp_transfer   phy_receive;
+    struct isotp_txq_t *txq;     /* NULL: frames go straight to the driver */
+    U8               tx_class;   /* priority of the frames in txq, 0 first */
+};
+
+struct isotp_t;
+
+/*
+ * Streaming transmit producer: write the length bytes of the message
+ * which start at byte offset into data, it is called when the frame
+ * carrying them is built; ERR_EMPTY: no data yet, the CF is tried again
+ * by the next poll, any other error aborts the transmission with N_ERROR
+ */
+typedef ERROR_CODE (*isotp_tx_producer)(struct isotp_t * /*msg*/, U32 /*offset*/,
+                                        U8 * /*data*/, U32 /*length*/);
+
+/*
+ * First Frame indication: return a buffer of at least length bytes to
+ * receive the message into, or NULL to reject it with FS=OVFLW
+ */
+typedef U8 *(*isotp_rx_buffer_cb)(struct isotp_t * /*msg*/, U32 /*length*/);
+
+/*
+ * Streaming receive consumer: length bytes of the message, from byte
+ * offset on, are in data; return STATUS_NORMAL to go on receiving,
+ * anything else aborts the reception with N_ERROR
+ */
+typedef ERROR_CODE (*isotp_rx_stream_cb)(struct isotp_t * /*msg*/, U32 /*offset*/,
+                                         const U8 * /*data*/, U32 /*length*/);
+
+/*
+ * Adaptive receiver flow control: BS and STmin of the FC which follows
+ * the FF, and CTS or WAIT at the end of each block, are chosen from the
+ * room left in the consumer and the rate it has been seen to drain at
+ */
+struct isotp_fc_adapt_t
+{
+    U32 (*backlog)(struct isotp_t * /*msg*/);  /* bytes received, not consumed yet */
+    U32  capacity;          /* bytes the consumer can hold */
+    U32  drain;             /* learnt drain rate, bytes per ms, 0: unknown */
+    Bool kept_up;           /* nothing was left at the last FC */
+    U32  last_backlog;
+    U32  last_received;     /* bytes of the message received at the last FC */
+    struct timer_t mark;    /* time of the last FC */
+};
+
+/*
+ * ISO-15765-2 service primitives to the upper layer, each one may be NULL.
+ * They are called at the end of the isotp_request(), isotp_on_frame(),
+ * isotp_rx_batch() or isotp_poll() call which caused them, so a new
+ * request may be made from inside them.
+ */
+struct isotp_service_t
+{
+    /* N_USData.con: the transmission is finished */
+    void (*con)(struct isotp_t * /*msg*/, enum N_Result /*result*/);
+    /* N_USData_FF.ind: a segmented message of length bytes is coming */
+    void (*ff_ind)(struct isotp_t * /*msg*/, U32 /*length*/);
+    /* N_USData.ind: a reception is finished, the data is rx_buf/DL when N_OK
+     * (already given to rx_stream_cb when streaming) */
+    void (*ind)(struct isotp_t * /*msg*/, enum N_Result /*result*/);
+    /* N_ChangeParameter.con */
+    void (*change_con)(struct isotp_t * /*msg*/, enum ISOTP_PARAM_e /*param*/,
+                       enum N_Result_ChangeParameter /*result*/);
 };
 
 struct isotp_t
 {
-    U16             DL; /* data length */
+    U32             DL; /* data length */
+    U8              TX_DL;  /* transmit data link layer length, 8: classic CAN */
+    U8              RX_DL;  /* receive data link layer length, taken from FF */
     isotp_states_t  tp_state;
     U16             SN; /* consecutive frame serial number */
     enum ISOTP_FS_e FS; /* Flow control status */
     U8 BS;              /* setting block size, setting value */
     U8 BS_Counter;      /* block size counter, setting value */
     U8 STmin;           /* SeparationTime minimum */
+    enum ISOTP_FS_e tx_FS;  /* FS of the last FC received, FS/BS/STmin are sent */
+    U8 tx_BS;           /* BS of the first FC received */
+    U8 tx_STmin;        /* STmin of the first FC received */
     ERROR_CODE (*fs_set_cb)(struct isotp_t* /*msg*/);
-    U16 rest;           /* mutilate frame remaining part */
+    struct isotp_fc_adapt_t *fc_adapt;  /* NULL: FC parameters from fc_set()/fs_set_cb */
+    struct isotp_peer_t     *peer;      /* NULL: the sender follows the FC only */
+    struct isotp_t          *rx_ctx;    /* NULL: half duplex, else receives SF/FF/CF */
+    U8 wait_count;      /* FS=WAIT in a row, sent or received */
+    Bool fc_pending;    /* the driver refused the last FC, isotp_poll() sends it again */
+    U32 rest;           /* mutilate frame remaining part */
     struct timer_t N_Ax;/* x: s/r */
     struct timer_t N_Bx;/* x: s/r */
     struct timer_t N_Cx;/* x: s/r */
+    struct timer_t N_STmin; /* separation time between two CF */
     enum N_Result  reply;
-    U8   Buffer[ISOTP_FF_DL];   /* data pool */
-    U16  buffer_index;          /* data_pool current index */
+    U8  *Buffer;                    /* message buffer from the pool, NULL if none */
+    U32  buffer_index;              /* data_pool current index */
+    U8  *rx_buf;                    /* destination of the received message */
+    Bool rx_held;                   /* Buffer holds a received message until isotp_buffer_release() */
+    isotp_rx_buffer_cb rx_buffer_cb;/* NULL: receive into Buffer */
+    isotp_rx_stream_cb rx_stream_cb;/* NULL: the whole message is kept in rx_buf */
+    U8  *rx_stream_buf;             /* window the payload is collected in */
+    U32  rx_stream_size;
+    U32  rx_stream_off;             /* offset of the window in the message */
+    const struct isotp_iovec_t *tx_iov; /* segments being sent */
+    U32  tx_iovcnt;
+    U32  tx_iov_idx;                /* segment of the next byte to send */
+    U32  tx_iov_off;                /* offset of the next byte in the segment */
+    struct isotp_iovec_t tx_buf_iov;/* Buffer as the only segment */
+    isotp_tx_producer tx_producer;  /* NULL: the message is read from tx_iov */
+    struct timer_wheel_t *wheel;    /* NULL: timers are only checked by isotp_poll() */
+    struct timer_node_t   tmo_node; /* next deadline of the session on the wheel */
+    const struct isotp_service_t *service;  /* NULL: results are only polled */
+    U8   events;                    /* indications not yet given to service */
+    Bool rx_active;                 /* a FF has been indicated, its N_USData.ind is due */
     struct isotp_msg_t isotp;   /* isotp data from the bus */
 };
 
@@ -107,7 +299,32 @@ ERROR_CODE isotp_init(struct isotp_t *msg,
                             isotp_transfer isotp_receive);
 enum N_Result isotp_send(struct isotp_t* msg);
 enum N_Result isotp_receive(struct isotp_t* msg, U32 tmoutUs);
+enum N_Result isotp_send_iov(struct isotp_t* msg, const struct isotp_iovec_t *iov, U32 iovcnt);
+ERROR_CODE isotp_request(struct isotp_t* msg);
+ERROR_CODE isotp_request_iov(struct isotp_t* msg, const struct isotp_iovec_t *iov, U32 iovcnt);
+ERROR_CODE isotp_request_stream(struct isotp_t* msg, U32 length, isotp_tx_producer producer);
+ERROR_CODE isotp_on_frame(struct isotp_t* msg, const struct phy_msg_t *frame);
+U32 isotp_rx_batch(struct isotp_t* msg, const struct phy_msg_t *frames, U32 n);
+isotp_states_t isotp_poll(struct isotp_t* msg);
+Bool isotp_busy(isotp_states_t state);
+U32 isotp_next_deadline(struct isotp_t* msg);
 ERROR_CODE fc_set(struct isotp_t *msg, enum ISOTP_FS_e FS, U8 BS, U8 STmin);
+ERROR_CODE isotp_set_fc_adapt(struct isotp_t *msg, struct isotp_fc_adapt_t *adapt,
+                              U32 (*backlog)(struct isotp_t* /*msg*/), U32 capacity);
+ERROR_CODE isotp_set_peer(struct isotp_t *msg, struct isotp_peer_t *peer);
+void isotp_peer_init(struct isotp_peer_t *peer);
+U32 isotp_peer_chunk(const struct isotp_peer_t *peer, U32 length);
+ERROR_CODE isotp_set_tx_dl(struct isotp_t *msg, U8 TX_DL);
+ERROR_CODE isotp_set_rx_buffer_cb(struct isotp_t *msg, isotp_rx_buffer_cb rx_buffer_cb);
+ERROR_CODE isotp_set_rx_stream(struct isotp_t *msg, isotp_rx_stream_cb stream_cb, U8 *window, U32 size);
+ERROR_CODE isotp_set_tx_batch(struct isotp_t *msg, isotp_transfer_batch send_batch);
+ERROR_CODE isotp_set_service(struct isotp_t *msg, const struct isotp_service_t *service);
+enum N_Result_ChangeParameter isotp_change_parameter(struct isotp_t *msg, enum ISOTP_PARAM_e param, U8 value);
+ERROR_CODE isotp_set_duplex(struct isotp_t *msg, struct isotp_t *rx);
+ERROR_CODE isotp_set_txq(struct isotp_t *msg, struct isotp_txq_t *txq, U8 tx_class);
+ERROR_CODE isotp_set_wheel(struct isotp_t *msg, struct timer_wheel_t *wheel);
+U8 *isotp_buffer_alloc(struct isotp_t *msg, U32 length);
+void isotp_buffer_release(struct isotp_t *msg);
 
 #endif
 
@@ -0,0 +1,439 @@
+#include <stddef.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "isotp_engine.h"
+
+/*
+ * A session is owned by whoever flips queued from 0 to 1, it is then on
+ * exactly one run queue until a worker has run it and cleared the flag;
+ * a flag given back or set is seen before the flags read after it
+ */
+#if defined(__GNUC__)
+#define ENGINE_TAKE(flag)   (__atomic_exchange_n((flag), 1, __ATOMIC_ACQ_REL) == 0)
+#define ENGINE_GIVE(flag)   do { __atomic_store_n((flag), 0, __ATOMIC_RELEASE); __atomic_thread_fence(__ATOMIC_SEQ_CST); } while(0)
+#define ENGINE_SET(flag)    do { __atomic_store_n((flag), 1, __ATOMIC_RELEASE); __atomic_thread_fence(__ATOMIC_SEQ_CST); } while(0)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+/* the interlocked operations are full barriers on every target */
+#define ENGINE_TAKE(flag)   (_InterlockedExchange((volatile long *)(flag), 1) == 0)
+#define ENGINE_GIVE(flag)   ((void)_InterlockedExchange((volatile long *)(flag), 0))
+#define ENGINE_SET(flag)    ((void)_InterlockedExchange((volatile long *)(flag), 1))
+#else
+#define ENGINE_TAKE(flag)   (atomic_exchange((flag), 1) == 0)
+#define ENGINE_GIVE(flag)   atomic_store((flag), 0)
+#define ENGINE_SET(flag)    atomic_store((flag), 1)
+#endif
+
+/*
+ * deadlines are waited for on the monotonic clock where a condition
+ * variable can be bound to it, else on the realtime clock
+ */
+#if defined(_POSIX_CLOCK_SELECTION) && (_POSIX_CLOCK_SELECTION > 0)
+#define ENGINE_MONOTONIC    (1)
+#define ENGINE_CLOCK        CLOCK_MONOTONIC
+#else
+#define ENGINE_MONOTONIC    (0)
+#define ENGINE_CLOCK        CLOCK_REALTIME
+#endif
+
+#define ENGINE_SESSION(m)   ((struct isotp_engine_session_t *) \
+                             ((U8 *)(m) - offsetof(struct isotp_engine_session_t, msg)))
+
+/* most frames taken from an inbox at once */
+#define ENGINE_RX_BATCH     (16UL)
+
+/*
+ * a session is on the run queue of its home worker at most once, which has
+ * no more than ISOTP_ENGINE_MAX_SESSION of them, so the queue can't overflow
+ */
+static void runq_push(struct isotp_engine_worker_t *w, struct isotp_engine_session_t *s)
+{
+    w->runq[(w->head + w->count) % ISOTP_ENGINE_MAX_SESSION] = s;
+    w->count ++;
+}
+
+/* the owner works from the head, thieves take from the tail */
+static struct isotp_engine_session_t *runq_pop(struct isotp_engine_worker_t *w, Bool tail)
+{
+    struct isotp_engine_session_t *s = NULL;
+
+    if(w->count > 0UL)
+    {
+        w->count --;
+        if(tail == TRUE)
+        {
+            s = w->runq[(w->head + w->count) % ISOTP_ENGINE_MAX_SESSION];
+        }
+        else
+        {
+            s = w->runq[w->head];
+            w->head = (w->head + 1UL) % ISOTP_ENGINE_MAX_SESSION;
+        }
+    }
+
+    return s;
+}
+
+/* make a session runnable on its home worker */
+static void engine_wake(struct isotp_engine_session_t *s)
+{
+    struct isotp_engine_worker_t *home   = s->home;
+    struct isotp_engine_t        *e      = home->engine;
+    Bool                          behind = FALSE;
+
+    if(ENGINE_TAKE(&s->queued))
+    {
+        pthread_mutex_lock(&home->lock);
+        runq_push(home, s);
+        behind = (home->count > 1UL) ? TRUE : FALSE;
+        pthread_cond_signal(&home->wake);
+        pthread_mutex_unlock(&home->lock);
+        /* the home worker is behind, offer the work to the next one */
+        if(behind == TRUE && e->worker_num > 1UL)
+        {
+            struct isotp_engine_worker_t *peer =
+                &e->worker[((U32)(home - e->worker) + 1UL) % e->worker_num];
+
+            pthread_mutex_lock(&peer->lock);
+            pthread_cond_signal(&peer->wake);
+            pthread_mutex_unlock(&peer->lock);
+        }
+    }
+}
+
+/* wheel callback, the lock of the home worker is held by the advance */
+static void engine_expired(void *arg)
+{
+    struct isotp_engine_session_t *s = (struct isotp_engine_session_t *)arg;
+
+    ENGINE_SET(&s->kick);
+    if(ENGINE_TAKE(&s->queued))
+    {
+        runq_push(s->home, s);
+    }
+}
+
+static void engine_event(struct isotp_engine_t *e, struct isotp_engine_session_t *s)
+{
+    if(e->event_cb != NULL)
+    {
+        e->event_cb(s);
+    }
+}
+
+/* N_USData.ind of a session, each message received or failed is told once */
+static void engine_ind(struct isotp_t *msg, enum N_Result result)
+{
+    struct isotp_engine_session_t *s = ENGINE_SESSION(msg);
+
+    (void)result;
+    engine_event(s->home->engine, s);
+}
+
+/* N_USData.con of a session: the submitted transmission has ended */
+static void engine_con(struct isotp_t *msg, enum N_Result result)
+{
+    struct isotp_engine_session_t *s = ENGINE_SESSION(msg);
+
+    (void)result;
+    s->tx_active = FALSE;
+    engine_event(s->home->engine, s);
+}
+
+static const struct isotp_service_t engine_service = { engine_con, NULL, engine_ind, NULL };
+
+static void engine_run(struct isotp_engine_worker_t *w, struct isotp_engine_session_t *s)
+{
+    struct isotp_engine_t *e   = w->engine;
+    struct isotp_t        *msg = &s->msg;
+    struct phy_msg_t       frames[ENGINE_RX_BATCH];
+    U32                    n    = 0UL;
+    U32                    i    = 0UL;
+    U32                    remain;
+
+    s->kick = 0;
+    w->runs ++;
+    (void)timer_snapshot();
+
+    /* the events are given by engine_con() and engine_ind() */
+    if(s->request != 0)
+    {
+        s->request = 0;
+        s->tx_active = TRUE;
+        if(isotp_request(msg) != STATUS_NORMAL && s->tx_active == TRUE)
+        {
+            /* refused before it started, there is no N_USData.con */
+            s->tx_active = FALSE;
+            engine_event(e, s);
+        }
+    }
+
+    while((n = isotp_ring_get(&s->inbox, frames, ENGINE_RX_BATCH)) > 0UL)
+    {
+        for(i = 0UL; i < n; i += isotp_rx_batch(msg, frames + i, n - i))
+        {}
+    }
+    (void)isotp_poll(msg);
+
+    remain = isotp_next_deadline(msg);
+    timer_snapshot_end();
+
+    pthread_mutex_lock(&s->home->lock);
+    if(remain == U32_INVALID_VALUE)
+    {
+        timer_wheel_disarm(&s->home->wheel, &s->node);
+    }
+    else
+    {
+        timer_wheel_arm(&s->home->wheel, &s->node, remain);
+    }
+    pthread_mutex_unlock(&s->home->lock);
+
+    /* whatever came in while running is not lost */
+    ENGINE_GIVE(&s->queued);
+    if(s->kick != 0 || s->request != 0 || isotp_ring_count(&s->inbox) > 0UL)
+    {
+        engine_wake(s);
+    }
+}
+
+static struct isotp_engine_session_t *engine_steal(struct isotp_engine_t *e, struct isotp_engine_worker_t *w)
+{
+    struct isotp_engine_session_t *s    = NULL;
+    struct isotp_engine_worker_t  *peer = NULL;
+    U32                            self = (U32)(w - e->worker);
+    U32                            k    = 0UL;
+
+    for(k = 1UL; k < e->worker_num && s == NULL; k ++)
+    {
+        peer = &e->worker[(self + k) % e->worker_num];
+        pthread_mutex_lock(&peer->lock);
+        s = runq_pop(peer, TRUE);
+        pthread_mutex_unlock(&peer->lock);
+    }
+    if(s != NULL)
+    {
+        w->steals ++;
+    }
+
+    return s;
+}
+
+static void *engine_worker(void *arg)
+{
+    struct isotp_engine_worker_t  *w = (struct isotp_engine_worker_t *)arg;
+    struct isotp_engine_t         *e = w->engine;
+    struct isotp_engine_session_t *s = NULL;
+    struct timespec                ts;
+    U32                            remain;
+
+    while(e->stop == FALSE)
+    {
+        pthread_mutex_lock(&w->lock);
+        (void)timer_wheel_advance(&w->wheel);
+        s = runq_pop(w, FALSE);
+        pthread_mutex_unlock(&w->lock);
+
+        if(s == NULL)
+        {
+            s = engine_steal(e, w);
+        }
+        if(s != NULL)
+        {
+            engine_run(w, s);
+            continue;
+        }
+
+        /* nothing to run: sleep until woken or the next deadline */
+        pthread_mutex_lock(&w->lock);
+        if(w->count == 0UL && e->stop == FALSE)
+        {
+            remain = timer_wheel_next(&w->wheel);
+            if(remain == U32_INVALID_VALUE)
+            {
+                pthread_cond_wait(&w->wake, &w->lock);
+            }
+            else if(remain > 0UL)
+            {
+                clock_gettime(ENGINE_CLOCK, &ts);
+                ts.tv_sec  += remain / 1000000UL;
+                ts.tv_nsec += (long)(remain % 1000000UL) * 1000L;
+                if(ts.tv_nsec >= 1000000000L)
+                {
+                    ts.tv_sec  ++;
+                    ts.tv_nsec -= 1000000000L;
+                }
+                (void)pthread_cond_timedwait(&w->wake, &w->lock, &ts);
+            }
+            else
+            {}
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+
+    return NULL;
+}
+
+ERROR_CODE isotp_engine_init(struct isotp_engine_t *engine, U32 worker_num, isotp_engine_event_cb event_cb)
+{
+    struct isotp_engine_worker_t *w = NULL;
+    pthread_condattr_t            attr;
+    U32                           i = 0UL;
+
+    if(engine == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+    if(worker_num == 0UL || worker_num > ISOTP_ENGINE_MAX_WORKER)
+    {
+        return ERR_PARAMETER;
+    }
+
+    engine->worker_num = worker_num;
+    engine->event_cb   = event_cb;
+    engine->stop       = FALSE;
+    (void)isotp_table_init(&engine->table);
+
+    pthread_condattr_init(&attr);
+#if ENGINE_MONOTONIC
+    pthread_condattr_setclock(&attr, ENGINE_CLOCK);
+#endif
+    for(i = 0UL; i < worker_num; i ++)
+    {
+        w = &engine->worker[i];
+        pthread_mutex_init(&w->lock, NULL);
+        pthread_cond_init(&w->wake, &attr);
+        timer_wheel_init(&w->wheel, ISOTP_ENGINE_RESOLUTION);
+        w->head     = 0UL;
+        w->count    = 0UL;
+        w->sessions = 0UL;
+        w->engine   = engine;
+        w->runs   = 0UL;
+        w->steals = 0UL;
+    }
+    pthread_condattr_destroy(&attr);
+
+    return STATUS_NORMAL;
+}
+
+ERROR_CODE isotp_engine_add(struct isotp_engine_t *engine, struct isotp_engine_session_t *session)
+{
+    struct isotp_engine_worker_t *home = NULL;
+    ERROR_CODE                    err  = STATUS_NORMAL;
+    U32                           h    = 0UL;
+
+    if(engine == NULL || session == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+    if(session->msg.isotp.txq != NULL)
+    {
+        /* pumped by every worker at once */
+        return ERR_PARAMETER;
+    }
+
+    /* the shard is chosen by the receive id */
+    h = session->msg.isotp.N_SA * 0x9E3779B1UL;
+    h ^= (h >> 16);
+    home = &engine->worker[h % engine->worker_num];
+    if(home->sessions >= ISOTP_ENGINE_MAX_SESSION)
+    {
+        return ERR_FULL;
+    }
+
+    err = isotp_table_add(&engine->table, &session->msg);
+    if(err == STATUS_NORMAL)
+    {
+        home->sessions ++;
+        session->home      = home;
+        session->queued    = 0;
+        session->kick      = 0;
+        session->request   = 0;
+        session->tx_active = FALSE;
+        session->msg.wheel = NULL;
+        (void)isotp_set_service(&session->msg, &engine_service);
+        isotp_ring_init(&session->inbox);
+        timer_node_init(&session->node, engine_expired, session);
+    }
+
+    return err;
+}
+
+ERROR_CODE isotp_engine_start(struct isotp_engine_t *engine)
+{
+    U32 i = 0UL;
+
+    engine->stop = FALSE;
+    for(i = 0UL; i < engine->worker_num; i ++)
+    {
+        if(pthread_create(&engine->worker[i].thread, NULL, engine_worker, &engine->worker[i]) != 0)
+        {
+            engine->worker_num = i;
+            isotp_engine_stop(engine);
+            return ERR_START;
+        }
+    }
+
+    return STATUS_NORMAL;
+}
+
+void isotp_engine_stop(struct isotp_engine_t *engine)
+{
+    U32 i = 0UL;
+
+    engine->stop = TRUE;
+    for(i = 0UL; i < engine->worker_num; i ++)
+    {
+        pthread_mutex_lock(&engine->worker[i].lock);
+        pthread_cond_signal(&engine->worker[i].wake);
+        pthread_mutex_unlock(&engine->worker[i].lock);
+    }
+    for(i = 0UL; i < engine->worker_num; i ++)
+    {
+        pthread_join(engine->worker[i].thread, NULL);
+    }
+}
+
+U32 isotp_engine_post(struct isotp_engine_t *engine, const struct phy_msg_t *frames, U32 n)
+{
+    struct isotp_t                *msg   = NULL;
+    struct isotp_engine_session_t *s     = NULL;
+    U32                            taken = 0UL;
+    U32                            i     = 0UL;
+    U32                            run   = 0UL;
+
+    while(i < n)
+    {
+        /* a run of frames with the same id goes to one inbox at once */
+        for(run = 1UL; i + run < n && frames[i + run].id == frames[i].id; run ++)
+        {}
+        msg = isotp_table_find(&engine->table, frames[i].id);
+        if(msg != NULL)
+        {
+            s = ENGINE_SESSION(msg);
+            taken += isotp_ring_put(&s->inbox, frames + i, run);
+            engine_wake(s);
+        }
+        i += run;
+    }
+
+    return taken;
+}
+
+ERROR_CODE isotp_engine_submit(struct isotp_engine_t *engine, struct isotp_engine_session_t *session)
+{
+    if(engine == NULL || session == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+    if(session->request != 0)
+    {
+        return ERR_USED;
+    }
+
+    ENGINE_SET(&session->request);
+    engine_wake(session);
+
+    return STATUS_NORMAL;
+}
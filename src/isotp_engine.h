@@ -0,0 +1,153 @@
+#ifndef __ISOTP_ENGINE_H__
+#define __ISOTP_ENGINE_H__
+
+#include <pthread.h>
+
+#include "isotp.h"
+#include "isotp_ring.h"
+#include "isotp_table.h"
+
+/*
+ * Multi-core engine: sessions are sharded by CAN id over worker threads.
+ * A session is run by one worker at a time, by its home worker unless an
+ * idle worker steals it; its deadlines stay on the wheel of the home
+ * worker. Frames are handed in by one feeder thread with
+ * isotp_engine_post(), the send functions of the sessions shall be safe to
+ * call from every worker. A transmit queue (isotp_txq_t) is not, so no
+ * session of the engine sends through one.
+ */
+#ifndef ISOTP_ENGINE_MAX_WORKER
+#define ISOTP_ENGINE_MAX_WORKER     (16UL)
+#endif
+/* sessions homed on one worker */
+#ifndef ISOTP_ENGINE_MAX_SESSION
+#define ISOTP_ENGINE_MAX_SESSION    (256UL)
+#endif
+/* tick of the wheels in us */
+#ifndef ISOTP_ENGINE_RESOLUTION
+#define ISOTP_ENGINE_RESOLUTION     (100UL)
+#endif
+
+/*
+ * The run flags of a session are flipped by the GCC/clang or MSVC
+ * intrinsics, else by C11 atomics; a toolchain with none of them cannot
+ * build the engine
+ */
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define ISOTP_ENGINE_FLAG           volatile S32
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L) && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define ISOTP_ENGINE_FLAG           _Atomic S32
+#else
+#error "isotp_engine needs GCC/clang, MSVC or C11 atomics"
+#endif
+
+struct isotp_engine_worker_t;
+
+struct isotp_engine_session_t
+{
+    struct isotp_t                msg;      /* initialized without a receive function */
+    struct isotp_ring_t           inbox;    /* frames from the feeder */
+    struct timer_node_t           node;     /* deadline on the wheel of home */
+    struct isotp_engine_worker_t *home;
+    ISOTP_ENGINE_FLAG             queued;   /* on a run queue or running */
+    ISOTP_ENGINE_FLAG             kick;     /* the deadline fired while running */
+    ISOTP_ENGINE_FLAG             request;  /* isotp_request() to be done */
+    Bool                          tx_active;
+};
+
+struct isotp_engine_worker_t
+{
+    pthread_t                      thread;
+    pthread_mutex_t                lock;    /* run queue and wheel */
+    pthread_cond_t                 wake;
+    struct timer_wheel_t           wheel;
+    struct isotp_engine_session_t *runq[ISOTP_ENGINE_MAX_SESSION];
+    U32                            head;
+    U32                            count;
+    U32                            sessions;/* sessions homed here, the run queue holds them all */
+    struct isotp_engine_t         *engine;
+    U32                            runs;    /* sessions run */
+    U32                            steals;  /* sessions stolen from other workers */
+};
+
+/*
+ * called by a worker when a message is received, a reception fails, or a
+ * submitted transmission ends, from the N_USData.ind and N_USData.con of
+ * the session; the received data shall be taken in it and a buffer of the
+ * pool released
+ */
+typedef void (*isotp_engine_event_cb)(struct isotp_engine_session_t * /*session*/);
+
+struct isotp_engine_t
+{
+    struct isotp_engine_worker_t worker[ISOTP_ENGINE_MAX_WORKER];
+    U32                          worker_num;
+    struct isotp_table_t         table;
+    isotp_engine_event_cb        event_cb;
+    volatile Bool                stop;
+};
+
+/*
+ * @Function: prepare an engine, timer_init_ns() shall be done before
+ * @Parameter: 
+ *  engine: engine object
+ *  worker_num: number of worker threads, e.g. the number of cores
+ *  event_cb: completion callback, may be NULL
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_engine_init(struct isotp_engine_t *engine, U32 worker_num, isotp_engine_event_cb event_cb);
+
+/*
+ * @Function: register a session, before isotp_engine_start(); the
+ *  service primitives of its msg are taken by the engine
+ * @Parameter: 
+ *  engine: engine object
+ *  session: session whose msg is initialized
+ * @Return: ERROR_CODE
+ *  ERR_USED another session owns the same N_SA
+ *  ERR_FULL its worker has ISOTP_ENGINE_MAX_SESSION sessions already
+ *  ERR_PARAMETER msg sends through a transmit queue
+ */
+ERROR_CODE isotp_engine_add(struct isotp_engine_t *engine, struct isotp_engine_session_t *session);
+
+/*
+ * @Function: start the worker threads
+ * @Parameter: 
+ *  engine: engine object
+ * @Return: ERROR_CODE
+ *  ERR_START a thread can't be created
+ */
+ERROR_CODE isotp_engine_start(struct isotp_engine_t *engine);
+
+/*
+ * @Function: stop and join the worker threads
+ * @Parameter: 
+ *  engine: engine object
+ * @Return: NULL
+ */
+void isotp_engine_stop(struct isotp_engine_t *engine);
+
+/*
+ * @Function: hand received frames to their sessions, feeder thread only
+ * @Parameter: 
+ *  engine: engine object
+ *  frames: received frames in bus order
+ *  n: number of frames
+ * @Return: number of frames taken, a frame of an unknown id or for a full
+ *  inbox is dropped
+ */
+U32 isotp_engine_post(struct isotp_engine_t *engine, const struct phy_msg_t *frames, U32 n);
+
+/*
+ * @Function: send msg->Buffer/msg->DL of a session from a worker, neither
+ *  shall be touched until the event of the transmission
+ * @Parameter: 
+ *  engine: engine object
+ *  session: registered session
+ * @Return: ERROR_CODE
+ *  ERR_USED a request is pending already
+ */
+ERROR_CODE isotp_engine_submit(struct isotp_engine_t *engine, struct isotp_engine_session_t *session);
+
+#endif
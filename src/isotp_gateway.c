@@ -0,0 +1,300 @@
+#include <stddef.h>
+#include <string.h>
+
+#include "isotp_gateway.h"
+
+#define GW_PORT_OF_MSG(m)   ((struct isotp_gw_port_t *) \
+                             ((U8 *)(m) - offsetof(struct isotp_gw_port_t, msg)))
+#define GW_PORT_OF_RX(m)    ((struct isotp_gw_port_t *) \
+                             ((U8 *)(m) - offsetof(struct isotp_gw_port_t, rx)))
+
+static U32        gw_backlog(struct isotp_t *msg);
+static ERROR_CODE gw_receive(struct isotp_t *msg, U32 offset, const U8 *data, U32 length);
+static ERROR_CODE gw_produce(struct isotp_t *msg, U32 offset, U8 *data, U32 length);
+static void       gw_rx_failed(struct isotp_gw_port_t *port);
+static void       gw_tx_start(struct isotp_gw_port_t *port);
+static void       gw_tx_check(struct isotp_gw_port_t *port);
+
+/*
+ * Bytes received by the port which the peer has not sent yet, the
+ * adaptive FC of the port holds its sender while they fill the buffer
+ */
+static U32 gw_backlog(struct isotp_t *msg)
+{
+    struct isotp_gw_port_t *port = GW_PORT_OF_RX(msg);
+    U32                     sent = (port->tx_active == TRUE) ? port->peer->msg.buffer_index : 0UL;
+
+    return port->put - port->done - sent;
+}
+
+/*
+ * Streaming consumer of the port, called with each frame received:
+ * the payload is put into the buffer and the peer starts sending the
+ * message as soon as its SF or FF can be built
+ */
+static ERROR_CODE gw_receive(struct isotp_t *msg, U32 offset, const U8 *data, U32 length)
+{
+    struct isotp_gw_port_t *port = GW_PORT_OF_RX(msg);
+    U32                     room = ISOTP_GW_SIZE - gw_backlog(msg);
+    U32                     pos  = 0UL;
+    U32                     n    = 0UL;
+
+    if(offset == 0UL)
+    {
+        if(port->rx_left > 0UL)
+        {
+            /* the message before is given up for this one */
+            gw_rx_failed(port);
+        }
+        if(port->count >= ISOTP_GW_QUEUE || length > room)
+        {
+            port->dropped ++;
+            return ERR_FULL;
+        }
+        port->length[(port->head + port->count) % ISOTP_GW_QUEUE] = msg->DL;
+        port->count ++;
+        port->rx_left = msg->DL;
+        /*
+         * the peer may send slower than this message comes in, it is only
+         * let run free by its first FC if it fits into the room left
+         */
+        port->adapt.kept_up = FALSE;
+    }
+    else if(port->rx_skip == TRUE)
+    {
+        /* the peer could not send it on, the sender is stopped too */
+        port->rx_skip = FALSE;
+        port->rx_left = 0UL;
+        return ERR_FAIL;
+    }
+    else if(length > room)
+    {
+        /* the FC did not hold the sender */
+        gw_rx_failed(port);
+        return ERR_FULL;
+    }
+    else
+    {}
+
+    pos = port->put % ISOTP_GW_SIZE;
+    n   = ISOTP_GW_SIZE - pos;
+    if(n > length)
+    {
+        n = length;
+    }
+    memcpy(port->buf + pos, data, n);
+    memcpy(port->buf, data + n, length - n);
+    port->put     += length;
+    port->rx_left -= length;
+    gw_tx_start(port);
+
+    return STATUS_NORMAL;
+}
+
+/*
+ * Streaming producer of the port, it sends on the first message
+ * received by the peer; ERR_EMPTY holds the CF until its bytes come in
+ */
+static ERROR_CODE gw_produce(struct isotp_t *msg, U32 offset, U8 *data, U32 length)
+{
+    struct isotp_gw_port_t *port = GW_PORT_OF_MSG(msg)->peer;
+    U32                     pos  = 0UL;
+    U32                     n    = 0UL;
+
+    if(offset + length > port->put - port->done)
+    {
+        /* the rest of a message cut short will not come */
+        return (port->tx_abort == TRUE) ? ERR_FAIL : ERR_EMPTY;
+    }
+
+    pos = (port->done + offset) % ISOTP_GW_SIZE;
+    n   = ISOTP_GW_SIZE - pos;
+    if(n > length)
+    {
+        n = length;
+    }
+    memcpy(data, port->buf + pos, n);
+    memcpy(data + n, port->buf, length - n);
+
+    return STATUS_NORMAL;
+}
+
+/*
+ * The message being received will not be complete: what came in is
+ * still sent on and then aborted if the peer has started it, else it
+ * is taken out of the buffer
+ */
+static void gw_rx_failed(struct isotp_gw_port_t *port)
+{
+    U32 tail = (port->head + port->count - 1UL) % ISOTP_GW_QUEUE;
+    U32 got  = 0UL;
+
+    if(port->rx_skip == TRUE)
+    {
+        /* out of the buffer already */
+        port->rx_skip = FALSE;
+    }
+    else if(port->count == 1UL && port->tx_active == TRUE)
+    {
+        port->length[tail] -= port->rx_left;
+        port->tx_abort      = TRUE;
+    }
+    else
+    {
+        got           = port->length[tail] - port->rx_left;
+        port->put    -= got;
+        port->count  --;
+        port->dropped ++;
+    }
+    port->rx_left = 0UL;
+}
+
+/*
+ * Let the peer send the first message once its SF or FF can be built
+ */
+static void gw_tx_start(struct isotp_gw_port_t *port)
+{
+    struct isotp_t *out  = &port->peer->msg;
+    U32             len  = 0UL;
+    U32             need = 0UL;
+
+    if(port->tx_active == TRUE || port->count == 0UL || isotp_busy(out->tp_state) == TRUE)
+    {
+        return;
+    }
+
+    len  = port->length[port->head];
+    need = (len < out->TX_DL) ? len : out->TX_DL;
+    if(port->put - port->done >= need
+        && isotp_request_stream(out, len, gw_produce) == STATUS_NORMAL)
+    {
+        /* else tried again by the next poll, e.g. the peer retry delay is not over */
+        port->tx_active = TRUE;
+    }
+}
+
+/*
+ * Take the first message out of the buffer once the peer has sent it
+ * or given it up, then start the next one
+ */
+static void gw_tx_check(struct isotp_gw_port_t *port)
+{
+    struct isotp_t *out = &port->peer->msg;
+    U32             len = 0UL;
+
+    if(port->tx_active == TRUE && isotp_busy(out->tp_state) == FALSE)
+    {
+        len = port->length[port->head];
+        if(out->reply == N_OK && port->tx_abort == FALSE)
+        {
+            port->routed ++;
+        }
+        else
+        {
+            port->dropped ++;
+        }
+        if(port->put - port->done < len)
+        {
+            /* given up while it is still coming in, the rest is not taken */
+            port->done    = port->put;
+            port->rx_skip = TRUE;
+        }
+        else
+        {
+            port->done += len;
+        }
+        port->head      = (port->head + 1UL) % ISOTP_GW_QUEUE;
+        port->count    --;
+        port->tx_active = FALSE;
+        port->tx_abort  = FALSE;
+    }
+    gw_tx_start(port);
+}
+
+ERROR_CODE isotp_gw_init(struct isotp_gw_t *gw)
+{
+    ERROR_CODE              err  = STATUS_NORMAL;
+    struct isotp_gw_port_t *port = NULL;
+    U32                     i    = 0UL;
+
+    if(gw == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+
+    for(i = 0UL; i < 2UL && err == STATUS_NORMAL; i ++)
+    {
+        port = &gw->port[i];
+        port->peer      = &gw->port[1UL - i];
+        port->put       = 0UL;
+        port->done      = 0UL;
+        port->head      = 0UL;
+        port->count     = 0UL;
+        port->rx_left   = 0UL;
+        port->tx_active = FALSE;
+        port->tx_abort  = FALSE;
+        port->rx_skip   = FALSE;
+        port->routed    = 0UL;
+        port->dropped   = 0UL;
+        err = isotp_set_duplex(&port->msg, &port->rx);
+        if(err == STATUS_NORMAL)
+        {
+            /* a window of one frame: each CF is handed on as it comes */
+            err = isotp_set_rx_stream(&port->rx, gw_receive, port->window, port->msg.TX_DL);
+        }
+        if(err == STATUS_NORMAL)
+        {
+            err = isotp_set_fc_adapt(&port->rx, &port->adapt, gw_backlog, ISOTP_GW_SIZE);
+        }
+    }
+
+    return err;
+}
+
+ERROR_CODE isotp_gw_on_frame(struct isotp_gw_t *gw, U32 port, const struct phy_msg_t *frame)
+{
+    if(gw == NULL || frame == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+    if(port > 1UL)
+    {
+        return ERR_PARAMETER;
+    }
+
+    return isotp_on_frame(&gw->port[port].msg, frame);
+}
+
+U32 isotp_gw_poll(struct isotp_gw_t *gw)
+{
+    struct isotp_gw_port_t *port   = NULL;
+    U32                     remain = U32_INVALID_VALUE;
+    U32                     r      = 0UL;
+    U32                     i      = 0UL;
+
+    if(gw == NULL)
+    {
+        return U32_INVALID_VALUE;
+    }
+
+    for(i = 0UL; i < 2UL; i ++)
+    {
+        (void)isotp_poll(&gw->port[i].msg);
+    }
+    for(i = 0UL; i < 2UL; i ++)
+    {
+        port = &gw->port[i];
+        if(port->rx_left > 0UL && port->rx.tp_state != ISOTP_WAIT_DATA)
+        {
+            gw_rx_failed(port);
+        }
+        gw_tx_check(port);
+        r = isotp_next_deadline(&port->msg);
+        if(r < remain)
+        {
+            remain = r;
+        }
+    }
+
+    return remain;
+}
@@ -0,0 +1,83 @@
+
+#ifndef __ISOTP_GATEWAY_H__
+#define __ISOTP_GATEWAY_H__
+
+#include "isotp.h"
+
+/*
+ * Cut-through gateway between two buses: each port is a full duplex
+ * session on its bus, what one port receives is sent on by the other
+ * one while it is still coming in, so a message is delayed by about a
+ * block instead of by the whole message. The addressing of each bus is
+ * the one its port is initialized with, each port sends and takes its
+ * own FCs: the receiving side flow-controls its sender from the room
+ * left in the buffer between the ports.
+ */
+/* bytes held between the ports, per direction, a power of two */
+#ifndef ISOTP_GW_SIZE
+#define ISOTP_GW_SIZE       (4096UL)
+#endif
+/* messages received and not sent on yet, per direction */
+#ifndef ISOTP_GW_QUEUE
+#define ISOTP_GW_QUEUE      (4UL)
+#endif
+
+struct isotp_gw_port_t
+{
+    struct isotp_t  msg;        /* session on the bus of the port */
+    struct isotp_t  rx;         /* its receive context */
+    struct isotp_gw_port_t *peer;   /* port the received messages are sent on by */
+    U8   window[CANFD_DATA_LEN];/* frame being received */
+    U8   buf[ISOTP_GW_SIZE];    /* received bytes the peer has not sent yet */
+    U32  put;                   /* bytes put into buf, counting on over the messages */
+    U32  done;                  /* count of put at the first byte of the first message */
+    U32  length[ISOTP_GW_QUEUE];/* messages in buf, the first one is sent on first */
+    U32  head;
+    U32  count;
+    U32  rx_left;               /* bytes of the message being received still to come */
+    Bool tx_active;             /* the peer is sending the first message */
+    Bool tx_abort;              /* the first message is cut short, the peer aborts it */
+    Bool rx_skip;               /* the message being received is dropped */
+    struct isotp_fc_adapt_t adapt;
+    U32  routed;                /* messages sent on */
+    U32  dropped;               /* messages lost on the way */
+};
+
+struct isotp_gw_t
+{
+    struct isotp_gw_port_t port[2];
+};
+
+/*
+ * @Function: connect the ports, port[0].msg and port[1].msg shall be
+ *  initialized with isotp_init() before, with the ids of their bus, the
+ *  send function of their bus and no receive function, and given the
+ *  TX_DL of their bus; the receive and the flow control settings of the
+ *  ports are made here
+ * @Parameter:
+ *  gw: gateway object
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_gw_init(struct isotp_gw_t *gw);
+
+/*
+ * @Function: hand a frame of the bus of a port to the gateway
+ * @Parameter:
+ *  gw:    gateway object
+ *  port:  0 or 1
+ *  frame: received frame
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_gw_on_frame(struct isotp_gw_t *gw, U32 port, const struct phy_msg_t *frame);
+
+/*
+ * @Function: run the timers of the ports and start sending on the
+ *  messages whose beginning has come in
+ * @Parameter:
+ *  gw: gateway object
+ * @Return: time until a port has timer work to do, us,
+ *  U32_INVALID_VALUE if none has
+ */
+U32 isotp_gw_poll(struct isotp_gw_t *gw);
+
+#endif
@@ -0,0 +1,94 @@
+#include "isotp_pool.h"
+
+/*
+ * A block is owned by whoever flips its flag from 0 to 1,
+ * so allocations from the rx and tx threads need no lock
+ */
+#if defined(_MSC_VER)
+#include <windows.h>
+#define POOL_TAKE(flag)     (InterlockedExchange((volatile LONG *)(flag), 1) == 0)
+#define POOL_GIVE(flag)     InterlockedExchange((volatile LONG *)(flag), 0)
+#elif defined(__GNUC__)
+#define POOL_TAKE(flag)     (__sync_lock_test_and_set((flag), 1) == 0)
+#define POOL_GIVE(flag)     __sync_lock_release(flag)
+#else
+#define POOL_TAKE(flag)     ((*(flag) == 0) ? ((*(flag) = 1) != 0) : FALSE)
+#define POOL_GIVE(flag)     (*(flag) = 0)
+#endif
+
+struct pool_class_t
+{
+    U8           *base;
+    U32           size;
+    U32           num;
+    volatile S32 *used;
+};
+
+static U8 pool_sf[ISOTP_POOL_SF_NUM][ISOTP_POOL_SF_SIZE];
+static U8 pool_small[ISOTP_POOL_SMALL_NUM][ISOTP_POOL_SMALL_SIZE];
+static U8 pool_full[ISOTP_POOL_FULL_NUM][ISOTP_POOL_FULL_SIZE];
+
+static volatile S32 used_sf[ISOTP_POOL_SF_NUM];
+static volatile S32 used_small[ISOTP_POOL_SMALL_NUM];
+static volatile S32 used_full[ISOTP_POOL_FULL_NUM];
+
+/* sorted by size */
+static const struct pool_class_t pool_class[] =
+{
+    { &pool_sf[0][0],    ISOTP_POOL_SF_SIZE,    ISOTP_POOL_SF_NUM,    used_sf    },
+    { &pool_small[0][0], ISOTP_POOL_SMALL_SIZE, ISOTP_POOL_SMALL_NUM, used_small },
+    { &pool_full[0][0],  ISOTP_POOL_FULL_SIZE,  ISOTP_POOL_FULL_NUM,  used_full  },
+};
+
+#define POOL_CLASS_NUM  (sizeof(pool_class) / sizeof(pool_class[0]))
+
+U8 *isotp_pool_alloc(U32 size)
+{
+    U8  *buf = NULL;
+    U32  c   = 0UL;
+    U32  i   = 0UL;
+
+    /* fall back to the next larger class when a class is exhausted */
+    for(c = 0UL; c < POOL_CLASS_NUM && buf == NULL; c ++)
+    {
+        if(size > pool_class[c].size)
+        {
+            continue;
+        }
+        for(i = 0UL; i < pool_class[c].num; i ++)
+        {
+            if(POOL_TAKE(&pool_class[c].used[i]))
+            {
+                buf = pool_class[c].base + i * pool_class[c].size;
+                break;
+            }
+        }
+    }
+
+    return buf;
+}
+
+ERROR_CODE isotp_pool_free(U8 *buf)
+{
+    ERROR_CODE err    = ERR_NOT_FOUND;
+    U32        c      = 0UL;
+    U32        offset = 0UL;
+
+    for(c = 0UL; c < POOL_CLASS_NUM && buf != NULL; c ++)
+    {
+        if(buf < pool_class[c].base
+            || buf >= pool_class[c].base + pool_class[c].num * pool_class[c].size)
+        {
+            continue;
+        }
+        offset = (U32)(buf - pool_class[c].base);
+        if(offset % pool_class[c].size == 0UL)
+        {
+            POOL_GIVE(&pool_class[c].used[offset / pool_class[c].size]);
+            err = STATUS_NORMAL;
+        }
+        break;
+    }
+
+    return err;
+}
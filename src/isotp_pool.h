@@ -0,0 +1,48 @@
+
+#ifndef __ISOTP_POOL_H__
+#define __ISOTP_POOL_H__
+
+#include "isotp.h"
+
+/*
+ * Message buffers are taken from fixed size classes instead of being
+ * embedded in every isotp_t, a request is served by the smallest class
+ * with a free block. Counts and sizes may be overridden at build time.
+ */
+#ifndef ISOTP_POOL_SF_SIZE
+#define ISOTP_POOL_SF_SIZE      (CANFD_DATA_LEN)    /* single frames */
+#endif
+#ifndef ISOTP_POOL_SF_NUM
+#define ISOTP_POOL_SF_NUM       (32UL)
+#endif
+#ifndef ISOTP_POOL_SMALL_SIZE
+#define ISOTP_POOL_SMALL_SIZE   (512UL)             /* small multi-frame messages */
+#endif
+#ifndef ISOTP_POOL_SMALL_NUM
+#define ISOTP_POOL_SMALL_NUM    (16UL)
+#endif
+#ifndef ISOTP_POOL_FULL_SIZE
+#define ISOTP_POOL_FULL_SIZE    (ISOTP_BUFFER_SIZE) /* full size messages */
+#endif
+#ifndef ISOTP_POOL_FULL_NUM
+#define ISOTP_POOL_FULL_NUM     (4UL)
+#endif
+
+/*
+ * @Function: take a buffer from the pool, safe to call from several threads
+ * @Parameter: 
+ *  size: minimum size of the buffer
+ * @Return: buffer, NULL if size is too large or all blocks are in use
+ */
+U8 *isotp_pool_alloc(U32 size);
+
+/*
+ * @Function: give a buffer back to the pool
+ * @Parameter: 
+ *  buf: buffer from isotp_pool_alloc()
+ * @Return: ERROR_CODE
+ *  ERR_NOT_FOUND buf is not a block of the pool
+ */
+ERROR_CODE isotp_pool_free(U8 *buf);
+
+#endif
@@ -0,0 +1,242 @@
+#include "isotp_reactor.h"
+
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+
+static ERROR_CODE reactor_watch(struct isotp_reactor_t *reactor, struct isotp_reactor_port_t *port)
+{
+    struct epoll_event ev;
+
+    ev.events   = EPOLLIN;
+    ev.data.ptr = port;
+    if(epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, port->fd, &ev) < 0)
+    {
+        return ERR_IO;
+    }
+    reactor->port_num ++;
+
+    return STATUS_NORMAL;
+}
+
+/* arm the timerfd to the earliest deadline, disarm it if there is none */
+static void reactor_arm(struct isotp_reactor_t *reactor, U32 remainUs)
+{
+    struct itimerspec its;
+
+    its.it_interval.tv_sec  = 0;
+    its.it_interval.tv_nsec = 0;
+    its.it_value.tv_sec     = 0;
+    its.it_value.tv_nsec    = 0;
+    if(remainUs != U32_INVALID_VALUE)
+    {
+        its.it_value.tv_sec  = remainUs / 1000000u;
+        its.it_value.tv_nsec = (remainUs % 1000000u) * 1000u;
+    }
+    (void)timerfd_settime(reactor->tfd, 0, &its, NULL);
+}
+
+ERROR_CODE isotp_reactor_init(struct isotp_reactor_t *reactor)
+{
+    struct epoll_event ev;
+
+    if(reactor == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+
+    reactor->port_num = 0UL;
+    reactor->stop     = FALSE;
+    reactor->txq      = NULL;
+    reactor->epfd     = epoll_create1(EPOLL_CLOEXEC);
+    reactor->tfd      = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    timer_wheel_init(&reactor->wheel, ISOTP_REACTOR_RESOLUTION);
+
+    /* the timerfd is told apart by a NULL pointer */
+    ev.events   = EPOLLIN;
+    ev.data.ptr = NULL;
+    if(reactor->epfd < 0 || reactor->tfd < 0
+        || epoll_ctl(reactor->epfd, EPOLL_CTL_ADD, reactor->tfd, &ev) < 0)
+    {
+        isotp_reactor_close(reactor);
+        return ERR_OPEN;
+    }
+
+    return STATUS_NORMAL;
+}
+
+void isotp_reactor_close(struct isotp_reactor_t *reactor)
+{
+    if(reactor->tfd >= 0)
+    {
+        close(reactor->tfd);
+        reactor->tfd = -1;
+    }
+    if(reactor->epfd >= 0)
+    {
+        close(reactor->epfd);
+        reactor->epfd = -1;
+    }
+}
+
+ERROR_CODE isotp_reactor_add_can(struct isotp_reactor_t *reactor,
+                                 struct isotp_socketcan_t *can,
+                                 const struct isotp_table_t *table)
+{
+    struct isotp_reactor_port_t *port = NULL;
+
+    if(reactor == NULL || can == NULL || table == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+    if(reactor->port_num >= ISOTP_REACTOR_MAX_PORT)
+    {
+        return ERR_FULL;
+    }
+
+    port           = &reactor->port[reactor->port_num];
+    port->fd       = can->fd;
+    port->can      = can;
+    port->table    = table;
+    port->ready_cb = NULL;
+    port->arg      = NULL;
+
+    return reactor_watch(reactor, port);
+}
+
+ERROR_CODE isotp_reactor_add_fd(struct isotp_reactor_t *reactor, int fd,
+                                void (*ready_cb)(void *), void *arg)
+{
+    struct isotp_reactor_port_t *port = NULL;
+
+    if(reactor == NULL || ready_cb == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+    if(reactor->port_num >= ISOTP_REACTOR_MAX_PORT)
+    {
+        return ERR_FULL;
+    }
+
+    port           = &reactor->port[reactor->port_num];
+    port->fd       = fd;
+    port->can      = NULL;
+    port->table    = NULL;
+    port->ready_cb = ready_cb;
+    port->arg      = arg;
+
+    return reactor_watch(reactor, port);
+}
+
+ERROR_CODE isotp_reactor_add_session(struct isotp_reactor_t *reactor, struct isotp_t *msg)
+{
+    if(reactor == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+
+    return isotp_set_wheel(msg, &reactor->wheel);
+}
+
+ERROR_CODE isotp_reactor_set_txq(struct isotp_reactor_t *reactor, struct isotp_txq_t *txq)
+{
+    if(reactor == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+    reactor->txq = txq;
+
+    return STATUS_NORMAL;
+}
+
+ERROR_CODE isotp_reactor_run_once(struct isotp_reactor_t *reactor, U32 timeoutUs)
+{
+    struct epoll_event           ev[ISOTP_REACTOR_MAX_PORT + 1UL];
+    struct isotp_reactor_port_t *port   = NULL;
+    U64                          expiry = 0u;
+    U32                          remain = U32_INVALID_VALUE;
+    U32                          r      = U32_INVALID_VALUE;
+    int                          waitMs = -1;
+    int                          n      = 0;
+    int                          i      = 0;
+
+    /* the frames queued by the last iteration go out as the budget allows */
+    if(reactor->txq != NULL)
+    {
+        r = isotp_txq_pump(reactor->txq);
+        if(r == 0u)
+        {
+            /* the socket is full, try again a tick later */
+            r = ISOTP_REACTOR_RESOLUTION;
+        }
+    }
+    remain = timer_wheel_next(&reactor->wheel);
+    if(r < remain)
+    {
+        remain = r;
+    }
+
+    /* a due deadline is handled at once, the timerfd wakes up for the others */
+    if(remain == 0u)
+    {
+        waitMs = 0;
+    }
+    else
+    {
+        reactor_arm(reactor, remain);
+        if(timeoutUs != U32_INVALID_VALUE)
+        {
+            waitMs = (int)((timeoutUs + 999u) / 1000u);
+        }
+    }
+
+    n = epoll_wait(reactor->epfd, ev, (int)(reactor->port_num + 1UL), waitMs);
+    if(n < 0 && errno != EINTR)
+    {
+        return ERR_IO;
+    }
+
+    /* one clock read for the frames and the deadlines of this iteration */
+    (void)timer_snapshot();
+    for(i = 0; i < n; i ++)
+    {
+        port = (struct isotp_reactor_port_t *)ev[i].data.ptr;
+        if(port == NULL)
+        {
+            (void)read(reactor->tfd, &expiry, sizeof(expiry));
+        }
+        else if(port->can != NULL)
+        {
+            /* a full batch means more frames may be waiting */
+            while(isotp_socketcan_dispatch(port->can, port->table) == ISOTP_SOCKETCAN_BATCH)
+            {}
+        }
+        else
+        {
+            port->ready_cb(port->arg);
+        }
+    }
+    (void)timer_wheel_advance(&reactor->wheel);
+    timer_snapshot_end();
+
+    return STATUS_NORMAL;
+}
+
+ERROR_CODE isotp_reactor_run(struct isotp_reactor_t *reactor)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    reactor->stop = FALSE;
+    while(reactor->stop == FALSE && err == STATUS_NORMAL)
+    {
+        err = isotp_reactor_run_once(reactor, U32_INVALID_VALUE);
+    }
+
+    return err;
+}
+
+void isotp_reactor_stop(struct isotp_reactor_t *reactor)
+{
+    reactor->stop = TRUE;
+}
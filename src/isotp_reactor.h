@@ -0,0 +1,134 @@
+#ifndef __ISOTP_REACTOR_H__
+#define __ISOTP_REACTOR_H__
+
+#include "isotp.h"
+#include "isotp_table.h"
+#include "isotp_socketcan.h"
+#include "isotp_txq.h"
+
+/*
+ * Linux event loop for many sessions on one thread: it sleeps in
+ * epoll_wait() on the CAN sockets and on one timerfd armed to the earliest
+ * session deadline of its timer wheel, so an idle loop uses no CPU. The
+ * transmit queue of the sessions, if they share one, is pumped by it.
+ */
+#ifndef ISOTP_REACTOR_MAX_PORT
+#define ISOTP_REACTOR_MAX_PORT      (16UL)
+#endif
+/* tick of the timer wheel in us, STmin=0 runs of CFs are sent once a tick */
+#ifndef ISOTP_REACTOR_RESOLUTION
+#define ISOTP_REACTOR_RESOLUTION    (100UL)
+#endif
+
+struct isotp_reactor_port_t
+{
+    int                          fd;
+    struct isotp_socketcan_t    *can;      /* NULL: ready_cb handles the fd */
+    const struct isotp_table_t  *table;    /* sessions of the frames of can */
+    void                       (*ready_cb)(void * /*arg*/);
+    void                        *arg;
+};
+
+struct isotp_reactor_t
+{
+    int                         epfd;
+    int                         tfd;       /* timerfd of the earliest deadline */
+    Bool                        stop;
+    struct timer_wheel_t        wheel;     /* deadlines of the sessions */
+    struct isotp_reactor_port_t port[ISOTP_REACTOR_MAX_PORT];
+    U32                         port_num;
+    struct isotp_txq_t         *txq;       /* NULL: the sessions send straight */
+};
+
+/*
+ * @Function: create the epoll instance and the timerfd,
+ *  timer_init_ns() or timer_init() shall be done before
+ * @Parameter: 
+ *  reactor: reactor object
+ * @Return: ERROR_CODE
+ *  ERR_OPEN the epoll instance or the timerfd can't be created
+ */
+ERROR_CODE isotp_reactor_init(struct isotp_reactor_t *reactor);
+
+/*
+ * @Function: release the epoll instance and the timerfd, the sockets are
+ *  left open
+ * @Parameter: 
+ *  reactor: reactor object
+ * @Return: NULL
+ */
+void isotp_reactor_close(struct isotp_reactor_t *reactor);
+
+/*
+ * @Function: watch a CAN socket, its frames are dispatched to the sessions
+ *  of table
+ * @Parameter: 
+ *  reactor: reactor object
+ *  can: opened socket
+ *  table: sessions receiving from the socket
+ * @Return: ERROR_CODE
+ *  ERR_FULL ISOTP_REACTOR_MAX_PORT fds are watched already
+ */
+ERROR_CODE isotp_reactor_add_can(struct isotp_reactor_t *reactor,
+                                 struct isotp_socketcan_t *can,
+                                 const struct isotp_table_t *table);
+
+/*
+ * @Function: watch any other readable fd, e.g. an eventfd of a driver
+ * @Parameter: 
+ *  reactor: reactor object
+ *  fd: file descriptor
+ *  ready_cb: called with arg when fd is readable
+ * @Return: ERROR_CODE
+ *  ERR_FULL ISOTP_REACTOR_MAX_PORT fds are watched already
+ */
+ERROR_CODE isotp_reactor_add_fd(struct isotp_reactor_t *reactor, int fd,
+                                void (*ready_cb)(void *), void *arg);
+
+/*
+ * @Function: let the reactor drive the timers of a session (isotp_set_wheel)
+ * @Parameter: 
+ *  reactor: reactor object
+ *  msg: session
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_reactor_add_session(struct isotp_reactor_t *reactor, struct isotp_t *msg);
+
+/*
+ * @Function: pump the transmit queue the sessions are given with
+ *  isotp_set_txq() once an iteration, it wakes up when the next frame may go
+ * @Parameter: 
+ *  reactor: reactor object
+ *  txq: queue, NULL for none
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_reactor_set_txq(struct isotp_reactor_t *reactor, struct isotp_txq_t *txq);
+
+/*
+ * @Function: wait for frames or the next deadline and handle them once
+ * @Parameter: 
+ *  reactor: reactor object
+ *  timeoutUs: longest wait, U32_INVALID_VALUE to wait for an event
+ * @Return: ERROR_CODE
+ *  ERR_IO epoll_wait() failed
+ */
+ERROR_CODE isotp_reactor_run_once(struct isotp_reactor_t *reactor, U32 timeoutUs);
+
+/*
+ * @Function: run until isotp_reactor_stop()
+ * @Parameter: 
+ *  reactor: reactor object
+ * @Return: ERROR_CODE of the failing iteration, STATUS_NORMAL when stopped
+ */
+ERROR_CODE isotp_reactor_run(struct isotp_reactor_t *reactor);
+
+/*
+ * @Function: make isotp_reactor_run() return after the current iteration,
+ *  to be called from a callback of the reactor thread
+ * @Parameter: 
+ *  reactor: reactor object
+ * @Return: NULL
+ */
+void isotp_reactor_stop(struct isotp_reactor_t *reactor);
+
+#endif
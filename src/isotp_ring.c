@@ -0,0 +1,74 @@
+#include "isotp_ring.h"
+
+/*
+ * An index is published with release semantics after the slots it covers
+ * are written, and read with acquire semantics before they are read
+ */
+#if defined(__GNUC__)
+#define RING_LOAD(idx)          __atomic_load_n((idx), __ATOMIC_ACQUIRE)
+#define RING_STORE(idx, val)    __atomic_store_n((idx), (val), __ATOMIC_RELEASE)
+#elif defined(_MSC_VER)
+#include <intrin.h>
+/* the interlocked operations are full barriers on every target */
+#define RING_LOAD(idx)          ((U32)_InterlockedOr((volatile long *)(idx), 0))
+#define RING_STORE(idx, val)    ((void)_InterlockedExchange((volatile long *)(idx), (long)(val)))
+#else
+#define RING_LOAD(idx)          atomic_load_explicit((idx), memory_order_acquire)
+#define RING_STORE(idx, val)    atomic_store_explicit((idx), (val), memory_order_release)
+#endif
+
+#define RING_MASK               (ISOTP_RING_SIZE - 1UL)
+
+void isotp_ring_init(struct isotp_ring_t *ring)
+{
+    RING_STORE(&ring->head, 0UL);
+    RING_STORE(&ring->tail, 0UL);
+}
+
+U32 isotp_ring_put(struct isotp_ring_t *ring, const struct phy_msg_t *frames, U32 n)
+{
+    U32 head = ring->head;
+    U32 tail = RING_LOAD(&ring->tail);
+    U32 room = ISOTP_RING_SIZE - (head - tail);
+    U32 i    = 0UL;
+
+    if(n > room)
+    {
+        n = room;
+    }
+    for(i = 0UL; i < n; i ++)
+    {
+        ring->frame[(head + i) & RING_MASK] = frames[i];
+    }
+    RING_STORE(&ring->head, head + n);
+
+    return n;
+}
+
+U32 isotp_ring_get(struct isotp_ring_t *ring, struct phy_msg_t *frames, U32 n)
+{
+    U32 tail  = ring->tail;
+    U32 head  = RING_LOAD(&ring->head);
+    U32 count = head - tail;
+    U32 i     = 0UL;
+
+    if(n > count)
+    {
+        n = count;
+    }
+    for(i = 0UL; i < n; i ++)
+    {
+        frames[i] = ring->frame[(tail + i) & RING_MASK];
+    }
+    RING_STORE(&ring->tail, tail + n);
+
+    return n;
+}
+
+U32 isotp_ring_count(struct isotp_ring_t *ring)
+{
+    U32 tail = RING_LOAD(&ring->tail);
+    U32 head = RING_LOAD(&ring->head);
+
+    return head - tail;
+}
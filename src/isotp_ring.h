@@ -0,0 +1,78 @@
+#ifndef __ISOTP_RING_H__
+#define __ISOTP_RING_H__
+
+#include "isotp.h"
+
+/*
+ * Bounded single producer / single consumer ring of CAN frames, one per
+ * direction between a driver (thread or ISR) and the ISO-TP engine.
+ * Neither side takes a lock, the size shall be a power of 2.
+ */
+#ifndef ISOTP_RING_SIZE
+#define ISOTP_RING_SIZE         (64UL)
+#endif
+#ifndef ISOTP_RING_CACHE_LINE
+#define ISOTP_RING_CACHE_LINE   (64UL)
+#endif
+
+/*
+ * The indices are read with acquire and written with release semantics,
+ * by the GCC/clang or MSVC intrinsics, else by C11 atomics; a toolchain
+ * with none of them cannot build the ring
+ */
+#if defined(__GNUC__) || defined(_MSC_VER)
+#define ISOTP_RING_INDEX        volatile U32
+#elif defined(__STDC_VERSION__) && (__STDC_VERSION__ >= 201112L) && !defined(__STDC_NO_ATOMICS__)
+#include <stdatomic.h>
+#define ISOTP_RING_INDEX        _Atomic U32
+#else
+#error "isotp_ring needs GCC/clang, MSVC or C11 atomics"
+#endif
+
+struct isotp_ring_t
+{
+    ISOTP_RING_INDEX head;  /* next slot to write, only moved by the producer */
+    U8           pad_head[ISOTP_RING_CACHE_LINE - sizeof(U32)];
+    ISOTP_RING_INDEX tail;  /* next slot to read, only moved by the consumer */
+    U8           pad_tail[ISOTP_RING_CACHE_LINE - sizeof(U32)];
+    struct phy_msg_t frame[ISOTP_RING_SIZE];
+};
+
+/*
+ * @Function: empty a ring, neither side shall use it meanwhile
+ * @Parameter: 
+ *  ring: ring object
+ * @Return: NULL
+ */
+void isotp_ring_init(struct isotp_ring_t *ring);
+
+/*
+ * @Function: append frames, producer side only
+ * @Parameter: 
+ *  ring: ring object
+ *  frames: frames to append
+ *  n: number of frames
+ * @Return: number of frames appended, less than n if the ring is full
+ */
+U32 isotp_ring_put(struct isotp_ring_t *ring, const struct phy_msg_t *frames, U32 n);
+
+/*
+ * @Function: remove the oldest frames, consumer side only
+ * @Parameter: 
+ *  ring: ring object
+ *  frames: destination of the frames
+ *  n: room of frames
+ * @Return: number of frames removed, 0 if the ring is empty
+ */
+U32 isotp_ring_get(struct isotp_ring_t *ring, struct phy_msg_t *frames, U32 n);
+
+/*
+ * @Function: number of frames waiting, exact on the consumer side and a
+ *  lower bound of the free room on the producer side
+ * @Parameter: 
+ *  ring: ring object
+ * @Return: number of frames
+ */
+U32 isotp_ring_count(struct isotp_ring_t *ring);
+
+#endif
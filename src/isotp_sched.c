@@ -0,0 +1,255 @@
+#include <string.h>
+
+#include "isotp_sched.h"
+#include "isotp_txq.h"
+
+static U32  sched_pump(struct isotp_sched_t *sched);
+static Bool sched_queued(const struct isotp_sched_t *sched);
+
+/*
+ * Hand the frames queued by the sessions to the driver, a queue shared by
+ * several sessions is pumped once; returns the time until one of the
+ * queues may let out its next frame
+ */
+static U32 sched_pump(struct isotp_sched_t *sched)
+{
+    struct isotp_txq_t *txq    = NULL;
+    U32                 remain = U32_INVALID_VALUE;
+    U32                 r      = 0UL;
+    U32                 i      = 0UL;
+    U32                 j      = 0UL;
+
+    for(i = 0UL; i < sched->count; i ++)
+    {
+        txq = sched->session[i]->isotp.txq;
+        for(j = 0UL; j < i && sched->session[j]->isotp.txq != txq; j ++)
+        {}
+        if(j == i && txq != NULL && isotp_txq_count(txq) > 0UL)
+        {
+            r = isotp_txq_pump(txq);
+            if(r < remain)
+            {
+                remain = r;
+            }
+        }
+    }
+
+    return remain;
+}
+
+/* frames of the sessions still wait in a queue */
+static Bool sched_queued(const struct isotp_sched_t *sched)
+{
+    U32 i = 0UL;
+
+    for(i = 0UL; i < sched->count; i ++)
+    {
+        if(isotp_txq_count(sched->session[i]->isotp.txq) > 0UL)
+        {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+ERROR_CODE isotp_sched_init(struct isotp_sched_t *sched, isotp_transfer bus_receive)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(sched == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else
+    {
+        memset(sched->session, 0, sizeof(sched->session));
+        sched->count       = 0UL;
+        sched->next        = 0UL;
+        sched->bus_receive = bus_receive;
+        err = isotp_table_init(&sched->table);
+    }
+
+    return err;
+}
+
+ERROR_CODE isotp_sched_add(struct isotp_sched_t *sched, struct isotp_t *msg)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    do
+    {
+        if(sched == NULL || msg == NULL)
+        {
+            err = ERR_POINTER_0;
+            break;
+        }
+        if(sched->count >= ISOTP_SCHED_SIZE)
+        {
+            err = ERR_FULL;
+            break;
+        }
+        err = isotp_table_add(&sched->table, msg);
+        if(err != STATUS_NORMAL)
+        {
+            break;
+        }
+        sched->session[sched->count] = msg;
+        sched->count ++;
+    } while(0);
+
+    return err;
+}
+
+ERROR_CODE isotp_sched_remove(struct isotp_sched_t *sched, struct isotp_t *msg)
+{
+    ERROR_CODE err = ERR_NOT_FOUND;
+    U32        i   = 0UL;
+
+    if(sched == NULL || msg == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+
+    for(i = 0UL; i < sched->count; i ++)
+    {
+        if(sched->session[i] == msg)
+        {
+            (void)isotp_table_remove(&sched->table, msg);
+            sched->count --;
+            /* keep the order of the others, the round robin goes on from next */
+            memmove(&sched->session[i], &sched->session[i + 1UL],
+                    (sched->count - i) * sizeof(sched->session[0]));
+            sched->session[sched->count] = NULL;
+            if(sched->next > i)
+            {
+                sched->next --;
+            }
+            if(sched->next >= sched->count)
+            {
+                sched->next = 0UL;
+            }
+            err = STATUS_NORMAL;
+            break;
+        }
+    }
+
+    return err;
+}
+
+ERROR_CODE isotp_sched_on_frame(struct isotp_sched_t *sched, const struct phy_msg_t *frame)
+{
+    if(sched == NULL || frame == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+
+    return isotp_table_dispatch(&sched->table, frame);
+}
+
+U32 isotp_sched_step(struct isotp_sched_t *sched)
+{
+    struct phy_msg_t frame;
+    struct isotp_t  *msg    = NULL;
+    U32              remain = U32_INVALID_VALUE;
+    U32              r      = 0UL;
+    U32              i      = 0UL;
+    U32              n      = 0UL;
+
+    if(sched == NULL)
+    {
+        return U32_INVALID_VALUE;
+    }
+
+    /* one clock read serves the whole step */
+    (void)timer_snapshot();
+    if(sched->bus_receive != NULL)
+    {
+        while(n < ISOTP_SCHED_RX_MAX
+            && sched->bus_receive(&frame) == STATUS_NORMAL)
+        {
+            (void)isotp_table_dispatch(&sched->table, &frame);
+            n ++;
+        }
+    }
+
+    /*
+     * every session sends at most one CF (or one batch) per step, the first
+     * one moves on each step so no target is always served first
+     */
+    for(i = 0UL; i < sched->count; i ++)
+    {
+        msg = sched->session[(sched->next + i) % sched->count];
+        (void)isotp_poll(msg);
+        r = isotp_next_deadline(msg);
+        if(r < remain)
+        {
+            remain = r;
+        }
+    }
+    if(sched->count > 0UL)
+    {
+        sched->next = (sched->next + 1UL) % sched->count;
+    }
+    /* what the sessions have queued goes out as the budget allows */
+    r = sched_pump(sched);
+    if(r < remain)
+    {
+        remain = r;
+    }
+    timer_snapshot_end();
+
+    if(n > 0UL)
+    {
+        /* more frames may be on the way */
+        remain = 0UL;
+    }
+
+    return remain;
+}
+
+U32 isotp_sched_busy(const struct isotp_sched_t *sched)
+{
+    const struct isotp_t *msg  = NULL;
+    U32                   busy = 0UL;
+    U32                   i    = 0UL;
+
+    if(sched == NULL)
+    {
+        return 0UL;
+    }
+
+    for(i = 0UL; i < sched->count; i ++)
+    {
+        msg = sched->session[i];
+        if(isotp_busy(msg->tp_state) == TRUE
+            || (msg->rx_ctx != NULL && isotp_busy(msg->rx_ctx->tp_state) == TRUE))
+        {
+            busy ++;
+        }
+    }
+
+    return busy;
+}
+
+ERROR_CODE isotp_sched_run(struct isotp_sched_t *sched)
+{
+    U32 remain = 0UL;
+
+    if(sched == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+
+    while(isotp_sched_busy(sched) > 0UL || sched_queued(sched) == TRUE)
+    {
+        remain = isotp_sched_step(sched);
+        if(remain > 0UL)
+        {
+            /* a FC may come in meanwhile, do not sleep through it */
+            timer_sleep((remain < ISOTP_SCHED_NAP) ? remain : ISOTP_SCHED_NAP);
+        }
+    }
+
+    return STATUS_NORMAL;
+}
@@ -0,0 +1,108 @@
+
+#ifndef __ISOTP_SCHED_H__
+#define __ISOTP_SCHED_H__
+
+#include "isotp.h"
+#include "isotp_table.h"
+
+/*
+ * Transmit scheduler for many sessions on one bus, e.g. flashing several
+ * ECUs at once: the sessions are stepped round robin without blocking,
+ * so while one waits for its FC or its STmin the CFs of the others fill
+ * the bus. It needs no OS, frames are read from one bus receive function
+ * or pushed in with isotp_sched_on_frame().
+ */
+#ifndef ISOTP_SCHED_SIZE
+#define ISOTP_SCHED_SIZE        (32UL)
+#endif
+/* most frames read from the bus in one step */
+#ifndef ISOTP_SCHED_RX_MAX
+#define ISOTP_SCHED_RX_MAX      (64UL)
+#endif
+/* longest sleep of isotp_sched_run() while no frame comes in, us */
+#ifndef ISOTP_SCHED_NAP
+#define ISOTP_SCHED_NAP         (100UL)
+#endif
+
+struct isotp_sched_t
+{
+    struct isotp_t      *session[ISOTP_SCHED_SIZE];
+    U32                  count;
+    U32                  next;          /* session stepped first by the next step */
+    struct isotp_table_t table;         /* sessions by the id of their frames */
+    isotp_transfer       bus_receive;   /* NULL: frames are pushed in */
+};
+
+/*
+ * @Function: clear the scheduler
+ * @Parameter:
+ *  sched:       scheduler object
+ *  bus_receive: reads one frame of the bus, ERR_EMPTY when there is none,
+ *               NULL if frames are given by isotp_sched_on_frame()
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_sched_init(struct isotp_sched_t *sched, isotp_transfer bus_receive);
+
+/*
+ * @Function: add a session, it shall be initialized with phy_receive NULL
+ *  and send to the bus shared by all sessions
+ * @Parameter:
+ *  sched: scheduler object
+ *  msg:   session
+ * @Return: ERROR_CODE
+ *  ERR_FULL ISOTP_SCHED_SIZE sessions are scheduled already
+ *  ERR_USED another session owns the same N_SA
+ */
+ERROR_CODE isotp_sched_add(struct isotp_sched_t *sched, struct isotp_t *msg);
+
+/*
+ * @Function: remove a session
+ * @Parameter:
+ *  sched: scheduler object
+ *  msg:   scheduled session
+ * @Return: ERROR_CODE
+ *  ERR_NOT_FOUND the session is not scheduled
+ */
+ERROR_CODE isotp_sched_remove(struct isotp_sched_t *sched, struct isotp_t *msg);
+
+/*
+ * @Function: route a frame of the bus to its session
+ * @Parameter:
+ *  sched: scheduler object
+ *  frame: received frame
+ * @Return: ERROR_CODE
+ *  ERR_NOT_FOUND no session for the identifier
+ */
+ERROR_CODE isotp_sched_on_frame(struct isotp_sched_t *sched, const struct phy_msg_t *frame);
+
+/*
+ * @Function: read the frames of the bus, then step every session once,
+ *  starting one session further on than the step before, and pump the
+ *  transmit queues of the sessions
+ * @Parameter:
+ *  sched: scheduler object
+ * @Return: time until a session has timer work to do, us,
+ *  U32_INVALID_VALUE if none has
+ */
+U32 isotp_sched_step(struct isotp_sched_t *sched);
+
+/*
+ * @Function: count the sessions with a transfer in progress
+ * @Parameter:
+ *  sched: scheduler object
+ * @Return: number of busy sessions
+ */
+U32 isotp_sched_busy(const struct isotp_sched_t *sched);
+
+/*
+ * @Function: step the sessions until none has a transfer in progress
+ *  and their transmit queues are empty, the transmissions are started by
+ *  isotp_request() before; it sleeps
+ *  with timer_sleep() while nothing is due, ISOTP_SCHED_NAP at most
+ * @Parameter:
+ *  sched: scheduler object
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_sched_run(struct isotp_sched_t *sched);
+
+#endif
@@ -0,0 +1,334 @@
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE     /* sendmmsg(), recvmmsg() */
+#endif
+#include "isotp_socketcan.h"
+
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <linux/can.h>
+#include <linux/can/raw.h>
+
+/* room for the SCM_TIMESTAMPNS control message of one frame */
+#define SOCKETCAN_CMSG_LEN  CMSG_SPACE(sizeof(struct timespec))
+
+/* tries of a send refused with ENOBUFS while the tx queue drains */
+#define SOCKETCAN_TX_RETRY  (100)
+
+static void frame_to_can(const struct phy_msg_t *frame, Bool brs, struct canfd_frame *cf)
+{
+    if(frame->id & ISOTP_ID_EXT_FLAG)
+    {
+        cf->can_id = (frame->id & ISOTP_EXT_ID_MASK) | CAN_EFF_FLAG;
+    }
+    else
+    {
+        cf->can_id = frame->id & ISOTP_STD_ID_MASK;
+    }
+    cf->len    = (U8)frame->length;
+    cf->flags  = (frame->fd == TRUE && brs == TRUE) ? CANFD_BRS : 0u;
+    cf->__res0 = 0u;
+    cf->__res1 = 0u;
+    memcpy(cf->data, frame->data, frame->length);
+}
+
+static void can_to_frame(const struct canfd_frame *cf, Bool fd, struct phy_msg_t *frame)
+{
+    if(cf->can_id & CAN_EFF_FLAG)
+    {
+        frame->id = (cf->can_id & CAN_EFF_MASK) | ISOTP_ID_EXT_FLAG;
+    }
+    else
+    {
+        frame->id = cf->can_id & CAN_SFF_MASK;
+    }
+    frame->fd       = fd;
+    frame->length   = (cf->len > CANFD_DATA_LEN) ? CANFD_DATA_LEN : cf->len;
+    frame->new_data = TRUE;
+    memcpy(frame->data, cf->data, frame->length);
+}
+
+ERROR_CODE isotp_socketcan_open(struct isotp_socketcan_t *can, const char *ifname, Bool canfd)
+{
+    ERROR_CODE         err    = STATUS_NORMAL;
+    struct sockaddr_can addr;
+    struct ifreq       ifr;
+    int                enable = 1;
+
+    if(can == NULL || ifname == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+
+    can->canfd        = canfd;
+    can->brs          = canfd;
+    can->rx_timestamp = 0u;
+    can->fd           = socket(PF_CAN, SOCK_RAW, CAN_RAW);
+    do
+    {
+        if(can->fd < 0)
+        {
+            err = ERR_OPEN;
+            break;
+        }
+        memset(&ifr, 0, sizeof(ifr));
+        strncpy(ifr.ifr_name, ifname, IFNAMSIZ - 1);
+        if(ioctl(can->fd, SIOCGIFINDEX, &ifr) < 0)
+        {
+            err = ERR_OPEN;
+            break;
+        }
+        if(canfd == TRUE
+            && setsockopt(can->fd, SOL_CAN_RAW, CAN_RAW_FD_FRAMES, &enable, sizeof(enable)) < 0)
+        {
+            err = ERR_OPEN;
+            break;
+        }
+        /* the kernel stamps every frame when it is received */
+        (void)setsockopt(can->fd, SOL_SOCKET, SO_TIMESTAMPNS, &enable, sizeof(enable));
+
+        memset(&addr, 0, sizeof(addr));
+        addr.can_family  = AF_CAN;
+        addr.can_ifindex = ifr.ifr_ifindex;
+        if(bind(can->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            err = ERR_OPEN;
+            break;
+        }
+    } while(0);
+
+    if(err != STATUS_NORMAL)
+    {
+        isotp_socketcan_close(can);
+    }
+
+    return err;
+}
+
+void isotp_socketcan_close(struct isotp_socketcan_t *can)
+{
+    if(can != NULL && can->fd >= 0)
+    {
+        close(can->fd);
+        can->fd = -1;
+    }
+}
+
+ERROR_CODE isotp_socketcan_filter(struct isotp_socketcan_t *can, const struct isotp_table_t *table)
+{
+    struct can_filter filter[ISOTP_TABLE_STD_SIZE + ISOTP_TABLE_EXT_SIZE];
+    U32               n = 0UL;
+    U32               i = 0UL;
+
+    if(can == NULL || table == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+
+    for(i = 0UL; i < ISOTP_TABLE_STD_SIZE; i ++)
+    {
+        if(table->std[i] != NULL)
+        {
+            filter[n].can_id   = i;
+            filter[n].can_mask = CAN_SFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+            n ++;
+        }
+    }
+    for(i = 0UL; i < ISOTP_TABLE_EXT_SIZE; i ++)
+    {
+        if(table->ext[i].msg != NULL)
+        {
+            filter[n].can_id   = (table->ext[i].id & ISOTP_EXT_ID_MASK) | CAN_EFF_FLAG;
+            filter[n].can_mask = CAN_EFF_MASK | CAN_EFF_FLAG | CAN_RTR_FLAG;
+            n ++;
+        }
+    }
+
+    /* no filter at all: nothing is received */
+    if(setsockopt(can->fd, SOL_CAN_RAW, CAN_RAW_FILTER,
+                  (n > 0UL) ? filter : NULL, n * sizeof(filter[0])) < 0)
+    {
+        return ERR_IO;
+    }
+
+    return STATUS_NORMAL;
+}
+
+ERROR_CODE isotp_socketcan_send(struct isotp_socketcan_t *can, struct phy_msg_t *frames, U32 n, U32 *sent)
+{
+    struct canfd_frame cf[ISOTP_SOCKETCAN_BATCH];
+    struct iovec       iov[ISOTP_SOCKETCAN_BATCH];
+    struct mmsghdr     hdr[ISOTP_SOCKETCAN_BATCH];
+    U32                chunk = 0UL;
+    U32                done  = 0UL;
+    U32                i     = 0UL;
+    int                retry = SOCKETCAN_TX_RETRY;
+    int                ret   = 0;
+    struct pollfd      pfd;
+
+    if(can == NULL || frames == NULL || sent == NULL)
+    {
+        return ERR_POINTER_0;
+    }
+    *sent = 0UL;
+    /* a batch is refused as a whole, not after a part of it went out */
+    for(i = 0UL; i < n; i ++)
+    {
+        if(frames[i].fd == TRUE && can->canfd != TRUE)
+        {
+            return ERR_PARAMETER;
+        }
+    }
+
+    while(n > 0UL)
+    {
+        chunk = (n > ISOTP_SOCKETCAN_BATCH) ? ISOTP_SOCKETCAN_BATCH : n;
+        memset(hdr, 0, chunk * sizeof(hdr[0]));
+        for(i = 0UL; i < chunk; i ++)
+        {
+            frame_to_can(&frames[i], can->brs, &cf[i]);
+            iov[i].iov_base = &cf[i];
+            iov[i].iov_len  = (frames[i].fd == TRUE) ? CANFD_MTU : CAN_MTU;
+            hdr[i].msg_hdr.msg_iov    = &iov[i];
+            hdr[i].msg_hdr.msg_iovlen = 1;
+        }
+
+        for(done = 0UL; done < chunk; )
+        {
+            ret = sendmmsg(can->fd, hdr + done, chunk - done, 0);
+            if(ret > 0)
+            {
+                done  += (U32)ret;
+                *sent += (U32)ret;
+            }
+            else if(ret < 0 && errno == ENOBUFS && retry-- > 0)
+            {
+                /* the tx queue of the interface is full, let it drain */
+                pfd.fd     = can->fd;
+                pfd.events = POLLOUT;
+                (void)poll(&pfd, 1, 1);
+            }
+            else if(ret < 0 && errno == EINTR)
+            {}
+            else
+            {
+                return ERR_BUS;
+            }
+        }
+
+        frames += chunk;
+        n      -= chunk;
+    }
+
+    return STATUS_NORMAL;
+}
+
+U32 isotp_socketcan_recv(struct isotp_socketcan_t *can, struct phy_msg_t *frames, U32 n)
+{
+    struct canfd_frame cf[ISOTP_SOCKETCAN_BATCH];
+    struct iovec       iov[ISOTP_SOCKETCAN_BATCH];
+    struct mmsghdr     hdr[ISOTP_SOCKETCAN_BATCH];
+    U8                 ctrl[ISOTP_SOCKETCAN_BATCH][SOCKETCAN_CMSG_LEN];
+    struct cmsghdr    *cmsg = NULL;
+    struct timespec    ts;
+    U32                got  = 0UL;
+    U32                i    = 0UL;
+    int                ret  = 0;
+
+    if(can == NULL || frames == NULL)
+    {
+        return 0UL;
+    }
+    if(n > ISOTP_SOCKETCAN_BATCH)
+    {
+        n = ISOTP_SOCKETCAN_BATCH;
+    }
+
+    memset(hdr, 0, n * sizeof(hdr[0]));
+    for(i = 0UL; i < n; i ++)
+    {
+        iov[i].iov_base = &cf[i];
+        iov[i].iov_len  = sizeof(cf[i]);
+        hdr[i].msg_hdr.msg_iov        = &iov[i];
+        hdr[i].msg_hdr.msg_iovlen     = 1;
+        hdr[i].msg_hdr.msg_control    = ctrl[i];
+        hdr[i].msg_hdr.msg_controllen = sizeof(ctrl[i]);
+    }
+
+    ret = recvmmsg(can->fd, hdr, n, MSG_DONTWAIT, NULL);
+    for(i = 0UL; ret > 0 && i < (U32)ret; i ++)
+    {
+        /* error and remote frames are not ISO-TP frames */
+        if((hdr[i].msg_len != CAN_MTU && hdr[i].msg_len != CANFD_MTU)
+            || (cf[i].can_id & (CAN_ERR_FLAG | CAN_RTR_FLAG)) != 0u)
+        {
+            continue;
+        }
+        can_to_frame(&cf[i], (hdr[i].msg_len == CANFD_MTU) ? TRUE : FALSE, &frames[got]);
+        frames[got].timestamp = 0u;
+        for(cmsg = CMSG_FIRSTHDR(&hdr[i].msg_hdr); cmsg != NULL;
+            cmsg = CMSG_NXTHDR(&hdr[i].msg_hdr, cmsg))
+        {
+            if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_TIMESTAMPNS)
+            {
+                memcpy(&ts, CMSG_DATA(cmsg), sizeof(ts));
+                frames[got].timestamp = (U64)ts.tv_sec * 1000000000u + (U64)ts.tv_nsec;
+                can->rx_timestamp     = frames[got].timestamp;
+            }
+        }
+        got ++;
+    }
+
+    return got;
+}
+
+Bool isotp_socketcan_wait(struct isotp_socketcan_t *can, U32 timeoutUs)
+{
+    struct pollfd pfd;
+    int           timeoutMs = -1;
+
+    if(timeoutUs != U32_INVALID_VALUE)
+    {
+        timeoutMs = (int)((timeoutUs + 999u) / 1000u);
+    }
+    pfd.fd      = can->fd;
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    return (poll(&pfd, 1, timeoutMs) > 0 && (pfd.revents & POLLIN)) ? TRUE : FALSE;
+}
+
+U32 isotp_socketcan_dispatch(struct isotp_socketcan_t *can, const struct isotp_table_t *table)
+{
+    struct phy_msg_t frames[ISOTP_SOCKETCAN_BATCH];
+    struct isotp_t  *msg  = NULL;
+    U32              got  = isotp_socketcan_recv(can, frames, ISOTP_SOCKETCAN_BATCH);
+    U32              i    = 0UL;
+    U32              run  = 0UL;
+    U32              used = 0UL;
+
+    while(i < got)
+    {
+        /* a run of frames with the same id goes to one session at once */
+        for(run = 1UL; i + run < got && frames[i + run].id == frames[i].id; run ++)
+        {}
+        msg = isotp_table_find(table, frames[i].id);
+        while(msg != NULL && run > 0UL)
+        {
+            used = isotp_rx_batch(msg, frames + i, run);
+            if(used == 0UL)
+            {
+                break;
+            }
+            i   += used;
+            run -= used;
+        }
+        i += run;
+    }
+
+    return got;
+}
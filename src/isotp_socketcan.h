@@ -0,0 +1,100 @@
+#ifndef __ISOTP_SOCKETCAN_H__
+#define __ISOTP_SOCKETCAN_H__
+
+#include "isotp.h"
+#include "isotp_table.h"
+
+/*
+ * Linux SocketCAN physical layer on a CAN_RAW socket, classic CAN or
+ * CAN FD. Frames are moved with sendmmsg()/recvmmsg() in batches of up
+ * to ISOTP_SOCKETCAN_BATCH, received frames carry the kernel timestamp.
+ * The timestamp is taken on the realtime clock of the kernel and is only
+ * reported, N_Bs/N_Cr are kept on the clock of the timer module.
+ */
+#ifndef ISOTP_SOCKETCAN_BATCH
+#define ISOTP_SOCKETCAN_BATCH   (32UL)
+#endif
+
+struct isotp_socketcan_t
+{
+    int  fd;            /* CAN_RAW socket, -1 if closed */
+    Bool canfd;         /* TRUE: CAN FD frames are enabled */
+    Bool brs;           /* TRUE: CAN FD frames are sent with bit rate switch */
+    U64  rx_timestamp;  /* kernel time of the last received frame, ns, for reports only */
+};
+
+/*
+ * @Function: open a CAN_RAW socket bound to an interface
+ * @Parameter: 
+ *  can: backend object
+ *  ifname: interface, e.g. "can0" or "vcan0"
+ *  canfd: TRUE to send and receive CAN FD frames as well, they are sent
+ *   with the bit rate switch unless can->brs is cleared after the open
+ * @Return: ERROR_CODE
+ *  ERR_OPEN the socket can't be opened or bound
+ */
+ERROR_CODE isotp_socketcan_open(struct isotp_socketcan_t *can, const char *ifname, Bool canfd);
+
+/*
+ * @Function: close the socket
+ * @Parameter: 
+ *  can: backend object
+ * @Return: NULL
+ */
+void isotp_socketcan_close(struct isotp_socketcan_t *can);
+
+/*
+ * @Function: let the kernel pass only the ids of the sessions of a table,
+ *  to be called again after sessions are added or removed
+ * @Parameter: 
+ *  can: backend object
+ *  table: registered sessions
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_socketcan_filter(struct isotp_socketcan_t *can, const struct isotp_table_t *table);
+
+/*
+ * @Function: send frames with as few sendmmsg() calls as possible,
+ *  matches isotp_transfer_batch once the backend is bound in a wrapper;
+ *  the frames are all checked before the first one is sent
+ * @Parameter: 
+ *  can: backend object
+ *  frames: frames to send
+ *  n: number of frames
+ *  sent: number of frames the socket took, n unless an error is returned
+ * @Return: ERROR_CODE
+ *  ERR_PARAMETER a CAN FD frame on a classic socket, none is sent
+ *  ERR_BUS the socket refused a frame, the *sent ones before it are sent
+ */
+ERROR_CODE isotp_socketcan_send(struct isotp_socketcan_t *can, struct phy_msg_t *frames, U32 n, U32 *sent);
+
+/*
+ * @Function: take the frames waiting on the socket, never blocks
+ * @Parameter: 
+ *  can: backend object
+ *  frames: destination of the frames
+ *  n: room of frames
+ * @Return: number of frames received
+ */
+U32 isotp_socketcan_recv(struct isotp_socketcan_t *can, struct phy_msg_t *frames, U32 n);
+
+/*
+ * @Function: wait until a frame can be received
+ * @Parameter: 
+ *  can: backend object
+ *  timeoutUs: longest wait, U32_INVALID_VALUE to wait forever
+ * @Return: TRUE if a frame is waiting
+ */
+Bool isotp_socketcan_wait(struct isotp_socketcan_t *can, U32 timeoutUs);
+
+/*
+ * @Function: receive the waiting frames and feed each run of frames of
+ *  one id to its session with isotp_rx_batch(), never blocks
+ * @Parameter: 
+ *  can: backend object
+ *  table: registered sessions
+ * @Return: number of frames received
+ */
+U32 isotp_socketcan_dispatch(struct isotp_socketcan_t *can, const struct isotp_table_t *table);
+
+#endif
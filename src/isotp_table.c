@@ -0,0 +1,207 @@
+#include <string.h>
+
+#include "isotp_table.h"
+
+#define EXT_MASK    (ISOTP_TABLE_EXT_SIZE - 1UL)
+
+static Bool id_is_std(U32 id);
+static U32  ext_hash(U32 id);
+static S32  ext_lookup(const struct isotp_table_t *table, U32 id);
+
+static Bool id_is_std(U32 id)
+{
+    return ((id & ISOTP_ID_EXT_FLAG) == 0UL && id <= ISOTP_STD_ID_MASK);
+}
+
+/*
+ * Multiplicative hash, the high bits are folded in because the low bits
+ * of 29-bit diagnostic ids (e.g. 0x18DAxxyy) are the only ones changing
+ */
+static U32 ext_hash(U32 id)
+{
+    U32 h = id * 0x9E3779B1UL;
+
+    h ^= (h >> 16);
+
+    return (h & EXT_MASK);
+}
+
+/*
+ * Returns the slot index of id, -1 if it is not in the table
+ */
+static S32 ext_lookup(const struct isotp_table_t *table, U32 id)
+{
+    S32 index = -1;
+    U32 i     = ext_hash(id);
+    U32 probe = 0UL;
+
+    while(probe < ISOTP_TABLE_EXT_SIZE && table->ext[i].msg != NULL)
+    {
+        if(table->ext[i].id == id)
+        {
+            index = (S32)i;
+            break;
+        }
+        i = (i + 1UL) & EXT_MASK;
+        probe ++;
+    }
+
+    return index;
+}
+
+ERROR_CODE isotp_table_init(struct isotp_table_t *table)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    if(table == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else
+    {
+        memset(table, 0, sizeof(*table));
+    }
+
+    return err;
+}
+
+ERROR_CODE isotp_table_add(struct isotp_table_t *table, struct isotp_t *msg)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+    U32        id  = 0UL;
+    U32        i   = 0UL;
+
+    do
+    {
+        if(table == NULL || msg == NULL)
+        {
+            err = ERR_POINTER_0;
+            break;
+        }
+        id = msg->isotp.N_SA;
+        if(isotp_table_find(table, id) != NULL)
+        {
+            err = ERR_USED;
+            break;
+        }
+        if(id_is_std(id))
+        {
+            table->std[id] = msg;
+            break;
+        }
+        /* keep one slot free so that a probe always terminates */
+        if(table->ext_used >= ISOTP_TABLE_EXT_SIZE - 1UL)
+        {
+            err = ERR_FULL;
+            break;
+        }
+        i = ext_hash(id);
+        while(table->ext[i].msg != NULL)
+        {
+            i = (i + 1UL) & EXT_MASK;
+        }
+        table->ext[i].id  = id;
+        table->ext[i].msg = msg;
+        table->ext_used ++;
+    } while(0);
+
+    return err;
+}
+
+ERROR_CODE isotp_table_remove(struct isotp_table_t *table, struct isotp_t *msg)
+{
+    ERROR_CODE err   = STATUS_NORMAL;
+    S32        index = -1;
+    U32        i, j, k;
+
+    do
+    {
+        if(table == NULL || msg == NULL)
+        {
+            err = ERR_POINTER_0;
+            break;
+        }
+        if(isotp_table_find(table, msg->isotp.N_SA) != msg)
+        {
+            err = ERR_NOT_FOUND;
+            break;
+        }
+        if(id_is_std(msg->isotp.N_SA))
+        {
+            table->std[msg->isotp.N_SA] = NULL;
+            break;
+        }
+        index = ext_lookup(table, msg->isotp.N_SA);
+        /* 
+         * backward shift deletion: move up the following entries of the
+         * probe chain which would not be reachable through the hole
+         */
+        i = (U32)index;
+        j = i;
+        for(;;)
+        {
+            j = (j + 1UL) & EXT_MASK;
+            if(table->ext[j].msg == NULL)
+            {
+                break;
+            }
+            k = ext_hash(table->ext[j].id);
+            if((i <= j) ? ((i < k) && (k <= j)) : ((i < k) || (k <= j)))
+            {
+                continue;
+            }
+            table->ext[i] = table->ext[j];
+            i = j;
+        }
+        table->ext[i].msg = NULL;
+        table->ext_used --;
+    } while(0);
+
+    return err;
+}
+
+struct isotp_t *isotp_table_find(const struct isotp_table_t *table, U32 id)
+{
+    struct isotp_t *msg   = NULL;
+    S32             index = -1;
+
+    if(id_is_std(id))
+    {
+        msg = table->std[id];
+    }
+    else
+    {
+        index = ext_lookup(table, id);
+        if(index >= 0)
+        {
+            msg = table->ext[index].msg;
+        }
+    }
+
+    return msg;
+}
+
+ERROR_CODE isotp_table_dispatch(const struct isotp_table_t *table, const struct phy_msg_t *frame)
+{
+    ERROR_CODE      err = STATUS_NORMAL;
+    struct isotp_t *msg = NULL;
+
+    if(table == NULL || frame == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else
+    {
+        msg = isotp_table_find(table, frame->id);
+        if(msg == NULL)
+        {
+            err = ERR_NOT_FOUND;
+        }
+        else
+        {
+            err = isotp_on_frame(msg, frame);
+        }
+    }
+
+    return err;
+}
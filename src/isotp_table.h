@@ -0,0 +1,81 @@
+
+#ifndef __ISOTP_TABLE_H__
+#define __ISOTP_TABLE_H__
+
+#include "isotp.h"
+
+/*
+ * Sessions are keyed by the CAN identifier alone (N_SA of the session):
+ * the layer only supports normal addressing, there is no extended or
+ * mixed addressing and so no N_TA or N_AE byte in the frame data to
+ * tell two sessions on the same identifier apart. Such sessions cannot
+ * share a table, isotp_table_add() refuses the second one.
+ */
+
+/* one slot per 11-bit identifier, direct indexed */
+#define ISOTP_TABLE_STD_SIZE    (ISOTP_STD_ID_MASK + 1UL)
+
+/* open addressing hash for 29-bit identifiers, must be a power of 2 */
+#define ISOTP_TABLE_EXT_SIZE    (256UL)
+
+struct isotp_table_slot_t
+{
+    U32             id;
+    struct isotp_t *msg;    /* NULL: slot is free */
+};
+
+struct isotp_table_t
+{
+    struct isotp_t           *std[ISOTP_TABLE_STD_SIZE];
+    struct isotp_table_slot_t ext[ISOTP_TABLE_EXT_SIZE];
+    U16                       ext_used;
+};
+
+/*
+ * @Function: clear all sessions of the table
+ * @Parameter: 
+ *  table: table object
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_table_init(struct isotp_table_t *table);
+
+/*
+ * @Function: register a session by its source address (N_SA)
+ * @Parameter: 
+ *  table: table object
+ *  msg:   initialized session
+ * @Return: ERROR_CODE
+ *  ERR_USED another session owns the same N_SA
+ *  ERR_FULL no free slot for a 29-bit identifier
+ */
+ERROR_CODE isotp_table_add(struct isotp_table_t *table, struct isotp_t *msg);
+
+/*
+ * @Function: unregister a session
+ * @Parameter: 
+ *  table: table object
+ *  msg:   registered session
+ * @Return: ERROR_CODE
+ */
+ERROR_CODE isotp_table_remove(struct isotp_table_t *table, struct isotp_t *msg);
+
+/*
+ * @Function: look up the session receiving frames of an identifier
+ * @Parameter: 
+ *  table: table object
+ *  id:    frame identifier, ISOTP_ID_EXT_FLAG set for 29-bit ids
+ * @Return: session, NULL if not found
+ */
+struct isotp_t *isotp_table_find(const struct isotp_table_t *table, U32 id);
+
+/*
+ * @Function: route a frame of the bus to its session
+ * @Parameter: 
+ *  table: table object
+ *  frame: received frame
+ * @Return: ERROR_CODE
+ *  ERR_NOT_FOUND no session for the identifier
+ */
+ERROR_CODE isotp_table_dispatch(const struct isotp_table_t *table, const struct phy_msg_t *frame);
+
+#endif
@@ -0,0 +1,313 @@
+#include <string.h>
+
+#include "isotp_txq.h"
+
+static Bool txq_before(const struct isotp_txq_t *txq, U16 a, U16 b);
+static void txq_swap(struct isotp_txq_t *txq, U32 i, U32 j);
+static void txq_up(struct isotp_txq_t *txq, U32 i);
+static void txq_down(struct isotp_txq_t *txq, U32 i);
+static void txq_refill(struct isotp_txq_t *txq);
+static U32  txq_wait(const struct isotp_txq_t *txq);
+static U32  frame_key(const struct phy_msg_t *frame);
+
+/*
+ * Arbitration field as a number: the 11 bits of a standard id line up
+ * with the base id of an extended one, and a standard frame wins over an
+ * extended one of the same base id (IDE is recessive)
+ */
+static U32 frame_key(const struct phy_msg_t *frame)
+{
+    U32 key = 0UL;
+
+    if(frame->id & ISOTP_ID_EXT_FLAG)
+    {
+        key = ((frame->id & ISOTP_EXT_ID_MASK) << 1UL) | 1UL;
+    }
+    else
+    {
+        key = (frame->id & ISOTP_STD_ID_MASK) << 19UL;
+    }
+
+    return key;
+}
+
+U32 isotp_frame_bits(const struct phy_msg_t *frame)
+{
+    U32 len   = frame->length;
+    U32 ext   = (frame->id & ISOTP_ID_EXT_FLAG) ? 1UL : 0UL;
+    U32 head  = 0UL;
+    U32 crc   = 0UL;
+    U32 bits  = 0UL;
+
+    if(frame->fd == TRUE)
+    {
+        /* SOF, id, SRR/IDE and the 18 bit id extension, r1, FDF, res, BRS, ESI, DLC */
+        head = ext ? 41UL : 22UL;
+        crc  = (len > 16UL) ? 21UL : 17UL;
+        /* dynamic stuff bits up to the CRC, stuff count and fixed stuff bits of the CRC */
+        bits = head + len * 8UL + (head + len * 8UL - 1UL) / 4UL
+             + 4UL + crc + (4UL + crc + 3UL) / 4UL;
+    }
+    else
+    {
+        /* SOF, id, RTR, IDE/SRR(, id extension, RTR), r0(, r1), DLC and CRC */
+        head = ext ? 54UL : 34UL;
+        bits = head + len * 8UL + (head + len * 8UL - 1UL) / 4UL;
+    }
+    /* CRC delimiter, ACK slot and delimiter, EOF, interframe space */
+    bits += 13UL;
+
+    return bits;
+}
+
+static Bool txq_before(const struct isotp_txq_t *txq, U16 a, U16 b)
+{
+    const struct isotp_txq_entry_t *ea = &txq->entry[a];
+    const struct isotp_txq_entry_t *eb = &txq->entry[b];
+
+    if(ea->tx_class != eb->tx_class)
+    {
+        return (ea->tx_class < eb->tx_class);
+    }
+    if(ea->key != eb->key)
+    {
+        return (ea->key < eb->key);
+    }
+
+    /* arrival, the counter may wrap (S32 is not 32 bit everywhere) */
+    return ((U32)(ea->seq - eb->seq) > 0x7FFFFFFFUL);
+}
+
+static void txq_swap(struct isotp_txq_t *txq, U32 i, U32 j)
+{
+    U16 t = txq->heap[i];
+
+    txq->heap[i] = txq->heap[j];
+    txq->heap[j] = t;
+}
+
+static void txq_up(struct isotp_txq_t *txq, U32 i)
+{
+    U32 parent = 0UL;
+
+    while(i > 0UL)
+    {
+        parent = (i - 1UL) / 2UL;
+        if(txq_before(txq, txq->heap[i], txq->heap[parent]) == FALSE)
+        {
+            break;
+        }
+        txq_swap(txq, i, parent);
+        i = parent;
+    }
+}
+
+static void txq_down(struct isotp_txq_t *txq, U32 i)
+{
+    U32 first = 0UL;
+    U32 child = 0UL;
+
+    for(;;)
+    {
+        first = i;
+        child = 2UL * i + 1UL;
+        if(child < txq->count && txq_before(txq, txq->heap[child], txq->heap[first]))
+        {
+            first = child;
+        }
+        child ++;
+        if(child < txq->count && txq_before(txq, txq->heap[child], txq->heap[first]))
+        {
+            first = child;
+        }
+        if(first == i)
+        {
+            break;
+        }
+        txq_swap(txq, i, first);
+        i = first;
+    }
+}
+
+/*
+ * Add the bits earned since the last refill, the part of a bit left over
+ * is kept in spare for the next one
+ */
+static void txq_refill(struct isotp_txq_t *txq)
+{
+    U32 elapsed = 0UL;
+    U64 earned  = 0ULL;
+
+    if(txq->rate == 0UL)
+    {
+        return;
+    }
+
+    elapsed = timer_interval(&txq->refill);
+    timer_forward(&txq->refill, elapsed);
+    earned = (U64)elapsed * txq->rate + txq->spare;
+    if(earned / txq->unit_hz >= (U64)(txq->burst - txq->tokens))
+    {
+        /* a full bucket earns nothing */
+        txq->tokens = txq->burst;
+        txq->spare  = 0UL;
+    }
+    else
+    {
+        txq->tokens += (U32)(earned / txq->unit_hz);
+        txq->spare   = (U32)(earned % txq->unit_hz);
+    }
+}
+
+/* time until the bits of the first frame are earned, after a refill */
+static U32 txq_wait(const struct isotp_txq_t *txq)
+{
+    U32 bits = isotp_frame_bits(&txq->entry[txq->heap[0]].frame);
+
+    if(txq->rate == 0UL || txq->tokens >= bits)
+    {
+        return 0UL;
+    }
+
+    return (U32)((((U64)(bits - txq->tokens)) * txq->unit_hz - txq->spare + txq->rate - 1UL) / txq->rate);
+}
+
+ERROR_CODE isotp_txq_init(struct isotp_txq_t *txq, isotp_transfer send, U32 rate, U32 burst)
+{
+    ERROR_CODE       err  = STATUS_NORMAL;
+    struct phy_msg_t longest;
+    U32              unit = timer_unit_ns();
+    U32              i    = 0UL;
+
+    if(txq == NULL || send == NULL)
+    {
+        err = ERR_POINTER_0;
+    }
+    else if(rate != 0UL && (unit == 0UL || unit > 1000000000UL))
+    {
+        /* the bits earned can't be counted in the unit of the timers */
+        err = ERR_NOT_INIT;
+    }
+    else
+    {
+        for(i = 0UL; i < ISOTP_TXQ_SIZE; i ++)
+        {
+            txq->free[i] = (U16)(ISOTP_TXQ_SIZE - 1UL - i);
+        }
+        txq->count = 0UL;
+        txq->seq   = 0UL;
+        txq->send    = send;
+        txq->rate    = rate;
+        txq->unit_hz = (unit == 0UL) ? 1UL : 1000000000UL / unit;
+
+        /* the longest frame shall fit into the bucket, or it never goes */
+        memset(&longest, 0, sizeof(longest));
+        longest.fd     = TRUE;
+        longest.id     = ISOTP_ID_EXT_FLAG;
+        longest.length = CANFD_DATA_LEN;
+        if(burst < isotp_frame_bits(&longest))
+        {
+            burst = isotp_frame_bits(&longest);
+        }
+        txq->burst  = burst;
+        txq->tokens = burst;
+        txq->spare  = 0UL;
+        timer_add(&txq->refill);
+    }
+
+    return err;
+}
+
+ERROR_CODE isotp_txq_put(struct isotp_txq_t *txq, const struct phy_msg_t *frames, U32 n, U8 tx_class)
+{
+    struct isotp_txq_entry_t *e   = NULL;
+    U16                       idx = 0u;
+    U32                       i   = 0UL;
+
+    if(txq == NULL || (frames == NULL && n > 0UL))
+    {
+        return ERR_POINTER_0;
+    }
+    if(n > ISOTP_TXQ_SIZE - txq->count)
+    {
+        /* the session keeps its frames and tries again */
+        (void)isotp_txq_pump(txq);
+        if(n > ISOTP_TXQ_SIZE - txq->count)
+        {
+            return ERR_FULL;
+        }
+    }
+
+    for(i = 0UL; i < n; i ++)
+    {
+        /* the free stack holds ISOTP_TXQ_SIZE - count entries */
+        idx = txq->free[ISOTP_TXQ_SIZE - 1UL - txq->count];
+        e   = &txq->entry[idx];
+        e->frame    = frames[i];
+        e->tx_class = tx_class;
+        e->key      = frame_key(&frames[i]);
+        e->seq      = txq->seq ++;
+        txq->heap[txq->count] = idx;
+        txq->count ++;
+        txq_up(txq, txq->count - 1UL);
+    }
+    (void)isotp_txq_pump(txq);
+
+    return STATUS_NORMAL;
+}
+
+U32 isotp_txq_pump(struct isotp_txq_t *txq)
+{
+    struct isotp_txq_entry_t *e    = NULL;
+    U32                       bits = 0UL;
+    U16                       idx  = 0u;
+
+    if(txq == NULL || txq->count == 0UL)
+    {
+        return U32_INVALID_VALUE;
+    }
+
+    txq_refill(txq);
+    while(txq->count > 0UL)
+    {
+        idx  = txq->heap[0];
+        e    = &txq->entry[idx];
+        bits = isotp_frame_bits(&e->frame);
+        if(txq->rate != 0UL && txq->tokens < bits)
+        {
+            /* the bits missing are earned at rate */
+            return txq_wait(txq);
+        }
+        if(txq->send(&e->frame) != STATUS_NORMAL)
+        {
+            /* the driver is full, the frame stays first */
+            return 0UL;
+        }
+        if(txq->rate != 0UL)
+        {
+            txq->tokens -= bits;
+        }
+        txq->count --;
+        txq->heap[0] = txq->heap[txq->count];
+        txq->free[ISOTP_TXQ_SIZE - 1UL - txq->count] = idx;
+        txq_down(txq, 0UL);
+    }
+
+    return U32_INVALID_VALUE;
+}
+
+U32 isotp_txq_next(struct isotp_txq_t *txq)
+{
+    if(txq == NULL || txq->count == 0UL)
+    {
+        return U32_INVALID_VALUE;
+    }
+    txq_refill(txq);
+
+    return txq_wait(txq);
+}
+
+U32 isotp_txq_count(const struct isotp_txq_t *txq)
+{
+    return (txq == NULL) ? 0UL : txq->count;
+}
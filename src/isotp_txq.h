@@ -0,0 +1,116 @@
+
+#ifndef __ISOTP_TXQ_H__
+#define __ISOTP_TXQ_H__
+
+#include "isotp.h"
+
+/*
+ * Transmit queue between the sessions and the CAN driver: the frames
+ * wait in a heap ordered by the class of their session, then by their
+ * CAN id as the bus arbitration would (the lower wins), then by arrival;
+ * a token bucket of bits lets them out no faster than the bus-load budget.
+ * It is not thread-safe, the sessions and the pump shall run on one thread.
+ * The scheduler and the reactor pump it, a session sending with
+ * isotp_send() pumps its own queue while it waits.
+ * A frame counts as sent once it is queued: N_As and N_Bs of the session
+ * run from then on, so the time a frame waits in the queue is taken from
+ * them; ISOTP_TXQ_SIZE frames at the budget shall go well within N_Bs.
+ */
+#ifndef ISOTP_TXQ_SIZE
+#define ISOTP_TXQ_SIZE      (64UL)
+#endif
+
+/* class of the sessions given no other, 0 is the most urgent */
+#define ISOTP_TXQ_CLASS_DEFAULT (4u)
+
+struct isotp_txq_entry_t
+{
+    struct phy_msg_t frame;
+    U8               tx_class;
+    U32              key;       /* arbitration field, lower wins */
+    U32              seq;       /* arrival, keeps the frames of one id in order */
+};
+
+struct isotp_txq_t
+{
+    struct isotp_txq_entry_t entry[ISOTP_TXQ_SIZE];
+    U16                      heap[ISOTP_TXQ_SIZE];  /* entries ordered */
+    U16                      free[ISOTP_TXQ_SIZE];  /* entries unused */
+    U32                      count;
+    U32                      seq;
+    isotp_transfer           send;      /* CAN driver */
+    U32                      rate;      /* budget in bits per second, 0: no budget */
+    U32                      burst;     /* most bits sent back to back */
+    U32                      tokens;    /* bits which may be sent now */
+    U32                      spare;     /* part of a bit earned, in 1/unit_hz */
+    U32                      unit_hz;   /* units of the timer module per second */
+    struct timer_t           refill;    /* time of the last refill */
+};
+
+/*
+ * @Function: clear the queue and set its budget, e.g. 60% of a 500 kbit/s
+ *  bus is rate 300000; a budget needs the time base of timer_init_ns(),
+ *  set before
+ * @Parameter:
+ *  txq:   queue object
+ *  send:  CAN driver, it returns an error when it can't take the frame now
+ *  rate:  bits per second, 0 for no budget
+ *  burst: bits the bucket holds, one frame of the longest kind at least
+ * @Return: ERROR_CODE
+ *  ERR_NOT_INIT a budget is given and the unit of the time base is not
+ *  known or longer than a second
+ */
+ERROR_CODE isotp_txq_init(struct isotp_txq_t *txq, isotp_transfer send, U32 rate, U32 burst);
+
+/*
+ * @Function: queue frames of one session, all of them or none, and let
+ *  out what the budget allows
+ * @Parameter:
+ *  txq:      queue object
+ *  frames:   frames in the order they shall go
+ *  n:        number of frames
+ *  tx_class: class of the session, 0 is the most urgent
+ * @Return: ERROR_CODE
+ *  ERR_FULL there is no room for n frames, none is queued
+ */
+ERROR_CODE isotp_txq_put(struct isotp_txq_t *txq, const struct phy_msg_t *frames, U32 n, U8 tx_class);
+
+/*
+ * @Function: hand the queued frames to the driver, first in order, as
+ *  long as the budget allows and the driver takes them
+ * @Parameter:
+ *  txq: queue object
+ * @Return: time until the next frame may go, in the unit of the timer
+ *  module; 0 if the driver has refused it; U32_INVALID_VALUE if the queue
+ *  is empty
+ */
+U32 isotp_txq_pump(struct isotp_txq_t *txq);
+
+/*
+ * @Function: time until the first frame may go, nothing is sent
+ * @Parameter:
+ *  txq: queue object
+ * @Return: time in the unit of the timer module, 0 if it may go now,
+ *  U32_INVALID_VALUE if the queue is empty
+ */
+U32 isotp_txq_next(struct isotp_txq_t *txq);
+
+/*
+ * @Function: count the frames waiting
+ * @Parameter:
+ *  txq: queue object
+ * @Return: number of frames
+ */
+U32 isotp_txq_count(const struct isotp_txq_t *txq);
+
+/*
+ * @Function: length of a frame on the bus including the worst case of
+ *  stuff bits and the interframe space; the data phase of a CAN FD frame
+ *  is counted at the nominal bit rate, which overestimates its load
+ * @Parameter:
+ *  frame: frame
+ * @Return: bits
+ */
+U32 isotp_frame_bits(const struct phy_msg_t *frame);
+
+#endif
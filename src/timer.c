@@ -1,13 +1,55 @@
 #include "timer.h"
 
-#define time_after(a,b)         ((long)(b) - (long)(a) <= 0)
+/*
+ * the clock read by one thread is cached there, the legacy 32-bit source
+ * is extended to 64 bits in one shared word updated by compare-and-swap,
+ * so any thread may read it; a toolchain without atomics shall use
+ * timer_init_ns() when timers are read by more than one thread
+ */
+#if defined(_MSC_VER)
+#include <intrin.h>
+#define TIMER_THREAD_LOCAL      __declspec(thread)
+#elif defined(__GNUC__)
+#define TIMER_THREAD_LOCAL      __thread
+#else
+#define TIMER_THREAD_LOCAL
+#endif
 
-#define time_before(a,b)        time_after(b,a)
+static U32 (*gTmr_tickMsFxn)(void);
+static U64 (*gTmr_tickNsFxn)(void);
+static U8  gTmrcountType;
+static U32 gTmrtickFactor;
+/* extended tick, its low 32 bits are the last tick read, counting up */
+static volatile U64 gTmr_extTick;
+static void (*gTmr_sleepUsFxn)(U32);
+static TIMER_THREAD_LOCAL U32 gTmr_snapshotDepth;
+static TIMER_THREAD_LOCAL U64 gTmr_snapshotTick;
 
-#define time_interval(now,pre)  ((long)(now) - (long)(pre)) 
+static U64 timer_ext_load(void)
+{
+#if defined(__GNUC__)
+    return __atomic_load_n(&gTmr_extTick, __ATOMIC_ACQUIRE);
+#elif defined(_MSC_VER)
+    return (U64)_InterlockedCompareExchange64((volatile __int64 *)&gTmr_extTick, 0, 0);
+#else
+    return gTmr_extTick;
+#endif
+}
 
-static U32 (*gTmr_tickMsFxn)(void);
-static U8 gTmrcountType, gTmrtickFactor;
+/* store next if the extended tick is still old, else fail */
+static Bool timer_ext_swap(U64 old, U64 next)
+{
+#if defined(__GNUC__)
+    return __atomic_compare_exchange_n(&gTmr_extTick, &old, next, 0,
+                                       __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE) ? TRUE : FALSE;
+#elif defined(_MSC_VER)
+    return ((U64)_InterlockedCompareExchange64((volatile __int64 *)&gTmr_extTick,
+                                               (__int64)next, (__int64)old) == old) ? TRUE : FALSE;
+#else
+    gTmr_extTick = next;
+    return TRUE;
+#endif
+}
 
 ERROR_CODE timer_init(U32 (*tickMs)(void), U8 countType, U8 tickFactor)
 {
@@ -19,17 +61,121 @@ ERROR_CODE timer_init(U32 (*tickMs)(void), U8 countType, U8 tickFactor)
     }
     else
     {
+        gTmr_tickNsFxn = NULL;
         gTmr_tickMsFxn = tickMs;
         gTmrcountType  = countType;
-        gTmrtickFactor = tickFactor;
+        gTmrtickFactor = (tickFactor == 0u) ? 1u : tickFactor;
+        gTmr_extTick   = (countType == TIMER_COUNT_DOWN) ? (U32)(0u - tickMs()) : tickMs();
+    }
+
+    return retVal;
+}
+
+ERROR_CODE timer_init_ns(U64 (*tickNs)(void), U32 unitNs)
+{
+    ERROR_CODE retVal = STATUS_NORMAL;
+
+    if (tickNs == NULL)
+    {
+        retVal = ERR_POINTER_0;
+    }
+    else
+    {
+        gTmr_tickMsFxn = NULL;
+        gTmr_tickNsFxn = tickNs;
+        gTmrcountType  = TIMER_COUNT_UP;
+        gTmrtickFactor = (unitNs == 0u) ? 1u : unitNs;
     }
 
     return retVal;
 }
 
+U32 timer_unit_ns(void)
+{
+    return (gTmr_tickNsFxn != NULL) ? gTmrtickFactor : 0u;
+}
+
+/*
+ * read the time base, the 32-bit source is unwrapped into 64 bits; a tick
+ * older than the one stored by another thread meanwhile reads as that one
+ */
+static U64 timer_read(void)
+{
+    U64 ext   = 0u;
+    U32 tick  = 0u;
+    U32 delta = 0u;
+
+    if (gTmr_tickNsFxn != NULL)
+    {
+        return gTmr_tickNsFxn();
+    }
+
+    do
+    {
+        ext  = timer_ext_load();
+        tick = gTmr_tickMsFxn();
+        if (gTmrcountType == TIMER_COUNT_DOWN)
+        {
+            tick = 0u - tick;
+        }
+        delta = (U32)(tick - (U32)ext);
+        if (delta > 0x7FFFFFFFu)
+        {
+            return ext;
+        }
+    } while (delta > 0u && timer_ext_swap(ext, ext + delta) == FALSE);
+
+    return ext + delta;
+}
+
+static U64 timer_now(void)
+{
+    return (gTmr_snapshotDepth > 0u) ? gTmr_snapshotTick : timer_read();
+}
+
+/* a mark taken after an older snapshot counts as no time elapsed */
+static U64 timer_elapsed(const struct timer_t *timer)
+{
+    U64 now = timer_now();
+
+    return (now > timer->markTime) ? (now - timer->markTime) : 0u;
+}
+
+static Bool timer_ready(void)
+{
+    return (gTmr_tickMsFxn != NULL || gTmr_tickNsFxn != NULL);
+}
+
+U64 timer_snapshot(void)
+{
+    if (gTmr_snapshotDepth == 0u && timer_ready())
+    {
+        gTmr_snapshotTick = timer_read();
+    }
+    gTmr_snapshotDepth++;
+
+    return gTmr_snapshotTick;
+}
+
+void timer_snapshot_renew(void)
+{
+    if (gTmr_snapshotDepth > 0u && timer_ready())
+    {
+        gTmr_snapshotTick = timer_read();
+    }
+}
+
+void timer_snapshot_end(void)
+{
+    if (gTmr_snapshotDepth > 0u)
+    {
+        gTmr_snapshotDepth--;
+    }
+}
+
 void timer_add(struct timer_t *timer)
 {
-    if (gTmr_tickMsFxn != NULL)
+    if (timer_ready())
     {
         timer->enable = TRUE;
         timer->timeout = FALSE;
@@ -45,7 +191,7 @@ void timer_refresh(struct timer_t *timer)
 {
     if(timer->enable == TRUE)
     {
-        timer->markTime = gTmr_tickMsFxn();
+        timer->markTime = timer_now();
     }
 }
 
@@ -58,20 +204,8 @@ Bool timer_overflow(struct timer_t * timer, U32 period_ms)
 {
     if(timer->enable)
     {
-        if (gTmrcountType == TIMER_COUNT_UP
-            && time_after(gTmr_tickMsFxn(), timer->markTime + period_ms * gTmrtickFactor))
-        {
-            timer->timeout = TRUE;
-        }
-        else if (gTmrcountType == TIMER_COUNT_DOWN
-            && time_before(gTmr_tickMsFxn(), timer->markTime - period_ms * gTmrtickFactor))
-        {
-            timer->timeout = TRUE;
-        }
-        else
-        {
-            timer->timeout = FALSE;
-        }
+        timer->timeout = (timer_elapsed(timer) >= (U64)period_ms * gTmrtickFactor)
+                         ? TRUE : FALSE;
     }
     else
     {
@@ -83,28 +217,294 @@ Bool timer_overflow(struct timer_t * timer, U32 period_ms)
 
 U32 timer_interval(struct timer_t * timer)
 {
-    U32 interVal = 0u;
+    U64 interVal = timer_elapsed(timer) / gTmrtickFactor;
 
-    if (gTmrcountType == TIMER_COUNT_UP)
+    return (interVal > U32_INVALID_VALUE) ? U32_INVALID_VALUE : (U32)interVal;
+}
+
+Bool timer_is_added(struct timer_t  *timer)
+{
+    return timer->enable;
+}
+
+U32 timer_remain(struct timer_t * timer, U32 period_ms)
+{
+    U32 remain  = U32_INVALID_VALUE;
+    U32 elapsed = 0u;
+
+    if (timer->enable)
     {
-        interVal = (S32)gTmr_tickMsFxn() - (S32)timer->markTime;
+        elapsed = timer_interval(timer);
+        remain  = (elapsed >= period_ms) ? 0u : (period_ms - elapsed);
     }
-    else if (gTmrcountType == TIMER_COUNT_DOWN)
+
+    return remain;
+}
+
+void timer_set_sleep(void (*sleepUs)(U32))
+{
+    gTmr_sleepUsFxn = sleepUs;
+}
+
+void timer_sleep(U32 us)
+{
+    if (gTmr_sleepUsFxn != NULL && us > 0u)
     {
-        interVal = (S32)timer->markTime - (S32)gTmr_tickMsFxn();
+        gTmr_sleepUsFxn(us);
+    }
+}
+
+
+void timer_forward(struct timer_t *timer, U32 period_ms)
+{
+    timer->markTime += (U64)period_ms * gTmrtickFactor;
+}
+
+static void wheel_link(struct timer_wheel_t *wheel, struct timer_node_t *node)
+{
+    struct timer_node_t **head;
+    U32 delta = node->expire - wheel->now;
+    U32 park  = node->expire;
+    U32 level = 0u;
+
+    /*
+     * beyond the horizon, park on the farthest slot of the last level,
+     * the deadline is kept and the node is linked again when cascaded
+     */
+    if (delta >= (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)))
+    {
+        delta = (1u << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1u;
+        park  = wheel->now + delta;
+    }
+    while (level < TIMER_WHEEL_LEVELS - 1u
+        && delta >= (1u << (TIMER_WHEEL_BITS * (level + 1u))))
+    {
+        level++;
+    }
+
+    head = &wheel->slot[level][(park >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK];
+    node->prev = NULL;
+    node->next = *head;
+    if (*head != NULL)
+    {
+        (*head)->prev = node;
+    }
+    *head = node;
+}
+
+static void wheel_unlink(struct timer_wheel_t *wheel, struct timer_node_t *node)
+{
+    U32 level;
+    U32 idx;
+
+    if (node->prev != NULL)
+    {
+        node->prev->next = node->next;
     }
     else
     {
-        interVal = 0u;
+        /*
+         * the head may sit on any level after the wheel moved, look it up;
+         * a node parked beyond the horizon is on any slot of the last level
+         */
+        for (level = 0u; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            idx = (node->expire >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+            if (wheel->slot[level][idx] == node)
+            {
+                wheel->slot[level][idx] = node->next;
+                break;
+            }
+        }
+        for (idx = 0u; level == TIMER_WHEEL_LEVELS && idx < TIMER_WHEEL_SLOTS; idx++)
+        {
+            if (wheel->slot[TIMER_WHEEL_LEVELS - 1u][idx] == node)
+            {
+                wheel->slot[TIMER_WHEEL_LEVELS - 1u][idx] = node->next;
+                break;
+            }
+        }
+    }
+    if (node->next != NULL)
+    {
+        node->next->prev = node->prev;
     }
+    node->next = NULL;
+    node->prev = NULL;
+}
 
-    interVal /= gTmrtickFactor;
+/* move the nodes of one slot to the levels below */
+static void wheel_cascade(struct timer_wheel_t *wheel, U32 level)
+{
+    U32 idx = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    struct timer_node_t *node = wheel->slot[level][idx];
+    struct timer_node_t *next;
 
-    return interVal;
+    wheel->slot[level][idx] = NULL;
+    while (node != NULL)
+    {
+        next = node->next;
+        wheel_link(wheel, node);
+        node = next;
+    }
 }
 
-Bool timer_is_added(struct timer_t  *timer)
+void timer_wheel_init(struct timer_wheel_t *wheel, U32 resolution)
 {
-    return timer->enable;
+    U32 level, idx;
+
+    for (level = 0u; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        for (idx = 0u; idx < TIMER_WHEEL_SLOTS; idx++)
+        {
+            wheel->slot[level][idx] = NULL;
+        }
+    }
+    wheel->now = 0u;
+    wheel->armed = 0u;
+    wheel->resolution = (resolution == 0u) ? 1u : resolution;
+    timer_add(&wheel->ref);
+}
+
+void timer_node_init(struct timer_node_t *node, void (*expire_cb)(void *), void *arg)
+{
+    node->next = NULL;
+    node->prev = NULL;
+    node->expire = 0u;
+    node->armed = FALSE;
+    node->expire_cb = expire_cb;
+    node->arg = arg;
+}
+
+void timer_wheel_arm(struct timer_wheel_t *wheel, struct timer_node_t *node, U32 delay)
+{
+    U32 ticks;
+
+    if (node->armed == TRUE)
+    {
+        wheel_unlink(wheel, node);
+    }
+    else
+    {
+        node->armed = TRUE;
+        wheel->armed++;
+    }
+
+    /* count from the start of the current tick and round up, never early */
+    ticks = timer_interval(&wheel->ref);
+    ticks = (delay > U32_INVALID_VALUE - ticks - wheel->resolution)
+            ? U32_INVALID_VALUE / wheel->resolution
+            : (ticks + delay + wheel->resolution - 1u) / wheel->resolution;
+    node->expire = wheel->now + ((ticks == 0u) ? 1u : ticks);
+    wheel_link(wheel, node);
+}
+
+void timer_wheel_disarm(struct timer_wheel_t *wheel, struct timer_node_t *node)
+{
+    if (node->armed == TRUE)
+    {
+        wheel_unlink(wheel, node);
+        node->armed = FALSE;
+        wheel->armed--;
+    }
+}
+
+U32 timer_wheel_advance(struct timer_wheel_t *wheel)
+{
+    U32 ticks;
+    U32 fired = 0u;
+    U32 level;
+    struct timer_node_t *node;
+
+    /* every expiry of this call, and the polls it runs, see one clock read */
+    (void)timer_snapshot();
+    ticks = timer_interval(&wheel->ref) / wheel->resolution;
+    timer_forward(&wheel->ref, ticks * wheel->resolution);
+    if (wheel->armed == 0u)
+    {
+        /* nothing to expire, jump straight to the current tick */
+        wheel->now += ticks;
+        ticks = 0u;
+    }
+
+    while (ticks > 0u)
+    {
+        ticks--;
+        wheel->now++;
+        for (level = 1u; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            if ((wheel->now & ((1u << (TIMER_WHEEL_BITS * level)) - 1u)) != 0u)
+            {
+                break;
+            }
+            wheel_cascade(wheel, level);
+        }
+
+        /* every node of the level 0 slot is due now */
+        while ((node = wheel->slot[0][wheel->now & TIMER_WHEEL_MASK]) != NULL)
+        {
+            wheel->slot[0][wheel->now & TIMER_WHEEL_MASK] = node->next;
+            if (node->next != NULL)
+            {
+                node->next->prev = NULL;
+            }
+            node->next = NULL;
+            node->armed = FALSE;
+            wheel->armed--;
+            fired++;
+            if (node->expire_cb != NULL)
+            {
+                node->expire_cb(node->arg);
+            }
+        }
+        if (wheel->armed == 0u)
+        {
+            wheel->now += ticks;
+            ticks = 0u;
+        }
+    }
+
+    timer_snapshot_end();
+
+    return fired;
 }
 
+U32 timer_wheel_next(struct timer_wheel_t *wheel)
+{
+    U32 best = U32_INVALID_VALUE;
+    U32 elapsed;
+    U32 level, i, idx;
+    struct timer_node_t *node;
+
+    if (wheel->armed == 0u)
+    {
+        return U32_INVALID_VALUE;
+    }
+
+    for (level = 0u; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        /* the current slot of a level holds its farthest nodes, scan it last */
+        idx = (wheel->now >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+        for (i = 1u; i <= TIMER_WHEEL_SLOTS; i++)
+        {
+            node = wheel->slot[level][(idx + i) & TIMER_WHEEL_MASK];
+            if (node != NULL)
+            {
+                for (; node != NULL; node = node->next)
+                {
+                    if (node->expire - wheel->now < best)
+                    {
+                        best = node->expire - wheel->now;
+                    }
+                }
+                break;
+            }
+        }
+    }
+
+    elapsed = timer_interval(&wheel->ref);
+    best = (best > U32_INVALID_VALUE / wheel->resolution)
+           ? U32_INVALID_VALUE - 1u : best * wheel->resolution;
+
+    return (best > elapsed) ? (best - elapsed) : 0u;
+}
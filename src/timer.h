@@ -13,7 +13,36 @@ struct timer_t
 {
     Bool enable;
     Bool timeout;
-    U32  markTime;
+    U64  markTime;  /* in ticks of the 64-bit time base */
+};
+
+/*
+ * Hierarchical timer wheel: level 0 holds the deadlines of the next
+ * TIMER_WHEEL_SLOTS ticks, every further level covers TIMER_WHEEL_SLOTS
+ * times the span of the level below and is cascaded down when due.
+ */
+#define TIMER_WHEEL_BITS    (6u)
+#define TIMER_WHEEL_SLOTS   (1u << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK    (TIMER_WHEEL_SLOTS - 1u)
+#define TIMER_WHEEL_LEVELS  (4u)
+
+struct timer_node_t
+{
+    struct timer_node_t *next;
+    struct timer_node_t *prev;
+    U32   expire;                   /* wheel tick of the deadline */
+    Bool  armed;
+    void (*expire_cb)(void * /*arg*/);
+    void *arg;
+};
+
+struct timer_wheel_t
+{
+    struct timer_node_t *slot[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    struct timer_t       ref;       /* start of the current tick */
+    U32                  now;       /* current tick, deadlines up to it have fired */
+    U32                  resolution;/* length of a tick */
+    U32                  armed;     /* number of armed nodes */
 };
 
 /*
@@ -22,12 +51,59 @@ struct timer_t
  *  tickUs: tick function, millisecond(0x0-0xFFFFFFFF)
  *  should modify TIMER_FACTOR_MS to match microsecond.
  *  e.g. tickUs outputs 1 tick = 1/8ms, so TIMER_FACTOR_MS = 8u
+ *  the 32-bit ticks are extended to 64 bits with atomics under GCC and
+ *  MSVC, another toolchain shall use timer_init_ns() when the timers are
+ *  used by more than one thread
  * @Return: ERROR_CODE
  *      STATUS_NORMAL tickUs is valid
  *      ERR_POINTER_0 tickUs is not found
  */
 ERROR_CODE timer_init(U32 (*tickUs)(void), U8 countType, U8 tickFactor);
 
+/*
+ * @Function: initialize timer module with a 64-bit monotonic time source,
+ *  it never wraps and is preferred over timer_init()
+ * @Parameter: 
+ *  tickNs: monotonic nanosecond function, e.g. CLOCK_MONOTONIC based
+ *  unitNs: nanoseconds of one period unit, 1000 for microsecond periods
+ * @Return: ERROR_CODE
+ *      STATUS_NORMAL tickNs is valid
+ *      ERR_POINTER_0 tickNs is not found
+ */
+ERROR_CODE timer_init_ns(U64 (*tickNs)(void), U32 unitNs);
+
+/*
+ * @Function: get the period unit of the time base
+ * @Parameter: NULL
+ * @Return: nanoseconds of one unit, 0 if the time base is given by
+ *  timer_init(), whose unit is not known, or is not set
+ */
+U32 timer_unit_ns(void);
+
+/*
+ * @Function: read the clock once and use that value for every timer call
+ *  of the calling thread until timer_snapshot_end(), calls may be nested
+ * @Parameter: NULL
+ * @Return: the snapshot, in ticks of the time base
+ */
+U64 timer_snapshot(void);
+
+/*
+ * @Function: read the clock again for the snapshot in progress, after a
+ *  call which may have blocked, e.g. a driver send, so the time it took
+ *  is seen by the timers checked next
+ * @Parameter: NULL
+ * @Return: NULL
+ */
+void timer_snapshot_renew(void);
+
+/*
+ * @Function: end the snapshot taken by the matching timer_snapshot()
+ * @Parameter: NULL
+ * @Return: NULL
+ */
+void timer_snapshot_end(void);
+
 /*
  * @Function: enable a timer and record current system tick
  * @Parameter: 
@@ -80,6 +156,96 @@ void timer_refresh(struct timer_t * timer);
  */
 U32 timer_interval(struct timer_t * timer);
 
+/*
+ * @Function: move the mark of the timer forward, unlike timer_refresh()
+ *  the time after the new mark is kept, a periodic job does not drift
+ * @Parameter: 
+ *  timer:     timer object
+ *  period_ms: time to move, same unit as timer_interval()
+ * @Return: NULL
+ */
+void timer_forward(struct timer_t *timer, U32 period_ms);
+
+/*
+ * @Function: get the time left until the timer is out of time
+ * @Parameter: 
+ *  timer: timer object
+ *  period_ms: period of the timer, same unit as timer_overflow()
+ * @Return: time left, 0 if out of time, U32_INVALID_VALUE if not enabled
+ */
+U32 timer_remain(struct timer_t * timer, U32 period_ms);
+
+/*
+ * @Function: install a precise sleep function for blocking users
+ * @Parameter: 
+ *  sleepUs: sleep function, e.g. clock_nanosleep() based, NULL to never sleep
+ * @Return: NULL
+ */
+void timer_set_sleep(void (*sleepUs)(U32));
+
+/*
+ * @Function: sleep with the installed sleep function,
+ *  returns at once if there is none
+ * @Parameter: 
+ *  us: sleep time
+ * @Return: NULL
+ */
+void timer_sleep(U32 us);
+
+/*
+ * @Function: initialize a timer wheel, timer_init() shall be done before
+ * @Parameter: 
+ *  wheel: wheel object
+ *  resolution: length of a tick, same unit as timer_overflow()
+ * @Return: NULL
+ */
+void timer_wheel_init(struct timer_wheel_t *wheel, U32 resolution);
+
+/*
+ * @Function: prepare a node before it is armed for the first time
+ * @Parameter: 
+ *  node: node object
+ *  expire_cb: called with arg from timer_wheel_advance() when the node expires
+ * @Return: NULL
+ */
+void timer_node_init(struct timer_node_t *node, void (*expire_cb)(void *), void *arg);
+
+/*
+ * @Function: (re)arm a node to expire after delay, O(1)
+ * @Parameter: 
+ *  wheel: wheel object
+ *  node: node object, it is moved if already armed
+ *  delay: time until the deadline, same unit as timer_overflow()
+ * @Return: NULL
+ */
+void timer_wheel_arm(struct timer_wheel_t *wheel, struct timer_node_t *node, U32 delay);
+
+/*
+ * @Function: disarm a node, O(1)
+ * @Parameter: 
+ *  wheel: wheel object
+ *  node: node object
+ * @Return: NULL
+ */
+void timer_wheel_disarm(struct timer_wheel_t *wheel, struct timer_node_t *node);
+
+/*
+ * @Function: move the wheel to the current time and fire expired nodes,
+ *  an expired node is disarmed before its callback runs
+ * @Parameter: 
+ *  wheel: wheel object
+ * @Return: number of fired nodes
+ */
+U32 timer_wheel_advance(struct timer_wheel_t *wheel);
+
+/*
+ * @Function: get the time until the earliest armed node expires
+ * @Parameter: 
+ *  wheel: wheel object
+ * @Return: time left, 0 if due, U32_INVALID_VALUE if no node is armed
+ */
+U32 timer_wheel_next(struct timer_wheel_t *wheel);
+
 
 #endif
 
@@ -1,9 +1,11 @@
 #include "isotp.h"
+#include "isotp_ring.h"
 #include <stdio.h>
 #include <stdarg.h>
 #include <unistd.h>
 #include <string.h>
 #include "sys/time.h"
+#include <time.h>
 #include <pthread.h>
 
 #include "comm_typedef.h"
@@ -20,6 +22,8 @@ static void       debug_out(const char *fmt, ...);
 
 
 static struct isotp_t sender, receiver;
+/* frames on the way to each side, one producer and one consumer each */
+static struct isotp_ring_t to_sender, to_receiver;
 static pthread_mutex_t dbg_mutex;
 
 static void debug_out(const char *fmt, ...)
@@ -51,20 +55,30 @@ void *rx_thread(void *arg)
                 dataLen ++;
             }
             debug_out("\r\n");
+            /* the message has been consumed, give its buffer back */
+            isotp_buffer_release(&receiver);
         }
     }
     return NULL;
 }
 
-static U32 port_platformTickUs(void)
+static U64 port_platformTickNs(void)
 {
-    U32            tickUs;
-    struct timeval tv;
+    struct timespec ts;
 
-    gettimeofday(&tv,NULL);
-    tickUs = tv.tv_sec * 1000000 + tv.tv_usec;
+    /* monotonic, does not jump with the wall clock */
+    clock_gettime(CLOCK_MONOTONIC, &ts);
 
-    return tickUs;
+    return (U64)ts.tv_sec * 1000000000u + (U64)ts.tv_nsec;
+}
+
+static void port_platformSleepUs(U32 us)
+{
+    struct timespec ts;
+
+    ts.tv_sec  = us / 1000000u;
+    ts.tv_nsec = (us % 1000000u) * 1000u;
+    clock_nanosleep(CLOCK_MONOTONIC, 0, &ts, NULL);
 }
 
 void main(void)
@@ -73,7 +87,12 @@ void main(void)
     pthread_t rc_task;
     ERROR_CODE retVal = STATUS_NORMAL;
 
-    retVal = timer_init(port_platformTickUs, TIMER_COUNT_UP, 1u);
+    /* timer periods are given in microseconds */
+    isotp_ring_init(&to_sender);
+    isotp_ring_init(&to_receiver);
+    retVal = timer_init_ns(port_platformTickNs, 1000u);
+    /* STmin gaps between CFs are slept instead of spun */
+    timer_set_sleep(port_platformSleepUs);
     /* 
      * initialize sender parameters
      * sender: isotp_send object
@@ -109,6 +128,7 @@ void main(void)
     /* Test 1,single frame */
     sender.DL = 5UL;
     debug_out("Single Frame test,DL:%d\r\n", sender.DL);
+    isotp_buffer_alloc(&sender, sender.DL);
     for(index = 0; index < sender.DL; index ++)
     {
         sender.Buffer[index] = (uint8_t)6UL;
@@ -122,6 +142,7 @@ void main(void)
     pthread_mutex_init(&dbg_mutex, NULL);
 
     debug_out("Consecutive Frame test,DL:%d\r\n", sender.DL);
+    isotp_buffer_alloc(&sender, sender.DL);
     for(index = 0; index < sender.DL; index ++)
     {
         sender.Buffer[index] = (uint8_t)index;
@@ -149,8 +170,10 @@ static ERROR_CODE sender_test_send(struct phy_msg_t *msg)
                     msg->data[0], msg->data[1], msg->data[2],
                     msg->data[3], msg->data[4], msg->data[5],
                     msg->data[6], msg->data[7]);
-        memcpy(&receiver.isotp.phy_rx, msg, sizeof(*msg));
-        receiver.isotp.phy_rx.new_data = TRUE;
+        if(isotp_ring_put(&to_receiver, msg, 1UL) == 0UL)
+        {
+            return ERR_FULL;
+        }
     }
     return STATUS_NORMAL;
 }
@@ -160,9 +183,8 @@ static ERROR_CODE sender_test_receive(struct phy_msg_t *msg)
     static uint32_t seq = 0UL;
     ERROR_CODE      err = ERR_EMPTY;
 
-    if(msg->new_data == TRUE)
+    if(isotp_ring_get(&to_sender, msg, 1UL) == 1UL)
     {
-        msg->new_data = FALSE;
         err = STATUS_NORMAL;
         seq ++;
         debug_out("Sder-Rx Seq:%04d Len:%02d Id:0x%04X Data:%02X %02X %02X %02X %02X %02X %02X %02X\r\n",
@@ -193,8 +215,10 @@ static ERROR_CODE receiver_test_send(struct phy_msg_t *msg)
                     msg->data[0], msg->data[1], msg->data[2],
                     msg->data[3], msg->data[4], msg->data[5],
                     msg->data[6], msg->data[7]);
-        memcpy(&sender.isotp.phy_rx, msg, sizeof(*msg));
-        sender.isotp.phy_rx.new_data = TRUE;
+        if(isotp_ring_put(&to_sender, msg, 1UL) == 0UL)
+        {
+            return ERR_FULL;
+        }
     }
     return STATUS_NORMAL;
 }
@@ -204,9 +228,8 @@ static ERROR_CODE receiver_test_receive(struct phy_msg_t *msg)
     static uint32_t seq = 0UL;
     ERROR_CODE      err = ERR_EMPTY;
 
-    if(msg->new_data == TRUE)
+    if(isotp_ring_get(&to_receiver, msg, 1UL) == 1UL)
     {
-        msg->new_data = FALSE;
         err = STATUS_NORMAL;
         seq ++;
         debug_out("Rcer-Rx Seq:%04d Len:%02d Id:0x%04X Data:%02X %02X %02X %02X %02X %02X %02X %02X\r\n",
@@ -0,0 +1,2000 @@
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+
+#include "isotp.h"
+#include "isotp_engine.h"
+#include "isotp_gateway.h"
+#include "isotp_ring.h"
+#include "isotp_sched.h"
+#include "isotp_txq.h"
+#include "timer.h"
+
+#include "comm_typedef.h"
+
+/*
+ * Checks of the transport layer on a simulated bus and a simulated
+ * clock: the frames sent by each side are held until they are handed
+ * to the other side, and the time only moves on when it is told to
+ */
+#define CLIENT_ADDRESS  0x766
+#define SERVER_ADDRESS  0x706
+
+#define WIRE_SIZE       (1024UL)
+
+#define CHECK(cond) \
+    do \
+    { \
+        checked ++; \
+        if(!(cond)) \
+        { \
+            failed ++; \
+            printf("%s:%d: check failed: %s\r\n", __FILE__, __LINE__, #cond); \
+        } \
+    } while(0)
+
+struct wire_t
+{
+    struct phy_msg_t frame[WIRE_SIZE];
+    U32  n;                 /* frames on the wire */
+    U32  sent;              /* frames accepted since the last reset */
+    U32  refuse;            /* frames accepted before the driver refuses */
+    U32  block;             /* us each send blocks the caller for */
+};
+
+static U32 checked, failed;
+static U64 now_ns;
+static U32 sleeps;
+static struct isotp_t client, server;
+static struct wire_t  to_server, to_client;
+
+static U64 sim_tick_ns(void)
+{
+    return now_ns;
+}
+
+/* a sleep moves the simulated clock on */
+static void sim_sleep_us(U32 us)
+{
+    sleeps ++;
+    now_ns += (U64)us * 1000u;
+}
+
+static void sim_advance(U32 us)
+{
+    now_ns += (U64)us * 1000u;
+}
+
+static ERROR_CODE wire_put(struct wire_t *wire, const struct phy_msg_t *frame)
+{
+    if(wire->n >= WIRE_SIZE || wire->sent >= wire->refuse)
+    {
+        return ERR_FULL;
+    }
+    wire->frame[wire->n] = *frame;
+    wire->n ++;
+    wire->sent ++;
+    sim_advance(wire->block);
+
+    return STATUS_NORMAL;
+}
+
+static void wire_reset(struct wire_t *wire)
+{
+    wire->n      = 0UL;
+    wire->sent   = 0UL;
+    wire->refuse = U32_INVALID_VALUE;
+    wire->block  = 0UL;
+}
+
+static ERROR_CODE client_send(struct phy_msg_t *frame)
+{
+    return wire_put(&to_server, frame);
+}
+
+static ERROR_CODE server_send(struct phy_msg_t *frame)
+{
+    return wire_put(&to_client, frame);
+}
+
+static U32 batch_calls;
+
+/* the frames of a batch go out until the wire refuses one, as sendmmsg() */
+static ERROR_CODE client_send_batch(struct phy_msg_t *frames, U32 count, U32 *sent)
+{
+    ERROR_CODE err = STATUS_NORMAL;
+
+    batch_calls ++;
+    for(*sent = 0UL; *sent < count; (*sent) ++)
+    {
+        err = wire_put(&to_server, &frames[*sent]);
+        if(err != STATUS_NORMAL)
+        {
+            break;
+        }
+    }
+
+    return err;
+}
+
+/* hand the frames on the wire to the session at its end */
+static void wire_deliver(struct wire_t *wire, struct isotp_t *msg)
+{
+    U32 i = 0UL;
+
+    for(i = 0UL; i < wire->n; i ++)
+    {
+        (void)isotp_on_frame(msg, &wire->frame[i]);
+    }
+    wire->n = 0UL;
+}
+
+/*
+ * Run both sides in steps of step us until neither has a transfer going
+ * on, at most limit us; returns the simulated time it took
+ */
+static U32 sim_run(U32 step, U32 limit)
+{
+    U64 start = now_ns;
+
+    do
+    {
+        wire_deliver(&to_server, &server);
+        wire_deliver(&to_client, &client);
+        (void)isotp_poll(&client);
+        (void)isotp_poll(&server);
+        if(isotp_busy(client.tp_state) == FALSE && isotp_busy(server.tp_state) == FALSE
+            && to_server.n == 0UL && to_client.n == 0UL)
+        {
+            break;
+        }
+        sim_advance(step);
+    } while(now_ns - start < (U64)limit * 1000u);
+
+    return (U32)((now_ns - start) / 1000u);
+}
+
+static void sim_setup(void)
+{
+    wire_reset(&to_server);
+    wire_reset(&to_client);
+    isotp_buffer_release(&server);
+    isotp_buffer_release(&client);
+    (void)isotp_init(&client, CLIENT_ADDRESS, SERVER_ADDRESS, NULL, client_send, NULL);
+    (void)isotp_init(&server, SERVER_ADDRESS, CLIENT_ADDRESS, NULL, server_send, NULL);
+    (void)fc_set(&server, ISOTP_FS_CTS, 0u, 0u);
+}
+
+static void fill(U8 *data, U32 length, U8 seed)
+{
+    U32 i = 0UL;
+
+    for(i = 0UL; i < length; i ++)
+    {
+        data[i] = (U8)(seed + i * 7UL);
+    }
+}
+
+static void test_request_length(void)
+{
+    static U8            data[16];
+    struct isotp_iovec_t iov[2];
+
+    sim_setup();
+    client.Buffer = data;
+
+    client.DL = 0UL;
+    CHECK(isotp_request(&client) == ERR_PARAMETER);
+    CHECK(client.tp_state == ISOTP_IDLE);
+    CHECK(to_server.n == 0UL);
+
+    client.DL = ISOTP_BUFFER_SIZE + 1UL;
+    CHECK(isotp_request(&client) == ERR_PARAMETER);
+    CHECK(client.DL == ISOTP_BUFFER_SIZE + 1UL);
+    CHECK(to_server.n == 0UL);
+
+    iov[0].base = data;
+    iov[0].len  = 0UL;
+    iov[1].base = data;
+    iov[1].len  = 0UL;
+    CHECK(isotp_request_iov(&client, iov, 2UL) == ERR_PARAMETER);
+    CHECK(to_server.n == 0UL);
+
+    client.DL = 5UL;
+    fill(data, 5UL, 1u);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    CHECK(to_server.n == 1UL && to_server.frame[0].data[0] == 0x05);
+    client.Buffer = NULL;
+}
+
+static void test_round_trip(void)
+{
+    static U8 data[300];
+
+    sim_setup();
+    (void)fc_set(&server, ISOTP_FS_CTS, 8u, 1u);
+    fill(data, sizeof(data), 3u);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.tp_state == ISOTP_IDLE && client.reply == N_OK);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.reply == N_OK);
+    CHECK(server.DL == sizeof(data));
+    CHECK(server.Buffer != NULL && memcmp(server.Buffer, data, sizeof(data)) == 0);
+    client.Buffer = NULL;
+}
+
+/* a sender waiting for a FC which does not come sleeps until N_Bs */
+static void test_send_wait_sleeps(void)
+{
+    static U8 data[100];
+    U64       start = 0u;
+
+    sim_setup();
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    sleeps = 0UL;
+    start  = now_ns;
+    CHECK(isotp_send(&client) == N_TIMEOUT_Bx);
+    CHECK(now_ns - start >= 250000000u);
+    CHECK(sleeps > 0UL && sleeps <= 250000UL / 100UL + 1UL);
+    client.Buffer = NULL;
+}
+
+/* no frame comes in: the wait for one sleeps until it times out */
+static void test_receive_sleeps(void)
+{
+    U64 start = 0u;
+
+    sim_setup();
+    sleeps = 0UL;
+    start  = now_ns;
+    CHECK(isotp_receive(&server, 1000UL) == N_ERROR);
+    CHECK(now_ns - start >= 1000000u);
+    CHECK(sleeps > 0UL && sleeps <= 1000UL / 100UL + 1UL);
+}
+
+/* CAN FD: TX_DL values, SF_DL escape, FF of a full frame, decoded back */
+static void test_fd_encoding(void)
+{
+    static U8 data[200];
+
+    sim_setup();
+    CHECK(isotp_set_tx_dl(&client, 13u) == ERR_PARAMETER);
+    CHECK(isotp_set_tx_dl(&client, 4u) == ERR_PARAMETER);
+    CHECK(isotp_set_tx_dl(&client, 64u) == STATUS_NORMAL);
+    CHECK(client.TX_DL == 64u);
+    client.Buffer = data;
+
+    /* up to 7 bytes the SF_DL stays in the PCI nibble */
+    fill(data, 7UL, 5u);
+    client.DL = 7UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    CHECK(to_server.n == 1UL);
+    CHECK(to_server.frame[0].fd == TRUE && to_server.frame[0].length == 8UL);
+    CHECK(to_server.frame[0].data[0] == 0x07);
+    (void)sim_run(100UL, 100000UL);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == 7UL);
+    CHECK(memcmp(server.Buffer, data, 7UL) == 0);
+    isotp_buffer_release(&server);
+
+    /* escape: PCI low nibble 0, SF_DL in byte #2, CAN_DL rounded up */
+    fill(data, 20UL, 9u);
+    client.DL = 20UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    CHECK(to_server.n == 1UL);
+    CHECK(to_server.frame[0].length == 24UL);
+    CHECK(to_server.frame[0].data[0] == 0x00 && to_server.frame[0].data[1] == 20u);
+    CHECK(memcmp(to_server.frame[0].data + 2, data, 20UL) == 0);
+    (void)sim_run(100UL, 100000UL);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == 20UL);
+    CHECK(memcmp(server.Buffer, data, 20UL) == 0);
+    isotp_buffer_release(&server);
+
+    /* SF_DL 62 is the largest SF of a 64 byte frame */
+    fill(data, 62UL, 11u);
+    client.DL = 62UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    CHECK(to_server.n == 1UL && to_server.frame[0].length == 64UL);
+    CHECK(to_server.frame[0].data[1] == 62u);
+    (void)sim_run(100UL, 100000UL);
+    CHECK(server.DL == 62UL && memcmp(server.Buffer, data, 62UL) == 0);
+    isotp_buffer_release(&server);
+
+    /* one byte more needs a FF, sent in a full frame */
+    fill(data, 200UL, 13u);
+    client.DL = 200UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    CHECK(to_server.n == 1UL && to_server.frame[0].length == 64UL);
+    CHECK(to_server.frame[0].data[0] == 0x10 && to_server.frame[0].data[1] == 200u);
+    CHECK(client.tp_state == ISOTP_WAIT_FIRST_FC);
+    (void)sim_run(100UL, 100000UL);
+    CHECK(client.tp_state == ISOTP_IDLE && client.reply == N_OK);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == 200UL);
+    CHECK(memcmp(server.Buffer, data, 200UL) == 0);
+    client.Buffer = NULL;
+}
+
+/* a received message stays in its block of the pool until it is released */
+static void test_rx_buffer_held(void)
+{
+    static U8 data[100];
+    U8       *held = NULL;
+
+    sim_setup();
+    client.Buffer = data;
+    fill(data, 5UL, 21u);
+    client.DL = 5UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 100000UL);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.Buffer != NULL);
+    held = server.Buffer;
+
+    /* not released: a SF and a FF are refused, the first message is kept */
+    fill(data, sizeof(data), 23u);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 100000UL);
+    CHECK(server.reply == N_BUFFER_OVFLW);
+    client.DL = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    wire_deliver(&to_server, &server);
+    CHECK(to_client.n == 1UL && to_client.frame[0].data[0] == 0x32);
+    (void)sim_run(100UL, 100000UL);
+    CHECK(client.reply == N_BUFFER_OVFLW);
+    CHECK(server.Buffer == held);
+    fill(data, 5UL, 21u);
+    CHECK(memcmp(server.Buffer, data, 5UL) == 0);
+
+    /* released: the next message is received again */
+    isotp_buffer_release(&server);
+    fill(data, sizeof(data), 25u);
+    client.DL = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == sizeof(data));
+    CHECK(memcmp(server.Buffer, data, sizeof(data)) == 0);
+    isotp_buffer_release(&server);
+
+    /* the block of a reception which timed out is taken back by the next one */
+    client.DL = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    wire_deliver(&to_server, &server);
+    /* the FC is lost and the client gone, no CF comes */
+    to_client.n = 0UL;
+    (void)isotp_init(&client, CLIENT_ADDRESS, SERVER_ADDRESS, NULL, client_send, NULL);
+    (void)sim_run(1000UL, 1000000UL);
+    CHECK(server.reply == N_TIMEOUT_Cx && server.Buffer != NULL);
+    client.Buffer = data;
+    client.DL     = 5UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 100000UL);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == 5UL);
+    CHECK(memcmp(server.Buffer, data, 5UL) == 0);
+    client.Buffer = NULL;
+}
+
+static U8 big_rx[6000];
+
+static U8 *big_rx_buffer(struct isotp_t *msg, U32 length)
+{
+    (void)msg;
+
+    return (length <= sizeof(big_rx)) ? big_rx : NULL;
+}
+
+/* a message above 4095 bytes gets the 32-bit FF_DL escape */
+static void test_ff_dl_escape(void)
+{
+    static U8            data[5000];
+    struct isotp_iovec_t iov;
+
+    sim_setup();
+    CHECK(isotp_set_rx_buffer_cb(&server, big_rx_buffer) == STATUS_NORMAL);
+    fill(data, sizeof(data), 17u);
+    iov.base = data;
+    iov.len  = sizeof(data);
+    CHECK(isotp_request_iov(&client, &iov, 1UL) == STATUS_NORMAL);
+    CHECK(to_server.n == 1UL);
+    CHECK(to_server.frame[0].data[0] == 0x10 && to_server.frame[0].data[1] == 0x00);
+    CHECK(to_server.frame[0].data[2] == 0x00 && to_server.frame[0].data[3] == 0x00);
+    CHECK(to_server.frame[0].data[4] == 0x13 && to_server.frame[0].data[5] == 0x88);
+    /* 6 bytes of PCI leave 2 of a classic frame */
+    CHECK(memcmp(to_server.frame[0].data + 6, data, 2UL) == 0);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.tp_state == ISOTP_IDLE && client.reply == N_OK);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == sizeof(data));
+    CHECK(memcmp(big_rx, data, sizeof(data)) == 0);
+
+    /* 4095 bytes still fit into the 12-bit FF_DL */
+    iov.len = ISOTP_FF_DL;
+    CHECK(isotp_request_iov(&client, &iov, 1UL) == STATUS_NORMAL);
+    CHECK(to_server.frame[0].data[0] == 0x1F && to_server.frame[0].data[1] == 0xFF);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == ISOTP_FF_DL);
+    CHECK(memcmp(big_rx, data, ISOTP_FF_DL) == 0);
+}
+
+struct wheel_probe_t
+{
+    struct timer_node_t node;
+    U32 fired;
+    U64 at_ns;              /* simulated time it expired at */
+};
+
+static void wheel_probe_cb(void *arg)
+{
+    struct wheel_probe_t *probe = (struct wheel_probe_t *)arg;
+
+    probe->fired ++;
+    probe->at_ns = now_ns;
+}
+
+/* run the wheel in steps of step us for span us */
+static void wheel_run(struct timer_wheel_t *wheel, U32 step, U32 span)
+{
+    U32 t = 0UL;
+
+    for(t = 0UL; t < span; t += step)
+    {
+        sim_advance(step);
+        (void)timer_wheel_advance(wheel);
+    }
+}
+
+/* deadlines on every level are cascaded down and fire on their tick */
+static void test_wheel_cascade(void)
+{
+    static struct timer_wheel_t wheel;
+    static struct wheel_probe_t probe[4];
+    static const U32 delay[4] = { 5UL, 100UL, 5000UL, 300000UL };  /* level 0, 1, 2, 3 */
+    U64 start = 0u;
+    U32 i     = 0UL;
+
+    timer_wheel_init(&wheel, 1UL);
+    start = now_ns;
+    for(i = 0UL; i < 4UL; i ++)
+    {
+        probe[i].fired = 0UL;
+        timer_node_init(&probe[i].node, wheel_probe_cb, &probe[i]);
+        timer_wheel_arm(&wheel, &probe[i].node, delay[i] * 1000UL);
+    }
+    CHECK(timer_wheel_next(&wheel) == 5000UL);
+
+    wheel_run(&wheel, 1000UL, 300000UL * 1000UL + 1000UL);
+    for(i = 0UL; i < 4UL; i ++)
+    {
+        CHECK(probe[i].fired == 1UL);
+        CHECK(probe[i].at_ns - start == (U64)delay[i] * 1000000u);
+    }
+    CHECK(timer_wheel_next(&wheel) == U32_INVALID_VALUE);
+
+    /* a node moved before it is due fires only at its new deadline */
+    timer_wheel_arm(&wheel, &probe[0].node, 100000UL);
+    timer_wheel_arm(&wheel, &probe[0].node, 7000000UL);
+    start = now_ns;
+    wheel_run(&wheel, 1000UL, 8000000UL);
+    CHECK(probe[0].fired == 2UL);
+    CHECK(probe[0].at_ns - start == 7000000000u);
+
+    /* a node parked beyond the horizon can be moved back in */
+    timer_wheel_arm(&wheel, &probe[1].node, 20000000UL);
+    timer_wheel_arm(&wheel, &probe[1].node, 1000UL);
+    wheel_run(&wheel, 1000UL, 21000000UL);
+    CHECK(probe[1].fired == 2UL);
+}
+
+/* the tick count wraps through 0 without losing or firing early */
+static void test_wheel_wrap(void)
+{
+    static struct timer_wheel_t wheel;
+    static struct wheel_probe_t probe[2];
+    U64 start = 0u;
+
+    timer_wheel_init(&wheel, 1UL);
+    /* an empty wheel jumps straight to the current tick, 80 before the wrap */
+    sim_advance(U32_INVALID_VALUE - 79UL);
+    (void)timer_wheel_advance(&wheel);
+    probe[0].fired = 0UL;
+    probe[1].fired = 0UL;
+    timer_node_init(&probe[0].node, wheel_probe_cb, &probe[0]);
+    timer_node_init(&probe[1].node, wheel_probe_cb, &probe[1]);
+    start = now_ns;
+    timer_wheel_arm(&wheel, &probe[0].node, 100UL);
+    timer_wheel_arm(&wheel, &probe[1].node, 9000UL);
+    CHECK(timer_wheel_next(&wheel) == 100UL);
+
+    wheel_run(&wheel, 1UL, 99UL);
+    CHECK(probe[0].fired == 0UL);
+    wheel_run(&wheel, 1UL, 1UL);
+    CHECK(probe[0].fired == 1UL && probe[0].at_ns - start == 100000u);
+    wheel_run(&wheel, 10UL, 8890UL);
+    CHECK(probe[1].fired == 0UL);
+    wheel_run(&wheel, 10UL, 20UL);
+    CHECK(probe[1].fired == 1UL && probe[1].at_ns - start == 9000000u);
+}
+
+/* N_As and N_Ar are the time the driver takes, also inside a poll */
+static void test_n_as_driver_time(void)
+{
+    static U8 data[100];
+
+    sim_setup();
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    to_server.block = 150000UL;
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.tp_state == ISOTP_ERROR && client.reply == N_TIMEOUT_Ax);
+
+    sim_setup();
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    to_server.block = 90000UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.reply == N_OK && server.reply == N_OK);
+
+    sim_setup();
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    to_client.block = 150000UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(server.tp_state == ISOTP_ERROR && server.reply == N_TIMEOUT_Ax);
+    client.Buffer = NULL;
+}
+
+#define LEGACY_READS    (200000UL)
+#define LEGACY_STEP     (3UL)     /* us each read moves the counter on */
+
+static U32 legacy_tick;
+
+/* a free running 32-bit counter, moved on by every read */
+static U32 legacy_tick_us(void)
+{
+    return __atomic_add_fetch(&legacy_tick, LEGACY_STEP, __ATOMIC_SEQ_CST);
+}
+
+static void *legacy_reader(void *arg)
+{
+    U64 last = 0u;
+    U64 now  = 0u;
+    U32 i    = 0UL;
+
+    *(U32 *)arg = 0UL;
+    last = timer_snapshot();
+    timer_snapshot_end();
+    for(i = 0UL; i < LEGACY_READS; i ++)
+    {
+        now = timer_snapshot();
+        timer_snapshot_end();
+        if(now < last)
+        {
+            (*(U32 *)arg) ++;
+        }
+        last = now;
+    }
+
+    return NULL;
+}
+
+/* the legacy 32-bit time base read by several threads across its wrap */
+static void test_legacy_tick_threads(void)
+{
+    pthread_t thread[4];
+    U32       backwards[4];
+    U64       start = 0u;
+    U64       end   = 0u;
+    U32       i     = 0UL;
+
+    legacy_tick = 0xFFF00000UL;
+    (void)timer_init(legacy_tick_us, TIMER_COUNT_UP, 1u);
+    start = timer_snapshot();
+    timer_snapshot_end();
+    for(i = 0UL; i < 4UL; i ++)
+    {
+        (void)pthread_create(&thread[i], NULL, legacy_reader, &backwards[i]);
+    }
+    for(i = 0UL; i < 4UL; i ++)
+    {
+        (void)pthread_join(thread[i], NULL);
+        CHECK(backwards[i] == 0UL);
+    }
+    end = timer_snapshot();
+    timer_snapshot_end();
+    /* every tick of the counter is counted once, none is lost or doubled */
+    CHECK((U32)end == legacy_tick);
+    CHECK(end - start == (U64)(U32)(legacy_tick - (U32)start));
+    CHECK(end > 0xFFFFFFFFu);
+
+    (void)timer_init_ns(sim_tick_ns, 1000u);
+}
+
+#define RING_FRAMES     (200000UL)
+
+static struct isotp_ring_t ring;
+
+/* producer thread: frames numbered in id, in runs of 1 to 7 */
+static void *ring_producer(void *arg)
+{
+    struct phy_msg_t frame[7];
+    U32              next = 0UL;
+    U32              run  = 0UL;
+    U32              n    = 0UL;
+    U32              i    = 0UL;
+
+    (void)arg;
+    memset(frame, 0, sizeof(frame));
+    while(next < RING_FRAMES)
+    {
+        run = 1UL + next % 7UL;
+        if(run > RING_FRAMES - next)
+        {
+            run = RING_FRAMES - next;
+        }
+        for(i = 0UL; i < run; i ++)
+        {
+            frame[i].id      = next + i;
+            frame[i].data[7] = (U8)(next + i);
+        }
+        n = isotp_ring_put(&ring, frame, run);
+        if(n == 0UL)
+        {
+            (void)sched_yield();
+        }
+        next += n;
+    }
+
+    return NULL;
+}
+
+/* one producer and one consumer thread see every frame once and in order */
+static void test_ring_threads(void)
+{
+    struct phy_msg_t frame[5];
+    pthread_t        producer;
+    U32              expect = 0UL;
+    U32              bad    = 0UL;
+    U32              n      = 0UL;
+    U32              i      = 0UL;
+
+    isotp_ring_init(&ring);
+    (void)pthread_create(&producer, NULL, ring_producer, NULL);
+    while(expect < RING_FRAMES)
+    {
+        n = isotp_ring_get(&ring, frame, 5UL);
+        if(n == 0UL)
+        {
+            (void)sched_yield();
+        }
+        for(i = 0UL; i < n; i ++)
+        {
+            if(frame[i].id != expect || frame[i].data[7] != (U8)expect)
+            {
+                bad ++;
+            }
+            expect ++;
+        }
+    }
+    (void)pthread_join(producer, NULL);
+    CHECK(bad == 0UL);
+    CHECK(isotp_ring_count(&ring) == 0UL);
+}
+
+/*
+ * CFs go out in runs of one driver call, the frames of a run the driver
+ * did not take are sent again from the first of them, none twice
+ */
+static void test_batch_rewind(void)
+{
+    static U8 data[300];
+    U32       i = 0UL;
+
+    sim_setup();
+    CHECK(isotp_set_tx_batch(&client, client_send_batch) == STATUS_NORMAL);
+    fill(data, sizeof(data), 27u);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    batch_calls   = 0UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    CHECK(batch_calls == 1UL && to_server.n == 1UL);
+
+    /* room for the FF, a whole run and part of the next one */
+    to_server.refuse = 1UL + ISOTP_TX_BATCH + 5UL;
+    wire_deliver(&to_server, &server);
+    wire_deliver(&to_client, &client);
+    (void)isotp_poll(&client);
+    CHECK(batch_calls == 2UL && to_server.n == ISOTP_TX_BATCH);
+    for(i = 0UL; i < to_server.n; i ++)
+    {
+        CHECK(to_server.frame[i].data[0] == (0x20 | ((i + 1UL) & 0x0F)));
+    }
+    wire_deliver(&to_server, &server);
+
+    /* the driver takes 5 CFs of the next run, then none */
+    (void)isotp_poll(&client);
+    (void)isotp_poll(&client);
+    CHECK(batch_calls == 4UL && to_server.n == 5UL);
+    CHECK(client.tp_state == ISOTP_SEND_CF);
+    for(i = 0UL; i < to_server.n; i ++)
+    {
+        CHECK(to_server.frame[i].data[0] == (0x20 | ((ISOTP_TX_BATCH + 1UL + i) & 0x0F)));
+    }
+    wire_deliver(&to_server, &server);
+    CHECK(server.tp_state == ISOTP_WAIT_DATA);
+
+    /* the rest of the run goes out from the first CF it did not take */
+    to_server.refuse = U32_INVALID_VALUE;
+    (void)isotp_poll(&client);
+    CHECK(to_server.n == ISOTP_TX_BATCH);
+    CHECK(to_server.frame[0].data[0] == (0x20 | ((ISOTP_TX_BATCH + 6UL) & 0x0F)));
+    CHECK(memcmp(to_server.frame[0].data + 1, data + 6UL + 7UL * (ISOTP_TX_BATCH + 5UL), 7UL) == 0);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.tp_state == ISOTP_IDLE && client.reply == N_OK);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == sizeof(data));
+    CHECK(memcmp(server.Buffer, data, sizeof(data)) == 0);
+    client.Buffer = NULL;
+}
+
+/* a vector of frames is fed at once and stops after the message ends */
+static void test_rx_batch(void)
+{
+    static U8               data[300];
+    static struct phy_msg_t frames[64];
+    struct phy_msg_t        ff;
+    U32                     n = 0UL;
+    U32                     i = 0UL;
+
+    sim_setup();
+    fill(data, sizeof(data), 29u);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    ff = to_server.frame[0];
+    wire_deliver(&to_server, &server);
+    wire_deliver(&to_client, &client);
+    while(client.tp_state == ISOTP_SEND_CF)
+    {
+        (void)isotp_poll(&client);
+    }
+    /* 42 CFs, a frame of another id among them, then the next message */
+    for(i = 0UL; i < to_server.n; i ++)
+    {
+        frames[n ++] = to_server.frame[i];
+        if(i == 10UL)
+        {
+            frames[n]    = to_server.frame[i];
+            frames[n].id = CLIENT_ADDRESS;
+            n ++;
+        }
+    }
+    CHECK(n == 43UL);
+    memset(&frames[n], 0, sizeof(frames[n]));
+    frames[n].id      = SERVER_ADDRESS;
+    frames[n].length  = FRAME_DATA_LEN;
+    frames[n].data[0] = 0x03;
+    frames[n].data[1] = 0xA1;
+    frames[n].data[2] = 0xA2;
+    frames[n].data[3] = 0xA3;
+    n ++;
+    to_server.n = 0UL;
+
+    CHECK(isotp_rx_batch(&server, frames, n) == n - 1UL);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == sizeof(data));
+    CHECK(memcmp(server.Buffer, data, sizeof(data)) == 0);
+    isotp_buffer_release(&server);
+    CHECK(isotp_rx_batch(&server, &frames[n - 1UL], 1UL) == 1UL);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == 3UL);
+    CHECK(server.Buffer[0] == 0xA1 && server.Buffer[2] == 0xA3);
+    isotp_buffer_release(&server);
+
+    /* a CF out of sequence ends the run at that frame */
+    CHECK(isotp_rx_batch(&server, &ff, 1UL) == 1UL);
+    CHECK(server.tp_state == ISOTP_WAIT_DATA);
+    frames[20].data[0] = (U8)(0x20 | ((frames[20].data[0] + 1u) & 0x0F));
+    CHECK(isotp_rx_batch(&server, frames, n) == 21UL);
+    CHECK(server.tp_state == ISOTP_ERROR && server.reply == N_WRONG_SN);
+    client.Buffer = NULL;
+}
+
+#define ENGINE_PAIRS    (8UL)
+#define ENGINE_FEED     (256UL)
+
+static struct isotp_engine_t         engine;
+static struct isotp_engine_session_t engine_client[ENGINE_PAIRS];
+static struct isotp_engine_session_t engine_server[ENGINE_PAIRS];
+static U8                            engine_data[ENGINE_PAIRS][300];
+static pthread_mutex_t               engine_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct phy_msg_t              engine_feed[ENGINE_FEED];
+static U32                           engine_feed_n;
+static U32                           engine_sent, engine_received, engine_bad;
+
+static U64 real_tick_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (U64)ts.tv_sec * 1000000000u + (U64)ts.tv_nsec;
+}
+
+/* the sessions send from the workers, the frames are fed back by main */
+static ERROR_CODE engine_send(struct phy_msg_t *frame)
+{
+    ERROR_CODE err = ERR_FULL;
+
+    pthread_mutex_lock(&engine_lock);
+    if(engine_feed_n < ENGINE_FEED)
+    {
+        engine_feed[engine_feed_n] = *frame;
+        engine_feed_n ++;
+        err = STATUS_NORMAL;
+    }
+    pthread_mutex_unlock(&engine_lock);
+
+    return err;
+}
+
+static void engine_event_cb(struct isotp_engine_session_t *session)
+{
+    U32 i = (U32)(session - engine_server);
+
+    pthread_mutex_lock(&engine_lock);
+    if(i < ENGINE_PAIRS)
+    {
+        if(session->msg.reply != N_OK
+            || memcmp(session->msg.Buffer, engine_data[i], session->msg.DL) != 0)
+        {
+            engine_bad ++;
+        }
+        engine_received ++;
+        (void)isotp_buffer_release(&session->msg);
+    }
+    else
+    {
+        if(session->msg.reply != N_OK)
+        {
+            engine_bad ++;
+        }
+        engine_sent ++;
+    }
+    pthread_mutex_unlock(&engine_lock);
+}
+
+/* feed the frames sent back until every session has had its events */
+static void engine_wait(U32 events)
+{
+    struct phy_msg_t frames[ENGINE_FEED];
+    U64              start = real_tick_ns();
+    U32              n     = 0UL;
+    U32              done  = 0UL;
+
+    do
+    {
+        pthread_mutex_lock(&engine_lock);
+        n = engine_feed_n;
+        memcpy(frames, engine_feed, n * sizeof(frames[0]));
+        engine_feed_n = 0UL;
+        done = engine_sent + engine_received;
+        pthread_mutex_unlock(&engine_lock);
+        (void)isotp_engine_post(&engine, frames, n);
+        if(n == 0UL)
+        {
+            (void)sched_yield();
+        }
+    } while(done < events && real_tick_ns() - start < 5000000000u);
+}
+
+static void engine_submit_all(U32 length)
+{
+    U32 i = 0UL;
+
+    for(i = 0UL; i < ENGINE_PAIRS; i ++)
+    {
+        engine_client[i].msg.Buffer = engine_data[i];
+        engine_client[i].msg.DL     = length;
+        CHECK(isotp_engine_submit(&engine, &engine_client[i]) == STATUS_NORMAL);
+    }
+}
+
+/*
+ * Sessions talking to each other through the engine: every message and
+ * every SF, also one after another to the same session, gives one event
+ */
+static void test_engine(void)
+{
+    U32 i = 0UL;
+
+    (void)timer_init_ns(real_tick_ns, 1000u);
+    CHECK(isotp_engine_init(&engine, 2UL, engine_event_cb) == STATUS_NORMAL);
+    for(i = 0UL; i < ENGINE_PAIRS; i ++)
+    {
+        fill(engine_data[i], sizeof(engine_data[i]), (U8)i);
+        (void)isotp_init(&engine_client[i].msg, 0x600 + i, 0x700 + i, NULL, engine_send, NULL);
+        (void)isotp_init(&engine_server[i].msg, 0x700 + i, 0x600 + i, NULL, engine_send, NULL);
+        CHECK(isotp_engine_add(&engine, &engine_client[i]) == STATUS_NORMAL);
+        CHECK(isotp_engine_add(&engine, &engine_server[i]) == STATUS_NORMAL);
+    }
+    CHECK(isotp_engine_add(&engine, &engine_server[0]) == ERR_USED);
+    CHECK(isotp_engine_start(&engine) == STATUS_NORMAL);
+
+    engine_submit_all(sizeof(engine_data[0]));
+    engine_wait(2UL * ENGINE_PAIRS);
+    CHECK(engine_sent == ENGINE_PAIRS && engine_received == ENGINE_PAIRS);
+
+    engine_submit_all(5UL);
+    engine_wait(4UL * ENGINE_PAIRS);
+    engine_submit_all(5UL);
+    engine_wait(6UL * ENGINE_PAIRS);
+    isotp_engine_stop(&engine);
+    CHECK(engine_sent == 3UL * ENGINE_PAIRS && engine_received == 3UL * ENGINE_PAIRS);
+    CHECK(engine_bad == 0UL);
+
+    (void)timer_init_ns(sim_tick_ns, 1000u);
+}
+
+static struct isotp_engine_session_t engine_many[ISOTP_ENGINE_MAX_SESSION + 1UL];
+
+/* the run queue of a worker holds every session homed on it */
+static void test_engine_capacity(void)
+{
+    static struct isotp_txq_t queue;
+    U32                       i = 0UL;
+
+    CHECK(isotp_engine_init(&engine, 1UL, NULL) == STATUS_NORMAL);
+    for(i = 0UL; i < ISOTP_ENGINE_MAX_SESSION; i ++)
+    {
+        (void)isotp_init(&engine_many[i].msg, i, 0x7FF, NULL, engine_send, NULL);
+        CHECK(isotp_engine_add(&engine, &engine_many[i]) == STATUS_NORMAL);
+    }
+    (void)isotp_init(&engine_many[i].msg, i, 0x7FF, NULL, engine_send, NULL);
+    CHECK(isotp_engine_add(&engine, &engine_many[i]) == ERR_FULL);
+    CHECK(isotp_table_find(&engine.table, i) == NULL);
+
+    /* a transmit queue is not safe to pump from the workers */
+    CHECK(isotp_engine_init(&engine, 1UL, NULL) == STATUS_NORMAL);
+    CHECK(isotp_txq_init(&queue, engine_send, 0UL, 0UL) == STATUS_NORMAL);
+    CHECK(isotp_set_txq(&engine_many[0].msg, &queue, ISOTP_TXQ_CLASS_DEFAULT) == STATUS_NORMAL);
+    CHECK(isotp_engine_add(&engine, &engine_many[0]) == ERR_PARAMETER);
+    CHECK(isotp_table_find(&engine.table, 0UL) == NULL);
+    (void)isotp_set_txq(&engine_many[0].msg, NULL, 0u);
+}
+
+struct service_log_t
+{
+    U32 con, ff_ind, ind, change_con;
+    enum N_Result con_result, ind_result;
+    U32 ff_length;
+    U32 ind_dl;
+    enum N_Result_ChangeParameter change_result;
+    U32 order;              /* ff_ind given before the last ind */
+};
+
+static struct service_log_t client_log, server_log;
+
+static struct service_log_t *service_log(const struct isotp_t *msg)
+{
+    return (msg == &client) ? &client_log : &server_log;
+}
+
+static void log_con(struct isotp_t *msg, enum N_Result result)
+{
+    service_log(msg)->con ++;
+    service_log(msg)->con_result = result;
+}
+
+static void log_ff_ind(struct isotp_t *msg, U32 length)
+{
+    service_log(msg)->ff_ind ++;
+    service_log(msg)->ff_length = length;
+}
+
+static void log_ind(struct isotp_t *msg, enum N_Result result)
+{
+    struct service_log_t *log = service_log(msg);
+
+    log->ind ++;
+    log->ind_result = result;
+    log->ind_dl     = msg->DL;
+    log->order      = log->ff_ind;
+}
+
+static void log_change_con(struct isotp_t *msg, enum ISOTP_PARAM_e param,
+                           enum N_Result_ChangeParameter result)
+{
+    (void)param;
+    service_log(msg)->change_con ++;
+    service_log(msg)->change_result = result;
+}
+
+static const struct isotp_service_t log_service = { log_con, log_ff_ind, log_ind, log_change_con };
+
+static void service_setup(void)
+{
+    sim_setup();
+    memset(&client_log, 0, sizeof(client_log));
+    memset(&server_log, 0, sizeof(server_log));
+    (void)isotp_set_service(&client, &log_service);
+    (void)isotp_set_service(&server, &log_service);
+}
+
+/* each transfer gives one con to the sender and one ind to the receiver */
+static void test_service(void)
+{
+    static U8 data[100];
+
+    fill(data, sizeof(data), 9u);
+
+    service_setup();
+    client.Buffer = data;
+    client.DL     = 5UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client_log.con == 1UL && client_log.con_result == N_OK);
+    CHECK(server_log.ind == 1UL && server_log.ind_result == N_OK && server_log.ind_dl == 5UL);
+    CHECK(server_log.ff_ind == 0UL && client_log.ind == 0UL && server_log.con == 0UL);
+    isotp_buffer_release(&server);
+
+    client.DL = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client_log.con == 2UL && client_log.con_result == N_OK);
+    CHECK(server_log.ff_ind == 1UL && server_log.ff_length == sizeof(data));
+    CHECK(server_log.ind == 2UL && server_log.ind_result == N_OK && server_log.order == 1UL);
+    CHECK(server_log.ind_dl == sizeof(data) && memcmp(server.Buffer, data, sizeof(data)) == 0);
+    isotp_buffer_release(&server);
+
+    /* no FC comes in N_Bs, 250 ms: the sender is confirmed with N_TIMEOUT_Bs */
+    service_setup();
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    to_server.n = 0UL;
+    sim_advance(251000UL);
+    (void)isotp_poll(&client);
+    CHECK(client_log.con == 1UL && client_log.con_result == N_TIMEOUT_Bx);
+
+    /* no CF comes in N_Cr, 250 ms: the receiver is told N_TIMEOUT_Cr */
+    service_setup();
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    wire_deliver(&to_server, &server);
+    CHECK(server_log.ff_ind == 1UL && server_log.ind == 0UL);
+    to_client.n = 0UL;
+    sim_advance(251000UL);
+    (void)isotp_poll(&server);
+    CHECK(server_log.ind == 1UL && server_log.ind_result == N_TIMEOUT_Cx);
+
+    /* N_ChangeParameter is confirmed at once, refused while receiving */
+    service_setup();
+    CHECK(isotp_change_parameter(&server, ISOTP_PARAM_STmin, 0x80u) == N_WRONG_VALUE);
+    CHECK(server_log.change_con == 1UL && server_log.change_result == N_WRONG_VALUE);
+    CHECK(isotp_change_parameter(&server, ISOTP_PARAM_BS, 4u) == N_CHANGE_OK);
+    CHECK(server_log.change_con == 2UL && server_log.change_result == N_CHANGE_OK);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    wire_deliver(&to_server, &server);
+    CHECK(isotp_change_parameter(&server, ISOTP_PARAM_BS, 8u) == N_RX_ON);
+    CHECK(server_log.change_con == 3UL && server_log.change_result == N_RX_ON);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client_log.con == 1UL && client_log.con_result == N_OK);
+    CHECK(server_log.ind == 1UL && server_log.ind_result == N_OK);
+
+    (void)isotp_set_service(&client, NULL);
+    (void)isotp_set_service(&server, NULL);
+    isotp_buffer_release(&server);
+    client.Buffer = NULL;
+}
+
+static U8  stream_window[FRAME_DATA_LEN];
+static U8  stream_data[ISOTP_BUFFER_SIZE];
+static U32 stream_calls, stream_got, stream_max;
+static U32 stream_refuse_at;    /* offset the consumer refuses from */
+
+static ERROR_CODE stream_consumer(struct isotp_t *msg, U32 offset, const U8 *data, U32 length)
+{
+    (void)msg;
+    stream_calls ++;
+    if(offset >= stream_refuse_at)
+    {
+        return ERR_FULL;
+    }
+    memcpy(stream_data + offset, data, length);
+    stream_got = offset + length;
+    if(length > stream_max)
+    {
+        stream_max = length;
+    }
+
+    return STATUS_NORMAL;
+}
+
+static void stream_setup(U32 refuse_at)
+{
+    sim_setup();
+    stream_calls     = 0UL;
+    stream_got       = 0UL;
+    stream_max       = 0UL;
+    stream_refuse_at = refuse_at;
+    CHECK(isotp_set_rx_stream(&server, stream_consumer, stream_window, sizeof(stream_window)) == STATUS_NORMAL);
+}
+
+/*
+ * A window of a classic frame is the least a consumer may be given, a
+ * message it refuses with its FF is answered by FC OVFLW
+ */
+static void test_rx_stream(void)
+{
+    static U8 data[100];
+
+    fill(data, sizeof(data), 5u);
+
+    sim_setup();
+    CHECK(isotp_set_rx_stream(&server, stream_consumer, stream_window, FRAME_DATA_LEN - 1UL) == ERR_PARAMETER);
+    CHECK(isotp_set_rx_stream(&server, stream_consumer, NULL, FRAME_DATA_LEN) == ERR_POINTER_0);
+
+    /* handed on in pieces no larger than the window */
+    stream_setup(U32_INVALID_VALUE);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.tp_state == ISOTP_IDLE && client.reply == N_OK);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.reply == N_OK);
+    CHECK(stream_got == sizeof(data) && memcmp(stream_data, data, sizeof(data)) == 0);
+    CHECK(stream_max <= FRAME_DATA_LEN && stream_calls >= sizeof(data) / FRAME_DATA_LEN);
+
+    /* refused with the FF: FC OVFLW, both sides end with an error */
+    stream_setup(0UL);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    wire_deliver(&to_server, &server);
+    CHECK(to_client.n == 1UL && to_client.frame[0].data[0] == 0x32);
+    CHECK(server.tp_state == ISOTP_ERROR && server.reply == N_ERROR);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.tp_state == ISOTP_ERROR && client.reply == N_BUFFER_OVFLW);
+
+    /* refused later on: the reception is aborted, no more is handed on */
+    stream_setup(20UL);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(server.tp_state == ISOTP_ERROR && server.reply == N_ERROR);
+    CHECK(stream_got <= 20UL + FRAME_DATA_LEN);
+
+    /* FD frames do not fit into the window: FC OVFLW */
+    stream_setup(U32_INVALID_VALUE);
+    CHECK(isotp_set_tx_dl(&client, CANFD_DATA_LEN) == STATUS_NORMAL);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    wire_deliver(&to_server, &server);
+    CHECK(to_client.n == 1UL && to_client.frame[0].data[0] == 0x32);
+    CHECK(server.tp_state == ISOTP_ERROR && server.reply == N_BUFFER_OVFLW);
+    CHECK(stream_calls == 0UL);
+
+    (void)isotp_set_rx_stream(&server, NULL, NULL, 0UL);
+    client.Buffer = NULL;
+}
+
+/*
+ * The FC received as a sender does not change the FC sent as a
+ * receiver: an OVFLW or the BS/STmin of the peer are not sent back
+ */
+static void test_fc_sides(void)
+{
+    static U8 data[100];
+
+    fill(data, sizeof(data), 11u);
+
+    sim_setup();
+    (void)fc_set(&client, ISOTP_FS_CTS, 4u, 2u);
+    (void)fc_set(&server, ISOTP_FS_CTS, 8u, 1u);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.tp_state == ISOTP_IDLE && client.reply == N_OK);
+    CHECK(client.tx_BS == 8u && client.tx_STmin == 1u);
+    CHECK(client.FS == ISOTP_FS_CTS && client.BS == 4u && client.STmin == 2u);
+    isotp_buffer_release(&server);
+
+    /* refused by the server with FC OVFLW */
+    stream_setup(0UL);
+    (void)fc_set(&client, ISOTP_FS_CTS, 4u, 2u);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.tp_state == ISOTP_ERROR && client.reply == N_BUFFER_OVFLW);
+    CHECK(client.tx_FS == ISOTP_FS_OVFLW && client.FS == ISOTP_FS_CTS);
+    (void)isotp_set_rx_stream(&server, NULL, NULL, 0UL);
+
+    /* the next FF from the server is answered with the client's own FC */
+    client.Buffer = NULL;
+    server.Buffer = data;
+    server.DL     = sizeof(data);
+    CHECK(isotp_request(&server) == STATUS_NORMAL);
+    wire_deliver(&to_client, &client);
+    CHECK(to_server.n == 1UL);
+    CHECK(to_server.frame[0].data[0] == 0x30 && to_server.frame[0].data[1] == 4u
+          && to_server.frame[0].data[2] == 2u);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(server.tp_state == ISOTP_IDLE && server.reply == N_OK);
+    CHECK(client.tp_state == ISOTP_FINISHED && client.reply == N_OK);
+    CHECK(client.DL == sizeof(data) && memcmp(client.Buffer, data, sizeof(data)) == 0);
+    isotp_buffer_release(&client);
+    server.Buffer = NULL;
+}
+
+static void client_fc(U8 fs)
+{
+    struct phy_msg_t frame;
+
+    memset(&frame, 0, sizeof(frame));
+    frame.id      = CLIENT_ADDRESS;
+    frame.length  = FRAME_DATA_LEN;
+    frame.data[0] = (U8)(0x30 | fs);
+    (void)isotp_on_frame(&client, &frame);
+}
+
+/* a FC the driver refuses at the end of a block is sent by the next poll */
+static void test_fc_refused(void)
+{
+    static U8 data[100];
+
+    sim_setup();
+    (void)fc_set(&server, ISOTP_FS_CTS, 2u, 0u);
+    fill(data, sizeof(data), 61u);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    wire_deliver(&to_server, &server);
+    wire_deliver(&to_client, &client);
+    (void)isotp_poll(&client);
+    (void)isotp_poll(&client);
+    CHECK(client.tp_state == ISOTP_WAIT_FC && to_server.n == 2UL);
+
+    to_client.refuse = to_client.sent;
+    wire_deliver(&to_server, &server);
+    CHECK(server.tp_state == ISOTP_WAIT_DATA && server.fc_pending == TRUE);
+    CHECK(to_client.n == 0UL);
+    CHECK(isotp_next_deadline(&server) <= 100UL);
+
+    to_client.refuse = U32_INVALID_VALUE;
+    sim_advance(100UL);
+    (void)isotp_poll(&server);
+    CHECK(server.fc_pending == FALSE && to_client.n == 1UL);
+    CHECK(to_client.frame[0].data[0] == 0x30 && to_client.frame[0].data[1] == 2u);
+    (void)sim_run(100UL, 100000UL);
+    CHECK(client.tp_state == ISOTP_IDLE && client.reply == N_OK);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.DL == sizeof(data));
+    CHECK(memcmp(server.Buffer, data, sizeof(data)) == 0);
+    client.Buffer = NULL;
+}
+
+/*
+ * The peer profile spaces the CFs after a WAIT and lets it go again,
+ * and holds back a message as long as one it refused until retry
+ */
+static void test_peer_pacing(void)
+{
+    static U8           data[100];
+    struct isotp_peer_t peer;
+    U32                 took  = 0UL;
+    U32                 chunk = 0UL;
+
+    fill(data, sizeof(data), 13u);
+    isotp_peer_init(&peer);
+
+    /* held once with WAIT: the pace is learnt */
+    sim_setup();
+    CHECK(isotp_set_peer(&client, &peer) == STATUS_NORMAL);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    to_server.n = 0UL;
+    client_fc(ISOTP_FS_WAIT);
+    client_fc(ISOTP_FS_CTS);
+    while(client.tp_state == ISOTP_SEND_CF)
+    {
+        (void)isotp_poll(&client);
+        sim_advance(10UL);
+    }
+    CHECK(client.tp_state == ISOTP_IDLE && client.reply == N_OK);
+    CHECK(peer.waits == 1UL && peer.pace == ISOTP_PEER_PACE_MIN);
+
+    /* the 14 CFs of the next message are spaced by the pace */
+    wire_reset(&to_server);
+    client.DL = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    took = sim_run(10UL, 1000000UL);
+    CHECK(server.tp_state == ISOTP_FINISHED && server.reply == N_OK);
+    CHECK(took >= 13UL * ISOTP_PEER_PACE_MIN);
+    CHECK(peer.pace == 0UL && peer.max_len == sizeof(data));
+    isotp_buffer_release(&server);
+
+    /* refused with OVFLW: held back until retry, a shorter one goes */
+    stream_setup(0UL);
+    CHECK(isotp_set_peer(&client, &peer) == STATUS_NORMAL);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.reply == N_BUFFER_OVFLW);
+    CHECK(peer.overflows == 1UL && peer.ovflw_len == sizeof(data) && peer.retry == ISOTP_PEER_RETRY_MIN);
+    (void)isotp_set_rx_stream(&server, NULL, NULL, 0UL);
+
+    wire_reset(&to_server);
+    client.DL = sizeof(data);
+    CHECK(isotp_request(&client) == ERR_FULL);
+    CHECK(to_server.n == 0UL && client.tp_state == ISOTP_ERROR);
+    chunk = isotp_peer_chunk(&peer, sizeof(data));
+    CHECK(chunk < sizeof(data));
+    client.DL = chunk;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.reply == N_OK && server.DL == chunk);
+    isotp_buffer_release(&server);
+
+    sim_advance(ISOTP_PEER_RETRY_MIN);
+    client.DL = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    (void)sim_run(100UL, 1000000UL);
+    CHECK(client.reply == N_OK && server.DL == sizeof(data));
+    CHECK(peer.ovflw_len == 0UL && peer.retry == 0UL);
+    isotp_buffer_release(&server);
+    (void)isotp_set_peer(&client, NULL);
+    client.Buffer = NULL;
+}
+
+#define SCHED_PAIRS     (3UL)
+
+static struct isotp_sched_t sched;
+static struct isotp_t       sched_client[SCHED_PAIRS], sched_server[SCHED_PAIRS];
+static struct wire_t        bus;
+static U32                  bus_head;
+
+static ERROR_CODE bus_send(struct phy_msg_t *frame)
+{
+    return wire_put(&bus, frame);
+}
+
+/* every frame sent stays on the bus, in the order it was sent */
+static ERROR_CODE bus_receive(struct phy_msg_t *frame)
+{
+    if(bus_head >= bus.n)
+    {
+        return ERR_EMPTY;
+    }
+    *frame = bus.frame[bus_head];
+    bus_head ++;
+
+    return STATUS_NORMAL;
+}
+
+/*
+ * Sessions on one bus are stepped round robin: while one waits for its
+ * STmin the others send, so the messages go out interleaved
+ */
+static void test_sched_interleave(void)
+{
+    static U8 data[SCHED_PAIRS][100];
+    U64       start     = 0u;
+    U32       first_cf1 = U32_INVALID_VALUE;
+    U32       last_cf0  = 0UL;
+    U32       i         = 0UL;
+
+    wire_reset(&bus);
+    bus_head = 0UL;
+    CHECK(isotp_sched_init(&sched, bus_receive) == STATUS_NORMAL);
+    for(i = 0UL; i < SCHED_PAIRS; i ++)
+    {
+        fill(data[i], sizeof(data[i]), (U8)(20u + i));
+        (void)isotp_init(&sched_client[i], 0x610 + i, 0x710 + i, NULL, bus_send, NULL);
+        (void)isotp_init(&sched_server[i], 0x710 + i, 0x610 + i, NULL, bus_send, NULL);
+        (void)fc_set(&sched_server[i], ISOTP_FS_CTS, 0u, 1u);
+        CHECK(isotp_sched_add(&sched, &sched_client[i]) == STATUS_NORMAL);
+        CHECK(isotp_sched_add(&sched, &sched_server[i]) == STATUS_NORMAL);
+    }
+    CHECK(isotp_sched_add(&sched, &sched_server[0]) == ERR_USED);
+
+    start = now_ns;
+    for(i = 0UL; i < SCHED_PAIRS; i ++)
+    {
+        sched_client[i].Buffer = data[i];
+        sched_client[i].DL     = sizeof(data[i]);
+        CHECK(isotp_request(&sched_client[i]) == STATUS_NORMAL);
+    }
+    CHECK(isotp_sched_busy(&sched) == SCHED_PAIRS);
+    CHECK(isotp_sched_run(&sched) == STATUS_NORMAL);
+    CHECK(isotp_sched_busy(&sched) == 0UL);
+
+    for(i = 0UL; i < SCHED_PAIRS; i ++)
+    {
+        CHECK(sched_client[i].tp_state == ISOTP_IDLE && sched_client[i].reply == N_OK);
+        CHECK(sched_server[i].tp_state == ISOTP_FINISHED && sched_server[i].reply == N_OK);
+        CHECK(sched_server[i].DL == sizeof(data[i])
+              && memcmp(sched_server[i].Buffer, data[i], sizeof(data[i])) == 0);
+        isotp_buffer_release(&sched_server[i]);
+        sched_client[i].Buffer = NULL;
+    }
+    for(i = 0UL; i < bus.n; i ++)
+    {
+        if((bus.frame[i].data[0] & 0xF0) != 0x20)
+        {
+            continue;
+        }
+        if(bus.frame[i].id == 0x710)
+        {
+            last_cf0 = i;
+        }
+        if(bus.frame[i].id == 0x711 && first_cf1 == U32_INVALID_VALUE)
+        {
+            first_cf1 = i;
+        }
+    }
+    /* 14 CFs 1 ms apart each: one after another would take 39 ms at least */
+    CHECK(first_cf1 < last_cf0);
+    CHECK(now_ns - start < 20000000u);
+}
+
+static struct isotp_txq_t txq;
+static U64                txq_sent_at[WIRE_SIZE];
+
+static ERROR_CODE txq_driver(struct phy_msg_t *frame)
+{
+    ERROR_CODE err = wire_put(&to_server, frame);
+
+    if(err == STATUS_NORMAL)
+    {
+        txq_sent_at[to_server.n - 1UL] = now_ns;
+    }
+
+    return err;
+}
+
+static void txq_frame(struct phy_msg_t *frame, U32 id, U8 tag)
+{
+    memset(frame, 0, sizeof(*frame));
+    frame->id      = id;
+    frame->length  = FRAME_DATA_LEN;
+    frame->data[0] = tag;
+}
+
+/*
+ * The queue lets the frames out by class, then by arbitration, then by
+ * arrival, and no faster than its budget once the burst is spent
+ */
+static void test_txq(void)
+{
+    struct phy_msg_t frame;
+    U32              bits    = 0UL;
+    U32              burst   = 0UL;
+    U32              first   = 0UL;
+    U32              wasted  = 0UL;
+    U32              n       = 0UL;
+    U32              r       = 0UL;
+    U32              expect  = 0UL;
+    U32              i       = 0UL;
+
+    /* a budget can't be counted in the unknown unit of the legacy base */
+    (void)timer_init(legacy_tick_us, TIMER_COUNT_UP, 1u);
+    CHECK(isotp_txq_init(&txq, txq_driver, 100000UL, 0UL) == ERR_NOT_INIT);
+    CHECK(isotp_txq_init(&txq, txq_driver, 0UL, 0UL) == STATUS_NORMAL);
+    (void)timer_init_ns(sim_tick_ns, 1000u);
+
+    /* held by the driver, then let out in order */
+    wire_reset(&to_server);
+    to_server.refuse = 0UL;
+    CHECK(isotp_txq_init(&txq, txq_driver, 0UL, 0UL) == STATUS_NORMAL);
+    txq_frame(&frame, 0x700, 1u);
+    CHECK(isotp_txq_put(&txq, &frame, 1UL, ISOTP_TXQ_CLASS_DEFAULT) == STATUS_NORMAL);
+    txq_frame(&frame, 0x700, 2u);
+    CHECK(isotp_txq_put(&txq, &frame, 1UL, ISOTP_TXQ_CLASS_DEFAULT) == STATUS_NORMAL);
+    txq_frame(&frame, 0x100, 3u);
+    CHECK(isotp_txq_put(&txq, &frame, 1UL, ISOTP_TXQ_CLASS_DEFAULT) == STATUS_NORMAL);
+    txq_frame(&frame, ISOTP_ID_EXT_FLAG | (0x100UL << 18), 4u);
+    CHECK(isotp_txq_put(&txq, &frame, 1UL, ISOTP_TXQ_CLASS_DEFAULT) == STATUS_NORMAL);
+    txq_frame(&frame, 0x7FF, 5u);
+    CHECK(isotp_txq_put(&txq, &frame, 1UL, 1u) == STATUS_NORMAL);
+    CHECK(isotp_txq_count(&txq) == 5UL && to_server.n == 0UL);
+    CHECK(isotp_txq_pump(&txq) == 0UL);
+    to_server.refuse = U32_INVALID_VALUE;
+    CHECK(isotp_txq_pump(&txq) == U32_INVALID_VALUE);
+    CHECK(to_server.n == 5UL);
+    CHECK(to_server.frame[0].data[0] == 5u && to_server.frame[1].data[0] == 3u
+          && to_server.frame[2].data[0] == 4u && to_server.frame[3].data[0] == 1u
+          && to_server.frame[4].data[0] == 2u);
+
+    /* 20 frames at 100 kbit/s: the burst goes at once, then one per 135 bits */
+    wire_reset(&to_server);
+    CHECK(isotp_txq_init(&txq, txq_driver, 100000UL, 0UL) == STATUS_NORMAL);
+    burst = txq.burst;
+    txq_frame(&frame, 0x700, 0u);
+    bits = isotp_frame_bits(&frame);
+    for(i = 0UL; i < 20UL; i ++)
+    {
+        frame.data[0] = (U8)i;
+        CHECK(isotp_txq_put(&txq, &frame, 1UL, ISOTP_TXQ_CLASS_DEFAULT) == STATUS_NORMAL);
+    }
+    first = to_server.n;
+    CHECK(first == burst / bits);
+    while((r = isotp_txq_pump(&txq)) != U32_INVALID_VALUE)
+    {
+        CHECK(r > 0UL);
+        n = to_server.n;
+        sim_advance(r);
+        (void)isotp_txq_pump(&txq);
+        if(to_server.n == n)
+        {
+            wasted ++;
+        }
+    }
+    CHECK(to_server.n == 20UL && wasted == 0UL);
+    expect = (U32)(((U64)(20UL * bits - burst) * 1000000u + 99999u) / 100000u);
+    CHECK((U32)((txq_sent_at[19] - txq_sent_at[0]) / 1000u) >= expect
+          && (U32)((txq_sent_at[19] - txq_sent_at[0]) / 1000u) <= expect + 1UL);
+
+    /* the queue is no deadline of the session, whoever pumps it waits on it */
+    sim_setup();
+    CHECK(isotp_txq_init(&txq, txq_driver, 100000UL, 0UL) == STATUS_NORMAL);
+    CHECK(isotp_set_txq(&client, &txq, ISOTP_TXQ_CLASS_DEFAULT) == STATUS_NORMAL);
+    for(i = 0UL; i <= burst / bits; i ++)
+    {
+        (void)isotp_txq_put(&txq, &frame, 1UL, ISOTP_TXQ_CLASS_DEFAULT);
+    }
+    CHECK(isotp_txq_count(&txq) == 1UL);
+    CHECK(isotp_next_deadline(&client) == U32_INVALID_VALUE);
+    CHECK(isotp_txq_next(&txq) > 0UL && isotp_txq_next(&txq) != U32_INVALID_VALUE);
+
+    /* not moved to another queue during a transfer */
+    client.Buffer = to_server.frame[0].data;
+    client.DL     = 20UL;
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    CHECK(isotp_set_txq(&client, NULL, 0u) == ERR_USED);
+    CHECK(client.isotp.txq == &txq);
+    client.Buffer = NULL;
+}
+
+/* a FC queued by a receiver goes out while isotp_receive() waits */
+static void test_receive_txq(void)
+{
+    static struct isotp_txq_t txq;
+    static U8                 data[100];
+
+    sim_setup();
+    CHECK(isotp_txq_init(&txq, server_send, 0UL, 0UL) == STATUS_NORMAL);
+    CHECK(isotp_set_txq(&server, &txq, ISOTP_TXQ_CLASS_DEFAULT) == STATUS_NORMAL);
+    client.Buffer = data;
+    client.DL     = sizeof(data);
+    CHECK(isotp_request(&client) == STATUS_NORMAL);
+    to_client.refuse = 0UL;
+    wire_deliver(&to_server, &server);
+    CHECK(server.tp_state == ISOTP_WAIT_DATA);
+    CHECK(isotp_txq_count(&txq) == 1UL && to_client.n == 0UL);
+
+    /* no CF follows, the wait ends by N_Cr once the FC is out */
+    to_client.refuse = U32_INVALID_VALUE;
+    CHECK(isotp_receive(&server, 1000UL) == N_TIMEOUT_Cx);
+    CHECK(isotp_txq_count(&txq) == 0UL);
+    CHECK(to_client.n == 1UL && to_client.frame[0].data[0] == 0x30);
+    (void)isotp_set_txq(&server, NULL, 0u);
+    client.Buffer = NULL;
+}
+
+/*
+ * Sessions stepped by the scheduler send through a shared queue: the
+ * scheduler pumps it until it is empty and keeps to its budget
+ */
+static void test_sched_txq(void)
+{
+    static U8 data[SCHED_PAIRS][100];
+    U64       start = 0u;
+    U64       bits  = 0u;
+    U32       i     = 0UL;
+
+    wire_reset(&bus);
+    bus_head = 0UL;
+    CHECK(isotp_txq_init(&txq, bus_send, 250000UL, 0UL) == STATUS_NORMAL);
+    CHECK(isotp_sched_init(&sched, bus_receive) == STATUS_NORMAL);
+    for(i = 0UL; i < SCHED_PAIRS; i ++)
+    {
+        fill(data[i], sizeof(data[i]), (U8)(40u + i));
+        (void)isotp_init(&sched_client[i], 0x610 + i, 0x710 + i, NULL, bus_send, NULL);
+        (void)isotp_init(&sched_server[i], 0x710 + i, 0x610 + i, NULL, bus_send, NULL);
+        (void)fc_set(&sched_server[i], ISOTP_FS_CTS, 0u, 0u);
+        CHECK(isotp_set_txq(&sched_client[i], &txq, (U8)i) == STATUS_NORMAL);
+        CHECK(isotp_set_txq(&sched_server[i], &txq, 0u) == STATUS_NORMAL);
+        (void)isotp_sched_add(&sched, &sched_client[i]);
+        (void)isotp_sched_add(&sched, &sched_server[i]);
+    }
+
+    start = now_ns;
+    for(i = 0UL; i < SCHED_PAIRS; i ++)
+    {
+        sched_client[i].Buffer = data[i];
+        sched_client[i].DL     = sizeof(data[i]);
+        CHECK(isotp_request(&sched_client[i]) == STATUS_NORMAL);
+    }
+    CHECK(isotp_sched_run(&sched) == STATUS_NORMAL);
+    CHECK(isotp_txq_count(&txq) == 0UL);
+    for(i = 0UL; i < SCHED_PAIRS; i ++)
+    {
+        CHECK(sched_client[i].reply == N_OK && sched_server[i].reply == N_OK);
+        CHECK(memcmp(sched_server[i].Buffer, data[i], sizeof(data[i])) == 0);
+        isotp_buffer_release(&sched_server[i]);
+        sched_client[i].Buffer = NULL;
+    }
+    for(i = 0UL; i < bus.n; i ++)
+    {
+        bits += isotp_frame_bits(&bus.frame[i]);
+    }
+    /* everything after the burst went out at 250 kbit/s at most */
+    CHECK(now_ns - start >= (bits - txq.burst) * 4000u);
+}
+
+#define GW_MSGS         (8UL)
+
+/*
+ * Gateway between a tester on bus A and an ECU on bus B: a_in/a_out are
+ * the frames of bus A to and from the gateway, b_in/b_out those of bus B
+ */
+static struct isotp_gw_t gw;
+static struct isotp_t    tester, ecu;
+static struct wire_t     a_in, a_out, b_in, b_out;
+static U8                ecu_got[GW_MSGS][ISOTP_BUFFER_SIZE];
+static U32               ecu_len[GW_MSGS];
+static U32               ecu_count, ecu_failed;
+
+static ERROR_CODE tester_send(struct phy_msg_t *frame)
+{
+    return wire_put(&a_in, frame);
+}
+
+static ERROR_CODE gw_a_send(struct phy_msg_t *frame)
+{
+    return wire_put(&a_out, frame);
+}
+
+static ERROR_CODE gw_b_send(struct phy_msg_t *frame)
+{
+    return wire_put(&b_out, frame);
+}
+
+static ERROR_CODE ecu_send(struct phy_msg_t *frame)
+{
+    return wire_put(&b_in, frame);
+}
+
+/* the ECU keeps what it is sent and gives the buffer back */
+static void ecu_ind(struct isotp_t *msg, enum N_Result result)
+{
+    if(result != N_OK)
+    {
+        ecu_failed ++;
+    }
+    else if(ecu_count < GW_MSGS)
+    {
+        memcpy(ecu_got[ecu_count], msg->Buffer, msg->DL);
+        ecu_len[ecu_count] = msg->DL;
+        ecu_count ++;
+    }
+    else
+    {}
+    isotp_buffer_release(msg);
+}
+
+static const struct isotp_service_t ecu_service = { NULL, NULL, ecu_ind, NULL };
+
+static U8 *ecu_refuse(struct isotp_t *msg, U32 length)
+{
+    (void)msg;
+    (void)length;
+
+    return NULL;
+}
+
+static void gw_deliver(struct wire_t *wire, U32 port)
+{
+    U32 i = 0UL;
+
+    for(i = 0UL; i < wire->n; i ++)
+    {
+        (void)isotp_gw_on_frame(&gw, port, &wire->frame[i]);
+    }
+    wire->n = 0UL;
+}
+
+static void gw_step(void)
+{
+    gw_deliver(&a_in, 0UL);
+    gw_deliver(&b_in, 1UL);
+    wire_deliver(&a_out, &tester);
+    wire_deliver(&b_out, &ecu);
+    (void)isotp_poll(&tester);
+    (void)isotp_poll(&ecu);
+    (void)isotp_gw_poll(&gw);
+}
+
+static Bool gw_idle(void)
+{
+    U32 i = 0UL;
+
+    for(i = 0UL; i < 2UL; i ++)
+    {
+        if(isotp_busy(gw.port[i].msg.tp_state) || isotp_busy(gw.port[i].rx.tp_state)
+            || gw.port[i].count > 0UL)
+        {
+            return FALSE;
+        }
+    }
+
+    return (isotp_busy(tester.tp_state) == FALSE && isotp_busy(ecu.tp_state) == FALSE
+            && a_in.n == 0UL && a_out.n == 0UL && b_in.n == 0UL && b_out.n == 0UL);
+}
+
+static void gw_run(void)
+{
+    U64 start = now_ns;
+
+    do
+    {
+        gw_step();
+        if(gw_idle() == TRUE)
+        {
+            break;
+        }
+        sim_advance(100UL);
+    } while(now_ns - start < 2000000000u);
+}
+
+static void gw_setup(void)
+{
+    wire_reset(&a_in);
+    wire_reset(&a_out);
+    wire_reset(&b_in);
+    wire_reset(&b_out);
+    memset(&gw, 0, sizeof(gw));
+    (void)isotp_init(&gw.port[0].msg, 0x7E0, 0x7E8, NULL, gw_a_send, NULL);
+    (void)isotp_init(&gw.port[1].msg, 0x708, 0x700, NULL, gw_b_send, NULL);
+    CHECK(isotp_gw_init(&gw) == STATUS_NORMAL);
+    (void)isotp_init(&tester, 0x7E8, 0x7E0, NULL, tester_send, NULL);
+    (void)isotp_init(&ecu, 0x700, 0x708, NULL, ecu_send, NULL);
+    (void)fc_set(&ecu, ISOTP_FS_CTS, 0u, 0u);
+    (void)isotp_set_service(&ecu, &ecu_service);
+    ecu_count  = 0UL;
+    ecu_failed = 0UL;
+}
+
+static void tester_request(U8 *data, U32 length)
+{
+    tester.Buffer = data;
+    tester.DL     = length;
+    CHECK(isotp_request(&tester) == STATUS_NORMAL);
+}
+
+/* the ECU is sent the message while it is still coming in */
+static void test_gw_cut_through(void)
+{
+    static U8 data[300];
+
+    fill(data, sizeof(data), 61u);
+    gw_setup();
+    tester_request(data, sizeof(data));
+    gw_step();
+    /* FF in, FC out: 6 bytes are not enough to build the FF of bus B */
+    CHECK(gw.port[0].put == 6UL && gw.port[0].tx_active == FALSE);
+    CHECK(tester.tp_state != ISOTP_WAIT_FIRST_FC && ecu.tp_state == ISOTP_IDLE);
+    gw_step();
+    /* the first CF: the outbound FF goes with 13 of 300 bytes in */
+    CHECK(gw.port[0].rx.tp_state == ISOTP_WAIT_DATA && gw.port[0].put < sizeof(data));
+    CHECK(gw.port[0].tx_active == TRUE && ecu.tp_state == ISOTP_WAIT_DATA);
+    gw_run();
+    CHECK(tester.reply == N_OK && ecu_count == 1UL && ecu_failed == 0UL);
+    CHECK(ecu_len[0] == sizeof(data) && memcmp(ecu_got[0], data, sizeof(data)) == 0);
+    CHECK(gw.port[0].routed == 1UL && gw.port[0].dropped == 0UL);
+    tester.Buffer = NULL;
+}
+
+/*
+ * The tester stops once the ECU is being sent the message: what came in
+ * goes on, then the outbound message is aborted; the next one is routed
+ */
+static void test_gw_inbound_abort(void)
+{
+    static U8 data[300];
+    U32       i = 0UL;
+
+    fill(data, sizeof(data), 67u);
+    gw_setup();
+    tester_request(data, sizeof(data));
+    for(i = 0UL; i < 3UL; i ++)
+    {
+        gw_step();
+    }
+    CHECK(gw.port[0].tx_active == TRUE);
+    /* the rest of the tester's CFs are lost */
+    (void)isotp_init(&tester, 0x7E8, 0x7E0, NULL, tester_send, NULL);
+    a_in.n = 0UL;
+    gw_run();
+    CHECK(gw.port[0].rx.reply == N_TIMEOUT_Cx);
+    CHECK(gw.port[1].msg.tp_state == ISOTP_ERROR);
+    CHECK(gw.port[0].routed == 0UL && gw.port[0].dropped == 1UL);
+    CHECK(ecu_count == 0UL && ecu_failed == 1UL);
+
+    tester_request(data, 50UL);
+    gw_run();
+    CHECK(gw.port[0].routed == 1UL && ecu_count == 1UL);
+    CHECK(ecu_len[0] == 50UL && memcmp(ecu_got[0], data, 50UL) == 0);
+    tester.Buffer = NULL;
+}
+
+/* the ECU refuses the message: the gateway refuses the rest of it too */
+static void test_gw_outbound_fail(void)
+{
+    static U8 data[300];
+
+    fill(data, sizeof(data), 71u);
+    gw_setup();
+    (void)isotp_set_rx_buffer_cb(&ecu, ecu_refuse);
+    tester_request(data, sizeof(data));
+    gw_run();
+    CHECK(gw.port[1].msg.reply == N_BUFFER_OVFLW);
+    CHECK(gw.port[0].rx.tp_state == ISOTP_ERROR && gw.port[0].rx.reply == N_ERROR);
+    CHECK(gw.port[0].routed == 0UL && gw.port[0].dropped == 1UL);
+    CHECK(gw.port[0].count == 0UL && gw.port[0].put == gw.port[0].done);
+    CHECK(ecu_count == 0UL);
+
+    (void)isotp_set_rx_buffer_cb(&ecu, NULL);
+    tester_request(data, sizeof(data));
+    gw_run();
+    CHECK(tester.reply == N_OK && ecu_count == 1UL);
+    CHECK(memcmp(ecu_got[0], data, sizeof(data)) == 0);
+    tester.Buffer = NULL;
+}
+
+/* the peer profile holds the message back, it is sent on once it lets it go */
+static void test_gw_peer_hold(void)
+{
+    static struct isotp_peer_t peer;
+    static U8                  data[5];
+    U32                        i = 0UL;
+
+    fill(data, sizeof(data), 83u);
+    gw_setup();
+    isotp_peer_init(&peer);
+    CHECK(isotp_set_peer(&gw.port[1].msg, &peer) == STATUS_NORMAL);
+    peer.ovflw_len = 1UL;
+    peer.retry     = 1000UL;
+    timer_add(&peer.refused);
+    tester_request(data, sizeof(data));
+    for(i = 0UL; i < 5UL; i ++)
+    {
+        gw_step();
+        sim_advance(100UL);
+    }
+    CHECK(gw.port[0].tx_active == FALSE && gw.port[0].count == 1UL);
+    CHECK(gw.port[0].routed == 0UL && gw.port[0].dropped == 0UL);
+    CHECK(ecu_count == 0UL);
+
+    sim_advance(1000UL);
+    gw_run();
+    CHECK(gw.port[0].routed == 1UL && gw.port[0].dropped == 0UL);
+    CHECK(ecu_count == 1UL && ecu_len[0] == sizeof(data));
+    CHECK(memcmp(ecu_got[0], data, sizeof(data)) == 0);
+    (void)isotp_set_peer(&gw.port[1].msg, NULL);
+    tester.Buffer = NULL;
+}
+
+/*
+ * While the ECU holds the first message, ISOTP_GW_QUEUE messages are
+ * kept and the next one is dropped; the kept ones go on in order
+ */
+static void test_gw_queue_full(void)
+{
+    static U8 data[300];
+    static U8 sf[ISOTP_GW_QUEUE + 1UL][4];
+    U32       i = 0UL;
+
+    fill(data, sizeof(data), 73u);
+    gw_setup();
+    tester_request(data, sizeof(data));
+    /* the ECU is not given the frames of bus B for now */
+    while(tester.tp_state != ISOTP_IDLE)
+    {
+        gw_deliver(&a_in, 0UL);
+        wire_deliver(&a_out, &tester);
+        (void)isotp_poll(&tester);
+        (void)isotp_gw_poll(&gw);
+        sim_advance(100UL);
+    }
+    for(i = 0UL; i < ISOTP_GW_QUEUE; i ++)
+    {
+        fill(sf[i], sizeof(sf[i]), (U8)(80u + i));
+        tester_request(sf[i], sizeof(sf[i]));
+        gw_deliver(&a_in, 0UL);
+        (void)isotp_gw_poll(&gw);
+    }
+    CHECK(gw.port[0].count == ISOTP_GW_QUEUE && gw.port[0].dropped == 1UL);
+    CHECK(gw.port[0].length[gw.port[0].head] == sizeof(data));
+
+    gw_run();
+    CHECK(gw.port[0].routed == ISOTP_GW_QUEUE && ecu_count == ISOTP_GW_QUEUE);
+    CHECK(ecu_len[0] == sizeof(data) && memcmp(ecu_got[0], data, sizeof(data)) == 0);
+    for(i = 1UL; i < ISOTP_GW_QUEUE; i ++)
+    {
+        CHECK(ecu_len[i] == sizeof(sf[i - 1UL]) && memcmp(ecu_got[i], sf[i - 1UL], sizeof(sf[0])) == 0);
+    }
+    tester.Buffer = NULL;
+}
+
+/* messages beyond ISOTP_GW_SIZE bytes in all wrap around the buffer */
+static void test_gw_wrap(void)
+{
+    static U8 data[3][ISOTP_BUFFER_SIZE];
+    static const U32 len[3] = { 1000UL, 4000UL, 3500UL };
+    U32       i = 0UL;
+
+    gw_setup();
+    for(i = 0UL; i < 3UL; i ++)
+    {
+        fill(data[i], len[i], (U8)(90u + i));
+        tester_request(data[i], len[i]);
+        gw_run();
+        CHECK(tester.reply == N_OK && ecu_count == i + 1UL);
+        CHECK(ecu_len[i] == len[i] && memcmp(ecu_got[i], data[i], len[i]) == 0);
+    }
+    CHECK(gw.port[0].put == 8500UL && gw.port[0].done == 8500UL);
+    CHECK(gw.port[0].routed == 3UL && gw.port[0].dropped == 0UL);
+    tester.Buffer = NULL;
+}
+
+int main(void)
+{
+    (void)timer_init_ns(sim_tick_ns, 1000u);
+    timer_set_sleep(sim_sleep_us);
+
+    test_request_length();
+    test_round_trip();
+    test_send_wait_sleeps();
+    test_receive_sleeps();
+    test_fd_encoding();
+    test_ff_dl_escape();
+    test_rx_buffer_held();
+    test_wheel_cascade();
+    test_wheel_wrap();
+    test_n_as_driver_time();
+    test_legacy_tick_threads();
+    test_ring_threads();
+    test_batch_rewind();
+    test_rx_batch();
+    test_service();
+    test_rx_stream();
+    test_fc_sides();
+    test_fc_refused();
+    test_peer_pacing();
+    test_sched_interleave();
+    test_txq();
+    test_sched_txq();
+    test_receive_txq();
+    test_gw_cut_through();
+    test_gw_inbound_abort();
+    test_gw_outbound_fail();
+    test_gw_peer_hold();
+    test_gw_queue_full();
+    test_gw_wrap();
+    test_engine();
+    test_engine_capacity();
+
+    printf("%lu checks, %lu failed\r\n", (unsigned long)checked, (unsigned long)failed);
+
+    return (failed == 0UL) ? 0 : 1;
+}
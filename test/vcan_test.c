@@ -0,0 +1,174 @@
+/*
+ * End to end throughput over SocketCAN, e.g. on a virtual bus:
+ *
+ *   ip link add dev vcan0 type vcan
+ *   ip link set vcan0 mtu 72 up        (mtu 72 for CAN FD)
+ *   ./isotp-vcan-pc vcan0 [fd]
+ *
+ * the client and the server have a socket each on the same interface
+ */
+#include "isotp.h"
+#include "isotp_table.h"
+#include "isotp_socketcan.h"
+#include "isotp_reactor.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "comm_typedef.h"
+
+#define CLIENT_ADDRESS  0x766
+#define SERVER_ADDRESS  0x706
+
+#define TEST_MSG_NUM    (200UL)
+#define TEST_MSG_LEN    (ISOTP_FF_DL)
+
+static struct isotp_t           client, server;
+static struct isotp_table_t     client_table, server_table;
+static struct isotp_socketcan_t client_can, server_can;
+static struct isotp_reactor_t   reactor;
+/* results of the message in flight, given by the service callbacks */
+static Bool                     client_done, server_done;
+static enum N_Result            client_result, server_result;
+
+static void client_con(struct isotp_t *msg, enum N_Result result)
+{
+    (void)msg;
+    client_done   = TRUE;
+    client_result = result;
+}
+
+static void server_ind(struct isotp_t *msg, enum N_Result result)
+{
+    (void)msg;
+    server_done   = TRUE;
+    server_result = result;
+}
+
+static const struct isotp_service_t client_service = { client_con, NULL, NULL, NULL };
+static const struct isotp_service_t server_service = { NULL, NULL, server_ind, NULL };
+
+static ERROR_CODE client_send(struct phy_msg_t *msg)
+{
+    U32 sent = 0UL;
+
+    return isotp_socketcan_send(&client_can, msg, 1UL, &sent);
+}
+
+static ERROR_CODE client_send_batch(struct phy_msg_t *msg, U32 count, U32 *sent)
+{
+    return isotp_socketcan_send(&client_can, msg, count, sent);
+}
+
+static ERROR_CODE server_send(struct phy_msg_t *msg)
+{
+    U32 sent = 0UL;
+
+    return isotp_socketcan_send(&server_can, msg, 1UL, &sent);
+}
+
+static U64 port_platformTickNs(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+
+    return (U64)ts.tv_sec * 1000000000u + (U64)ts.tv_nsec;
+}
+
+int main(int argc, char *argv[])
+{
+    const char *ifname = (argc > 1) ? argv[1] : "vcan0";
+    Bool        canfd  = (argc > 2 && strcmp(argv[2], "fd") == 0) ? TRUE : FALSE;
+    U64         start  = 0u;
+    U64         stop   = 0u;
+    U64         bus_first = 0u;
+    U32         count  = 0UL;
+    U32         index  = 0UL;
+    U32         errors = 0UL;
+
+    timer_init_ns(port_platformTickNs, 1000u);
+
+    if(isotp_socketcan_open(&client_can, ifname, canfd) != STATUS_NORMAL
+        || isotp_socketcan_open(&server_can, ifname, canfd) != STATUS_NORMAL)
+    {
+        printf("can't open %s\r\n", ifname);
+        return 1;
+    }
+
+    /* frames are pushed in by isotp_socketcan_dispatch(), no receive function */
+    isotp_init(&client, CLIENT_ADDRESS, SERVER_ADDRESS, NULL, client_send, NULL);
+    isotp_init(&server, SERVER_ADDRESS, CLIENT_ADDRESS, NULL, server_send, NULL);
+    isotp_set_tx_batch(&client, client_send_batch);
+    isotp_set_tx_dl(&client, (canfd == TRUE) ? CANFD_DATA_LEN : FRAME_DATA_LEN);
+    /* no FC between blocks and no separation time: line rate */
+    fc_set(&server, ISOTP_FS_CTS, 0u, 0u);
+    isotp_set_service(&client, &client_service);
+    isotp_set_service(&server, &server_service);
+
+    isotp_table_init(&client_table);
+    isotp_table_init(&server_table);
+    isotp_table_add(&client_table, &client);
+    isotp_table_add(&server_table, &server);
+    isotp_socketcan_filter(&client_can, &client_table);
+    isotp_socketcan_filter(&server_can, &server_table);
+
+    /* one thread sleeps on both sockets and the deadlines of both sessions */
+    isotp_reactor_init(&reactor);
+    isotp_reactor_add_can(&reactor, &client_can, &client_table);
+    isotp_reactor_add_can(&reactor, &server_can, &server_table);
+    isotp_reactor_add_session(&reactor, &client);
+    isotp_reactor_add_session(&reactor, &server);
+
+    start = port_platformTickNs();
+    for(count = 0UL; count < TEST_MSG_NUM; count ++)
+    {
+        client.DL = TEST_MSG_LEN;
+        isotp_buffer_alloc(&client, client.DL);
+        for(index = 0UL; index < client.DL; index ++)
+        {
+            client.Buffer[index] = (U8)(index + count);
+        }
+        client_done = FALSE;
+        server_done = FALSE;
+        isotp_request(&client);
+
+        /* a failed transmission is not received */
+        while((client_done == FALSE || server_done == FALSE)
+            && (client_done == FALSE || client_result == N_OK))
+        {
+            isotp_reactor_run_once(&reactor, U32_INVALID_VALUE);
+            if(bus_first == 0u)
+            {
+                bus_first = server_can.rx_timestamp;
+            }
+        }
+
+        if(client_result != N_OK || server_done == FALSE || server_result != N_OK
+            || server.DL != TEST_MSG_LEN
+            || memcmp(client.Buffer, server.rx_buf, TEST_MSG_LEN) != 0)
+        {
+            errors ++;
+            printf("message %u failed, reply %d/%d\r\n", count, client.reply, server.reply);
+        }
+        isotp_buffer_release(&server);
+        isotp_buffer_release(&client);
+    }
+    stop = port_platformTickNs();
+
+    printf("%u messages of %u bytes on %s (%s), %u errors\r\n",
+           count, (U32)TEST_MSG_LEN, ifname, (canfd == TRUE) ? "CAN FD" : "CAN", errors);
+    printf("wall clock: %.1f kB/s\r\n",
+           (double)count * TEST_MSG_LEN * 1e6 / (double)(stop - start));
+    if(server_can.rx_timestamp > bus_first)
+    {
+        printf("kernel timestamps: %.1f kB/s\r\n",
+               (double)count * TEST_MSG_LEN * 1e6 / (double)(server_can.rx_timestamp - bus_first));
+    }
+
+    isotp_reactor_close(&reactor);
+    isotp_socketcan_close(&client_can);
+    isotp_socketcan_close(&server_can);
+
+    return (errors == 0UL) ? 0 : 1;
+}